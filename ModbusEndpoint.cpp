@@ -7,24 +7,80 @@
 #include "config.h"
 #include "bsp_functions.h"
 #include "mb.h"
+#include "pulse_counter.h"
+#include "vsense.h"
+#include "scheduler.h"
+#include "nvconfig.h"
+#include "boot.h"
+#include "usb_cdc.h"
+#include "mb_master.h"
+#include "logic.h"
+#include "history.h"
+#include "image.h"
+
+#define CLI_POLL_INTERVAL_US 100000 // backstop for the USB chars-available trigger
 
 uint8_t mb_address = 0;
 
+static void modbus_task()
+{
+	mb_process();
+	sched_post(SCHED_TASK_OUTPUTS); // coils may have been written
+}
+
+static void cli_task()
+{
+	static bool s_started = false;
+	if (!s_started)
+	{
+		// USB comes up from the scheduler, once the bus is already being served
+		usb_init();
+		cli_init();
+		boot_mark("usb");
+		s_started = true;
+		return;
+	}
+	cli_process();
+}
+
 int main() {
-	stdio_init_all(); 
-	
+	boot_mark("main");
+	sched_init();
 	bsp_setup_pins();
+	boot_mark("pins");
+	nvconfig_init();
+	boot_mark("config");
 	
-	mb_address = get_address_byte();
-	printf("Address: 0x%02x\r\n", mb_address);
-	mb_init(mb_address);
-	cli_init();
-	while (1) {
-		cli_process();
-		update_inputs();
-		mb_process();
-		update_outputs();
-		light_update();
-	}
+	const nvconfig_t *config = nvconfig_get();
+	mb_address = config->address ? config->address : get_address_byte();
+	mb_init(mb_address, config->baud, (uart_parity_t)config->parity, config->framing);
+	nvconfig_apply();
+	boot_mark("modbus");
+	pulse_counter_init();
+	vsense_init();
+	boot_mark("io");
+	
+	//             task                 name        function              period                     prio  budget us
+	sched_add_task(SCHED_TASK_MODBUS,   "modbus",   modbus_task,          0,                         0,    300);
+	sched_add_task(SCHED_TASK_OUTPUTS,  "outputs",  update_outputs,       0,                         1,    50);
+	sched_add_task(SCHED_TASK_INPUTS,   "inputs",   update_inputs,        0,                         1,    50);
+	sched_add_task(SCHED_TASK_PULSE,    "pulse",    pulse_counter_update, PULSE_UPDATE_INTERVAL_US,  2,    100);
+	sched_add_task(SCHED_TASK_VSENSE,   "vsense",   vsense_update,        VSENSE_UPDATE_INTERVAL_US, 2,    200);
+	sched_add_task(SCHED_TASK_LED,      "led",      light_update,         0,                         3,    50);
+	sched_add_task(SCHED_TASK_CLI,      "cli",      cli_task,             CLI_POLL_INTERVAL_US,      4,    500);
+	sched_add_task(SCHED_TASK_NVCONFIG, "nvconfig", nvconfig_task,        0,                         5,    2000);
+	sched_add_task(SCHED_TASK_USB,      "usb",      usb_task,             USB_TASK_INTERVAL_US,      1,    500);
+	sched_add_task(SCHED_TASK_LOGIC,    "logic",    logic_task,           0,                         1,    100);
+	sched_add_task(SCHED_TASK_HISTORY,  "history",  history_task,         HISTORY_SAMPLE_US,         5,    2000);
+	sched_add_task(SCHED_TASK_IMAGE,    "image",    image_task,           0,                         5,    2000);
+	#if MB_MASTER
+		sched_add_task(SCHED_TASK_MASTER,   "master",   mb_master_task,       0,                         0,    300);
+		mb_master_init();
+	#endif
+	logic_init();
+	history_init();
+	image_init();
+	sched_post(SCHED_TASK_CLI);
+	boot_mark("sched");
+	sched_run();
 }
-
@@ -0,0 +1,52 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "boot.h"
+#include "pico/stdlib.h"
+#include "hardware/watchdog.h"
+#include "mb.h"
+
+// The timer is reset by the runtime init before main(), so these times start
+// there and miss the boot ROM, flash second stage and bootloader (a few ms
+// without an update to swap in).
+typedef struct
+{
+	const char *name;
+	uint64_t us;
+} boot_stage_t;
+
+static boot_stage_t s_stages[BOOT_MAX_STAGES];
+static uint8_t s_stage_count = 0;
+
+void boot_mark(const char *stage)
+{
+	if (s_stage_count < BOOT_MAX_STAGES)
+	{
+		s_stages[s_stage_count].name = stage;
+		s_stages[s_stage_count].us = time_us_64();
+		s_stage_count++;
+	}
+}
+
+void boot_print()
+{
+	printf("** BOOT TRACE **\r\n");
+	printf("RESET CAUSE\t= %s\r\n", watchdog_caused_reboot() ? "WATCHDOG" : "POWER/RUN PIN");
+	printf("STAGE\t\tDONE us\t\tTOOK us\r\n");
+	uint64_t previous_us = 0;
+	for (uint8_t i = 0; i < s_stage_count; i++)
+	{
+		printf("%-8s\t%-8lu\t%lu\r\n", s_stages[i].name, (uint32_t)s_stages[i].us, (uint32_t)(s_stages[i].us - previous_us));
+		previous_us = s_stages[i].us;
+	}
+	
+	uint64_t first_reply_us = mb_first_reply_us();
+	if (first_reply_us)
+	{
+		printf("FIRST REPLY\t= %lu us after reset\r\n", (uint32_t)first_reply_us);
+	}
+	else
+	{
+		printf("FIRST REPLY\t= NONE YET\r\n");
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+#define BOOT_MAX_STAGES 12
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	
+	// Records time_us_64() for an init stage. Only the pointer is kept, so
+	// the name must be a string literal.
+	void boot_mark(const char *stage);
+	
+	void boot_print();
+
+#ifdef __cplusplus
+}
+#endif
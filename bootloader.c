@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "bootloader.h"
+#include "image.h"
+#include "flash_io.h"
+#include "pico/stdlib.h"
+#include "pico/bootrom.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "hardware/watchdog.h"
+#include "hardware/structs/scb.h"
+#include "hardware/regs/m0plus.h"
+
+// Separate executable at the start of flash, see bootloader.h. Runs before
+// every application start: nothing to do costs a scan of the boot log.
+
+static uint8_t s_sector[FLASH_SECTOR_SIZE];
+
+static const uint8_t *bootloader_flash(uint32_t offset)
+{
+	return (const uint8_t *)(XIP_BASE + offset);
+}
+
+static void bootloader_copy(uint32_t from, uint32_t to)
+{
+	memcpy(s_sector, bootloader_flash(from), FLASH_SECTOR_SIZE);
+	flash_io_erase(to, FLASH_SECTOR_SIZE);
+	for (uint32_t page = 0; page < FLASH_SECTOR_SIZE; page += FLASH_PAGE_SIZE)
+	{
+		const uint32_t *word = (const uint32_t *)(s_sector + page);
+		bool blank = true;
+		for (uint8_t i = 0; blank && i < FLASH_PAGE_SIZE / sizeof(uint32_t); i++)
+		{
+			blank = word[i] == 0xFFFFFFFF;
+		}
+		if (!blank)
+		{
+			flash_io_program(to + page, s_sector + page, FLASH_PAGE_SIZE);
+		}
+	}
+}
+
+// Swaps the first sectors of the application and the image slot, carrying on
+// from the last step logged. Every step only overwrites a copy the log shows
+// is safe elsewhere, so it can be repeated after a power cut.
+static void bootloader_swap(uint8_t sectors, uint32_t last)
+{
+	uint8_t sector = 0;
+	uint8_t step = BOOTLOG_SCRATCH;
+	switch (BOOTLOG_EVENT(last))
+	{
+	case BOOTLOG_SCRATCH:
+		sector = BOOTLOG_ARGUMENT(last);
+		step = BOOTLOG_SAVED;
+		break;
+	case BOOTLOG_SAVED:
+		sector = BOOTLOG_ARGUMENT(last);
+		step = BOOTLOG_SWAPPED;
+		break;
+	case BOOTLOG_SWAPPED:
+		sector = BOOTLOG_ARGUMENT(last) + 1;
+		break;
+	}
+
+	for (; sector < sectors; sector++, step = BOOTLOG_SCRATCH)
+	{
+		uint32_t app = BOOTLOADER_APP_OFFSET + sector * FLASH_SECTOR_SIZE;
+		uint32_t slot = IMAGE_FLASH_OFFSET + sector * FLASH_SECTOR_SIZE;
+		if (step == BOOTLOG_SCRATCH)
+		{
+			if (memcmp(bootloader_flash(app), bootloader_flash(slot), FLASH_SECTOR_SIZE) == 0)
+			{
+				continue; // nothing to swap, checked again if a power cut lands here
+			}
+			bootloader_copy(slot, BOOTLOADER_SCRATCH_OFFSET);
+			bootlog_append(BOOTLOG_ENTRY(BOOTLOG_SCRATCH, sector));
+			step = BOOTLOG_SAVED;
+		}
+		if (step == BOOTLOG_SAVED)
+		{
+			bootloader_copy(app, slot);
+			bootlog_append(BOOTLOG_ENTRY(BOOTLOG_SAVED, sector));
+		}
+		bootloader_copy(BOOTLOADER_SCRATCH_OFFSET, app);
+		bootlog_append(BOOTLOG_ENTRY(BOOTLOG_SWAPPED, sector));
+	}
+}
+
+static void bootloader_start_app()
+{
+	const uint32_t *vectors = (const uint32_t *)(XIP_BASE + BOOTLOADER_APP_OFFSET + BOOTLOADER_APP_VECTORS);
+	if (vectors[0] < SRAM_BASE || vectors[0] > SRAM_END
+		|| vectors[1] < XIP_BASE + BOOTLOADER_APP_OFFSET || vectors[1] >= XIP_BASE + IMAGE_FLASH_OFFSET)
+	{
+		reset_usb_boot(0, 0); // no application, wait to be programmed over USB
+	}
+
+	// Nothing here uses interrupts, but the application starts with none pending
+	*(io_rw_32 *)(PPB_BASE + M0PLUS_NVIC_ICER_OFFSET) = 0xFFFFFFFF;
+	*(io_rw_32 *)(PPB_BASE + M0PLUS_NVIC_ICPR_OFFSET) = 0xFFFFFFFF;
+	scb_hw->vtor = (uintptr_t)vectors;
+	__asm volatile (
+		"msr msp, %0\n"
+		"bx %1\n"
+		:
+		: "r" (vectors[0]), "r" (vectors[1])
+	);
+	__builtin_unreachable();
+}
+
+int main()
+{
+	uint32_t last = bootlog_last();
+	uint8_t sectors = BOOTLOG_ARGUMENT(bootlog_first());
+	bool trial = false;
+
+	switch (BOOTLOG_EVENT(last))
+	{
+	case BOOTLOG_TRIAL:
+		// The trial reset before confirming: crashed, hung or lost power
+		last = BOOTLOG_ENTRY(BOOTLOG_REVERTING, sectors);
+		bootlog_append(last);
+		// fall through
+	case BOOTLOG_PENDING:
+	case BOOTLOG_SCRATCH:
+	case BOOTLOG_SAVED:
+	case BOOTLOG_SWAPPED:
+	case BOOTLOG_REVERTING:
+		bootloader_swap(sectors, last);
+		if (bootlog_contains(BOOTLOG_REVERTING))
+		{
+			bootlog_append(BOOTLOG_ENTRY(BOOTLOG_REVERTED, sectors));
+		}
+		else
+		{
+			bootlog_append(BOOTLOG_ENTRY(BOOTLOG_TRIAL, sectors));
+			trial = true;
+		}
+		break;
+	}
+
+	if (trial)
+	{
+		// The application takes over feeding it, see image.c
+		watchdog_enable(BOOTLOADER_WATCHDOG_MS, true);
+	}
+	bootloader_start_app();
+}
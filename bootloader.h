@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+// Flash layout from the start: the bootloader (its own executable, flash
+// second stage included), a scratch sector and the boot log, then the
+// application. Keep BOOTLOADER_SIZE in step with the link addresses in
+// CMakeLists.txt.
+//
+// An update is staged in the image slot (image.h) while the application runs.
+// On activation the bootloader swaps the application sectors with the slot
+// one at a time through the scratch sector, logging each step, so a power cut
+// anywhere resumes where it stopped. The new application then runs on trial
+// under the watchdog. If the board resets before the application confirms
+// itself, the bootloader swaps back, so the old application (which the swap
+// left in the slot) runs again.
+#define BOOTLOADER_SIZE (32 * 1024)
+#define BOOTLOADER_SCRATCH_OFFSET (BOOTLOADER_SIZE - 2 * FLASH_SECTOR_SIZE)
+#define BOOTLOADER_LOG_OFFSET (BOOTLOADER_SIZE - FLASH_SECTOR_SIZE)
+#define BOOTLOADER_APP_OFFSET BOOTLOADER_SIZE
+#define BOOTLOADER_APP_VECTORS 0x100 // the application keeps its own second stage in front of its vector table
+#define BOOTLOADER_WATCHDOG_MS 4000 // trial runs reset if not fed for this long
+
+// Boot log: one 32-bit entry per step, programmed in place without erasing,
+// event << 24 | argument << 16 | check. The check is the low 16 bits of
+// ~(event << 8 | argument), so erased and torn words never pass. Activation
+// erases the log and starts it with BOOTLOG_PENDING.
+#define BOOTLOG_ENTRIES (FLASH_SECTOR_SIZE / sizeof(uint32_t))
+#define BOOTLOG_ENTRY(event, argument) \
+	((uint32_t)(event) << 24 | (uint32_t)(argument) << 16 | (~((event) << 8 | (argument)) & 0xFFFF))
+#define BOOTLOG_EVENT(entry) ((entry) >> 24)
+#define BOOTLOG_ARGUMENT(entry) (((entry) >> 16) & 0xFF)
+
+enum BOOTLOG_EVENTS
+{
+	BOOTLOG_NONE, // empty log, nothing has been activated
+	BOOTLOG_PENDING, // argument: sectors to swap, written by the application
+	BOOTLOG_SCRATCH, // argument: sector, slot copy saved in the scratch sector
+	BOOTLOG_SAVED, // argument: sector, application copy moved to the slot
+	BOOTLOG_SWAPPED, // argument: sector, scratch copy moved to the application
+	BOOTLOG_TRIAL, // swap done, the new application is on trial
+	BOOTLOG_CONFIRMED, // written by the new application, the update stays
+	BOOTLOG_REVERTING, // the trial reset unconfirmed, swapping back
+	BOOTLOG_REVERTED // the old application is back
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// Last entry that passes its check, 0 (BOOTLOG_NONE) if there is none
+	uint32_t bootlog_last();
+
+	// First entry, which holds the sector count once activated
+	uint32_t bootlog_first();
+
+	bool bootlog_contains(uint8_t event);
+
+	// Erases the log and writes entry as its first. Interrupts are held off
+	// for the erase (about 45 ms), the caller waits for a quiet bus.
+	void bootlog_start(uint32_t entry);
+
+	// Interrupts are held off for one page program
+	bool bootlog_append(uint32_t entry);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "bootloader.h"
+#include "flash_io.h"
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+// Shared by the bootloader and the application
+
+static const uint32_t *bootlog_entries()
+{
+	return (const uint32_t *)(XIP_BASE + BOOTLOADER_LOG_OFFSET);
+}
+
+static bool bootlog_valid(uint32_t entry)
+{
+	return entry == BOOTLOG_ENTRY(BOOTLOG_EVENT(entry), BOOTLOG_ARGUMENT(entry));
+}
+
+// Index of the first erased word, where the next entry goes
+static uint16_t bootlog_end()
+{
+	const uint32_t *entries = bootlog_entries();
+	uint16_t end = 0;
+	while (end < BOOTLOG_ENTRIES && entries[end] != 0xFFFFFFFF)
+	{
+		end++;
+	}
+	return end;
+}
+
+uint32_t bootlog_last()
+{
+	const uint32_t *entries = bootlog_entries();
+	for (uint16_t i = bootlog_end(); i > 0; i--)
+	{
+		if (bootlog_valid(entries[i - 1]))
+		{
+			return entries[i - 1]; // skips a word torn by a power cut
+		}
+	}
+	return BOOTLOG_NONE;
+}
+
+uint32_t bootlog_first()
+{
+	uint32_t entry = bootlog_entries()[0];
+	return bootlog_valid(entry) ? entry : BOOTLOG_NONE;
+}
+
+bool bootlog_contains(uint8_t event)
+{
+	const uint32_t *entries = bootlog_entries();
+	for (uint16_t i = 0; i < BOOTLOG_ENTRIES && entries[i] != 0xFFFFFFFF; i++)
+	{
+		if (bootlog_valid(entries[i]) && BOOTLOG_EVENT(entries[i]) == event)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static void bootlog_program(uint16_t index, uint32_t entry)
+{
+	// Erased bytes program as no change, so the page can take one word at a time
+	static uint8_t s_page[FLASH_PAGE_SIZE];
+	uint32_t offset = index * sizeof(uint32_t);
+	memset(s_page, 0xFF, sizeof(s_page));
+	memcpy(s_page + offset % FLASH_PAGE_SIZE, &entry, sizeof(entry));
+
+	flash_io_program(BOOTLOADER_LOG_OFFSET + offset - offset % FLASH_PAGE_SIZE, s_page, FLASH_PAGE_SIZE);
+}
+
+void bootlog_start(uint32_t entry)
+{
+	flash_io_erase(BOOTLOADER_LOG_OFFSET, FLASH_SECTOR_SIZE);
+	bootlog_program(0, entry);
+}
+
+bool bootlog_append(uint32_t entry)
+{
+	uint16_t end = bootlog_end();
+	if (end == BOOTLOG_ENTRIES)
+	{
+		return false; // a swap logs well under this between activations
+	}
+	bootlog_program(end, entry);
+	return true;
+}
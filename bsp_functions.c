@@ -6,6 +6,10 @@
 #include "pico/time.h"
 #include <stdio.h>
 #include "mb.h"
+#include "vsense.h"
+#include "scheduler.h"
+#include "logic.h"
+#include "history.h"
 
 static uint8_t s_input_state = 0;
 
@@ -19,6 +23,21 @@ static uint32_t s_bsp_counters[2] = { 0 };
 static int light_timer = 0;
 static uint64_t light_timer_next = 0;
 #define FLASHING_INTERVAL_US 250000
+#define FLASHING_TOGGLES 40
+
+// Pins each output channel drives; channels sharing a pin cannot run at once
+static const uint32_t s_output_pin_mask[NUM_OUTPUTS] =
+{
+	(1u << OUTPUT_1_PIN) | (1u << OUTPUT_2_PIN),
+	(1u << OUTPUT_2_PIN)
+};
+static uint32_t s_output_pins_busy = 0;
+static bool s_pulse_active[NUM_OUTPUTS] = { false };
+static uint64_t s_pulse_end_us[NUM_OUTPUTS] = { 0 };
+static uint16_t s_output_completed = 0;
+static uint8_t s_output_inhibit = 0;
+static uint16_t s_pulse_time_ms = PULSE_TIME_MS;
+static uint32_t s_input_sample_us = INPUT_SAMPLE_INTERVAL_US;
 
 enum BSP_COUNTERS
 {
@@ -26,6 +45,17 @@ enum BSP_COUNTERS
 	OUTPUT_2
 };
 
+static void output_status_publish()
+{
+	uint16_t status = 0;
+	for (uint8_t i = 0; i < NUM_OUTPUTS; i++)
+	{
+		status |= output_busy(i) ? (1 << i) : 0;
+	}
+	mb_set_input_register(MB_IR_OUTPUT_STATUS, status);
+	mb_set_input_register(MB_IR_OUTPUT_COMPLETED, s_output_completed);
+}
+
 void light_update()
 {
 	if (!light_enabled) { return; }
@@ -35,9 +65,39 @@ void light_update()
 		gpio_put(OUTPUT_2_PIN, !state);
 		light_timer++;
 		light_timer_next = time_us_64() + FLASHING_INTERVAL_US;
-		if (light_timer > 40 && state) { light_enabled = false; }	
+		if (light_timer > FLASHING_TOGGLES && state)
+		{
+			light_enabled = false;
+			s_output_pins_busy &= ~s_output_pin_mask[0];
+			s_output_completed++;
+			output_status_publish();
+		}
 	}
+	
+	if (light_enabled)
+	{
+		sched_post_at(SCHED_TASK_LED, light_timer_next);
+	}
+}
 
+static void input_edge_callback(uint gpio, uint32_t events)
+{
+	// One-shot: sampling takes over until the input settles, so a fast
+	// pulse train costs at most one wake per INPUT_SAMPLE_INTERVAL_US
+	gpio_set_irq_enabled(gpio, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, false);
+	sched_post(SCHED_TASK_INPUTS);
+}
+
+static void inputs_arm_irq()
+{
+	gpio_set_irq_enabled_with_callback(INPUT_1_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, input_edge_callback);
+	gpio_set_irq_enabled(INPUT_2_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
+	
+	// Arming clears latched edges, so catch a change that slipped in since the last sample
+	if (gpio_get(INPUT_1_PIN) != (bool)(s_input_state & 0x01) || gpio_get(INPUT_2_PIN) != (bool)(s_input_state & 0x02))
+	{
+		sched_post(SCHED_TASK_INPUTS);
+	}
 }
 
 void bsp_setup_pins()
@@ -58,6 +118,11 @@ void bsp_setup_pins()
 	
 	s_input_state |= gpio_get(INPUT_1_PIN) ? 0x01 : 0;
 	s_input_state |= gpio_get(INPUT_2_PIN) ? 0x02 : 0;
+	s_debounce[0] = (s_input_state & 0x01) ? 0xFF : 0x00;
+	s_debounce[1] = (s_input_state & 0x02) ? 0xFF : 0x00;
+	mb_set_discrete_input(0, s_input_state & 0x01);
+	mb_set_discrete_input(1, s_input_state & 0x02);
+	inputs_arm_irq();
 	
 	gpio_init(OUTPUT_1_PIN);
 	gpio_set_dir(OUTPUT_1_PIN, GPIO_OUT);
@@ -107,28 +172,83 @@ bool get_output(uint8_t channel)
 	return false;
 }
 
-void pulse_output(uint8_t channel)
+bool output_busy(uint8_t channel)
+{
+	return channel < NUM_OUTPUTS && (s_output_pins_busy & s_output_pin_mask[channel]);
+}
+
+void set_output_inhibit(uint8_t channel, bool on)
+{
+	s_output_inhibit = on ? s_output_inhibit | (1 << channel) : s_output_inhibit & ~(1 << channel);
+}
+
+bool output_inhibited(uint8_t channel)
+{
+	return channel < NUM_OUTPUTS && (s_output_inhibit & (1 << channel));
+}
+
+uint32_t output_run_time_ms(uint8_t channel)
+{
+	if (channel == 0)
+	{
+		return s_pulse_time_ms + (FLASHING_TOGGLES + 1) * (FLASHING_INTERVAL_US / 1000);
+	}
+	return s_pulse_time_ms;
+}
+
+void set_pulse_time_ms(uint16_t pulse_time_ms)
 {
-	#define PULSE_TIME_MS 100
+	s_pulse_time_ms = pulse_time_ms;
+}
+
+void set_input_sample_interval_us(uint32_t sample_us)
+{
+	s_input_sample_us = sample_us;
+}
+
+bool pulse_output(uint8_t channel)
+{
+	if (channel >= NUM_OUTPUTS || output_busy(channel) || output_inhibited(channel)) { return false; }
+	
 	if (channel == 0)
 	{
 		gpio_put(OUTPUT_1_PIN, true);
 		gpio_put(OUTPUT_2_PIN, true);
-		sleep_ms(PULSE_TIME_MS);
+	}
+	else if (channel == 1)
+	{
+		gpio_put(OUTPUT_2_PIN, true);
+	}
+	s_output_pins_busy |= s_output_pin_mask[channel];
+	s_pulse_active[channel] = true;
+	s_pulse_end_us[channel] = time_us_64() + s_pulse_time_ms * 1000;
+	sched_post_at(SCHED_TASK_OUTPUTS, s_pulse_end_us[channel]);
+	output_status_publish();
+	history_output(channel);
+	return true;
+}
+
+static void pulse_complete(uint8_t channel)
+{
+	s_pulse_active[channel] = false;
+	if (channel == 0)
+	{
+		// Output 2 stays on and hands over to the flashing sequence, which releases the channel
 		gpio_put(OUTPUT_1_PIN, false);
 		s_bsp_counters[OUTPUT_1]++;
 		light_timer = 0;
 		light_enabled = true;
 		light_timer_next = time_us_64() + FLASHING_INTERVAL_US;
-		//add_repeating_timer_ms(500, light_callback, NULL, &timer);
+		sched_post(SCHED_TASK_LED);
 	}
 	else if (channel == 1)
 	{
-		gpio_put(OUTPUT_2_PIN, true);
-		sleep_ms(PULSE_TIME_MS);
 		gpio_put(OUTPUT_2_PIN, false);
 		s_bsp_counters[OUTPUT_2]++;
+		s_output_pins_busy &= ~s_output_pin_mask[channel];
+		s_output_completed++;
 	}
+	output_status_publish();
 }
 
 bool get_input(uint8_t channel)
@@ -141,7 +261,10 @@ uint8_t get_address_byte()
 	return (uint8_t)((gpio_get_all() >> 16) & 0xFF);
 }
 
-float get_bus_voltage();
+float get_bus_voltage()
+{
+	return vsense_get_mv(VSENSE_12V) / 1000.0f;
+}
 
 bool input_changed()
 {
@@ -155,6 +278,8 @@ bool input_changed()
 
 void update_inputs()
 {
+	uint8_t previous = s_input_state;
+	
 	s_debounce[0] <<= 1;
 	s_debounce[0] |= gpio_get(INPUT_1_PIN);
 	
@@ -186,16 +311,54 @@ void update_inputs()
 		mb_set_discrete_input(1, false);
 		s_changed = true;
 	}
+	
+	if (s_input_state != previous)
+	{
+		for (uint8_t i = 0; i < NUM_INPUTS; i++)
+		{
+			if ((s_input_state ^ previous) & (1 << i))
+			{
+				history_input(i, s_input_state & (1 << i));
+			}
+		}
+		logic_input_changed();
+	}
+	
+	bool settled = (s_debounce[0] == 0x00 || s_debounce[0] == 0xFF) && (s_debounce[1] == 0x00 || s_debounce[1] == 0xFF);
+	if (settled)
+	{
+		inputs_arm_irq();
+	}
+	else
+	{
+		sched_post_at(SCHED_TASK_INPUTS, time_us_64() + s_input_sample_us);
+	}
 }
 
 void update_outputs()
 {
-	for (int i = 0; i < NUM_OUTPUTS; i++)
+	uint64_t now = time_us_64();
+	for (uint8_t i = 0; i < NUM_OUTPUTS; i++)
+	{
+		if (s_pulse_active[i])
+		{
+			if (now >= s_pulse_end_us[i])
+			{
+				pulse_complete(i);
+			}
+			else
+			{
+				sched_post_at(SCHED_TASK_OUTPUTS, s_pulse_end_us[i]);
+			}
+		}
+	}
+	
+	for (uint8_t i = 0; i < NUM_OUTPUTS; i++)
 	{
-		bool coil_value = mb_get_coil(i);
-		if (coil_value)
+		// The Modbus layer refuses coil writes while busy or inhibited, so a set coil is an
+		// accepted command; one set by the logic engine under an inhibit is dropped the same way
+		if (mb_get_coil(i) && (pulse_output(i) || output_inhibited(i)))
 		{
-			pulse_output(i);
 			mb_set_coil(i, false);
 		}
 	}
@@ -4,6 +4,9 @@
 #include <stdbool.h>
 
 #define NUM_OUTPUTS 2
+#define NUM_INPUTS 2
+#define INPUT_SAMPLE_INTERVAL_US 1000 // default debounce sample period, 8 samples per transition
+#define PULSE_TIME_MS 100 // default
 
 #ifdef __cplusplus
 extern "C" {
@@ -14,7 +17,20 @@ extern "C" {
 	bool get_LED_state();
 	void set_LED_state(bool state);
 
-	void pulse_output(uint8_t channel);
+	bool pulse_output(uint8_t channel);
+	
+	bool output_busy(uint8_t channel);
+	
+	// An inhibited output refuses to start, whether asked by a coil, the CLI or the logic engine
+	void set_output_inhibit(uint8_t channel, bool on);
+	
+	bool output_inhibited(uint8_t channel);
+	
+	uint32_t output_run_time_ms(uint8_t channel);
+	
+	void set_pulse_time_ms(uint16_t pulse_time_ms);
+	
+	void set_input_sample_interval_us(uint32_t sample_us);
 
 	bool get_input(uint8_t channel);
 
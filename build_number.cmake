@@ -49,6 +49,10 @@ IF(NOT HEADER_MACRO)
 	set(HEADER_MACRO "BUILD_NUMBER")
 ENDIF()
 
+IF(NOT HEADER_TIMESTAMP_MACRO)
+	set(HEADER_TIMESTAMP_MACRO "BUILD_TIMESTAMP")
+ENDIF()
+
 IF(NOT HEADER_GUARD)
 	set(HEADER_GUARD "CMAKE_BUILD_NUMBER_HEADER")
 endif()
@@ -81,8 +85,11 @@ ENDIF()
 #Update the cache
 file(WRITE ${CACHE_FILE} "${BUILD_NUMBER}")
 
+#Taken with the number, so a build number always names one time. Honours SOURCE_DATE_EPOCH.
+string(TIMESTAMP BUILD_TIMESTAMP "%Y-%m-%dT%H:%M:%SZ" UTC)
+
 #Create the header
-file(WRITE ${HEADER_FILE} "//This file is automatically generated by build_number.cmake\n\n#ifndef ${HEADER_GUARD}\n#define ${HEADER_GUARD}\n\n#define ${HEADER_MACRO} ${BUILD_NUMBER}\n\n#endif")
+file(WRITE ${HEADER_FILE} "//This file is automatically generated by build_number.cmake\n\n#ifndef ${HEADER_GUARD}\n#define ${HEADER_GUARD}\n\n#define ${HEADER_MACRO} ${BUILD_NUMBER}\n#define ${HEADER_TIMESTAMP_MACRO} \"${BUILD_TIMESTAMP}\"\n\n#endif")
 
 #Feedback
-message("Build number: ${BUILD_NUMBER}")
\ No newline at end of file
+message("Build number: ${BUILD_NUMBER} (${BUILD_TIMESTAMP})")
\ No newline at end of file
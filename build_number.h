@@ -4,5 +4,6 @@
 #define CMAKE_BUILD_NUMBER_HEADER
 
 #define BUILD_NUMBER 14
+#define BUILD_TIMESTAMP "2026-10-19T11:14:47Z"
 
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <ctype.h>
 #include "pico/stdlib.h"
 #include "cli.h"
+#include "scheduler.h"
 
 #define MAX_BUFFER_SIZE 80
 #define CMD_TERMINATOR '\r'
@@ -22,8 +23,8 @@ const char cli_unrecognized[] = "[Error] Command not recognized.";
 
 cli_status_t cli_process()
 {
-	int c = getchar_timeout_us(0);
-	if (c != PICO_ERROR_TIMEOUT)
+	int c;
+	while (!cmd_pending && (c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT)
 	{
 		cli_put(c);
 	}
@@ -97,14 +98,22 @@ cli_status_t cli_process()
 
 	printf((char*) cli_prompt); /* Print the CLI prompt to the user.             */
 	
+	sched_post(SCHED_TASK_CLI); /* Pick up anything typed ahead of this command. */
 	return ret;
 }
 
+static void cli_chars_available(void *param)
+{
+	sched_post(SCHED_TASK_CLI);
+}
+
 void cli_init()
 {
 	buffer_ptr = buffer;
 
 	cmd_pending = 0;
+	
+	stdio_set_chars_available_callback(cli_chars_available, NULL);
 
 	/* Print the CLI prompt. */
 	printf((char*) cli_prompt);
@@ -4,6 +4,7 @@
 extern "C" {
 #endif
 
+	#include <stdint.h>
 	#include "cli_defs.h"
 
 	cli_status_t cli_process();
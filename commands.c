@@ -10,6 +10,16 @@
 #include "build_number.h"
 #include "build_version.h"
 #include "mb.h"
+#include "pulse_counter.h"
+#include "vsense.h"
+#include "scheduler.h"
+#include "nvconfig.h"
+#include "boot.h"
+#include "mb_usb.h"
+#include "mb_master.h"
+#include "logic.h"
+#include "history.h"
+#include "image.h"
 
 static cli_status_t cli_cmd_led(int argc, char **argv);
 static cli_status_t cli_cmd_input(int argc, char **argv);
@@ -17,6 +27,16 @@ static cli_status_t cli_cmd_output(int argc, char **argv);
 static cli_status_t cli_cmd_id(int argc, char **argv);
 static cli_status_t cli_cmd_stats(int argc, char **argv);
 static cli_status_t cli_cmd_version(int argc, char **argv);
+static cli_status_t cli_cmd_tasks(int argc, char **argv);
+static cli_status_t cli_cmd_turnaround(int argc, char **argv);
+static cli_status_t cli_cmd_map(int argc, char **argv);
+static cli_status_t cli_cmd_config(int argc, char **argv);
+static cli_status_t cli_cmd_boot(int argc, char **argv);
+static cli_status_t cli_cmd_bus(int argc, char **argv);
+static cli_status_t cli_cmd_master(int argc, char **argv);
+static cli_status_t cli_cmd_logic(int argc, char **argv);
+static cli_status_t cli_cmd_history(int argc, char **argv);
+static cli_status_t cli_cmd_image(int argc, char **argv);
 
 
 cmd_t cmds[] =
@@ -29,12 +49,12 @@ cmd_t cmds[] =
 	{
 		.cmd = "inputs",
 		.func = cli_cmd_input,
-		.help = "(Returns the state of the discrete inputs)"
+		.help = "(Returns the state, pulse count and frequency of the discrete inputs)"
 	},
 	{
 		.cmd = "pulse",
 		.func = cli_cmd_output,
-		.help = "<output channel 1-2> (Pulses the selected output for 100ms)"
+		.help = "<output channel 1-2> (Pulses the selected output for the configured time, runs in the background)"
 	},
 	{
 		.cmd = "id",
@@ -50,6 +70,56 @@ cmd_t cmds[] =
 		.cmd = "version",
 		.func = cli_cmd_version,
 		.help = "(Returns the Build Versions & Number)"
+	},
+	{
+		.cmd = "tasks",
+		.func = cli_cmd_tasks,
+		.help = "[reset] (Returns scheduler timing, budgets and overruns per task)"
+	},
+	{
+		.cmd = "turnaround",
+		.func = cli_cmd_turnaround,
+		.help = "[reset | delay <us>] (Returns the ModBus reply turnaround distribution, sets the minimum response delay)"
+	},
+	{
+		.cmd = "map",
+		.func = cli_cmd_map,
+		.help = "[bench] (Returns the ModBus register blocks, times map lookups when built with MB_MAP_BENCHMARK)"
+	},
+	{
+		.cmd = "config",
+		.func = cli_cmd_config,
+		.help = "[<address/baud/parity/framing/delay/sample/pulse> <value> | save | defaults] (Returns or edits the stored configuration)"
+	},
+	{
+		.cmd = "boot",
+		.func = cli_cmd_boot,
+		.help = "(Returns the init stage timestamps and the reset to first reply time)"
+	},
+	{
+		.cmd = "bus",
+		.func = cli_cmd_bus,
+		.help = "(Returns bus utilisation, frame and error rates and master gaps over the last 1/10/60 s)"
+	},
+	{
+		.cmd = "master",
+		.func = cli_cmd_master,
+		.help = "[reset] (Returns the poll table results and polls per second against bus capacity in master mode)"
+	},
+	{
+		.cmd = "logic",
+		.func = cli_cmd_logic,
+		.help = "[reset | run | stop | save] (Returns the logic engine state and scan times, runs the staged program, stops or stores it)"
+	},
+	{
+		.cmd = "history",
+		.func = cli_cmd_history,
+		.help = "(Returns the event log extent, staged pages, bytes per event and flash writes)"
+	},
+	{
+		.cmd = "image",
+		.func = cli_cmd_image,
+		.help = "(Returns the staging slot transfer state, CRC, bytes per second and flash writes)"
 	}
 };
 
@@ -92,8 +162,12 @@ static cli_status_t cli_cmd_led(int argc, char **argv)
 
 static cli_status_t cli_cmd_input(int argc, char **argv)
 {
-	printf("[1] = %s\r\n", get_input(0) ? "TRUE" : "FALSE");
-	printf("[2] = %s\r\n", get_input(1) ? "TRUE" : "FALSE");
+	for (uint8_t i = 0; i < NUM_INPUTS; i++)
+	{
+		uint32_t frequency = pulse_counter_get_frequency_mhz(i);
+		printf("[%d] = %s\tCOUNT = %lu\tFREQ = %lu.%03lu Hz\r\n", i + 1, get_input(i) ? "TRUE" : "FALSE",
+			pulse_counter_get_count(i), frequency / 1000, frequency % 1000);
+	}
 	return CLI_OK;
 }
 
@@ -107,16 +181,20 @@ static cli_status_t cli_cmd_output(int argc, char **argv)
 	if (channel == 0 || channel > NUM_OUTPUTS) // Is valid 1 -> NUM_OUTPUTS
 		return CLI_E_INVALID_ARGS;
 
-	pulse_output(channel - 1);
+	if (!pulse_output(channel - 1))
+	{
+		puts("Output busy");
+	}
 	
 	return CLI_OK;
 }
 
 static cli_status_t cli_cmd_id(int argc, char **argv)
 {
-	uint8_t address = get_address_byte();
-	printf("Modbus Address: 0x%02x\r\n", address);
+	uint8_t address = nvconfig_get()->address ? nvconfig_get()->address : get_address_byte();
+	printf("Modbus Address: 0x%02x%s\r\n", address, nvconfig_get()->address ? " (configured)" : "");
 	mb_set_id(address);
+	mb_print_units();
 	return CLI_OK;
 }
 
@@ -124,12 +202,203 @@ static cli_status_t cli_cmd_stats(int argc, char **argv)
 {
 	mb_print_stats();
 	printf("\r\n");
+	mb_usb_print_stats();
+	printf("\r\n");
 	print_bsp_stats();
+	printf("\r\n");
+	vsense_print_stats();
 	return CLI_OK;
 }
 
 static cli_status_t cli_cmd_version(int argc, char **argv)
 {
 	printf("Build Information: %d.%d.%d\r\n", BUILD_VERSION_MAJOR, BUILD_VERSION_MINOR, BUILD_NUMBER);
+	return CLI_OK;
+}
+
+static cli_status_t cli_cmd_tasks(int argc, char **argv)
+{
+	if (argc == 2 && !strncmp(argv[1], "reset", 5))
+	{
+		sched_reset_stats();
+		puts("Scheduler statistics cleared");
+		return CLI_OK;
+	}
+	
+	if (argc != 1)
+		return CLI_E_INVALID_ARGS;
+	
+	sched_print_stats();
+	return CLI_OK;
+}
+
+
+static cli_status_t cli_cmd_turnaround(int argc, char **argv)
+{
+	if (argc == 2 && !strncmp(argv[1], "reset", 5))
+	{
+		mb_reset_turnaround();
+		puts("Turnaround statistics cleared");
+		return CLI_OK;
+	}
+	
+	if (argc == 3 && !strncmp(argv[1], "delay", 5))
+	{
+		mb_set_response_delay(strtoul(argv[2], NULL, 10));
+		printf("Response delay: %lu us\r\n", mb_get_response_delay());
+		return CLI_OK;
+	}
+	
+	if (argc != 1)
+		return CLI_E_INVALID_ARGS;
+	
+	mb_print_turnaround();
+	return CLI_OK;
+}
+
+static cli_status_t cli_cmd_map(int argc, char **argv)
+{
+	#if MB_MAP_BENCHMARK
+		if (argc == 2 && !strncmp(argv[1], "bench", 5))
+		{
+			mb_map_benchmark();
+			return CLI_OK;
+		}
+	#endif
+	
+	if (argc != 1)
+		return CLI_E_INVALID_ARGS;
+	
+	mb_print_map();
+	return CLI_OK;
 }
 
+static cli_status_t cli_cmd_config(int argc, char **argv)
+{
+	if (argc == 1)
+	{
+		nvconfig_print();
+		return CLI_OK;
+	}
+	
+	if (argc == 2 && !strncmp(argv[1], "save", 4))
+	{
+		if (!nvconfig_save())
+		{
+			puts("Settings out of range, not saved");
+			return CLI_E_INVALID_ARGS;
+		}
+		puts("Saving when the bus is quiet");
+		return CLI_OK;
+	}
+	
+	if (argc == 2 && !strncmp(argv[1], "defaults", 8))
+	{
+		nvconfig_defaults();
+		puts("Defaults restored, not saved");
+		return CLI_OK;
+	}
+	
+	if (argc != 3)
+		return CLI_E_INVALID_ARGS;
+	
+	uint32_t value;
+	if (!strcmp(argv[1], "parity"))
+	{
+		if (!strcmp(argv[2], "none")) { value = UART_PARITY_NONE; }
+		else if (!strcmp(argv[2], "even")) { value = UART_PARITY_EVEN; }
+		else if (!strcmp(argv[2], "odd")) { value = UART_PARITY_ODD; }
+		else { return CLI_E_INVALID_ARGS; }
+	}
+	else if (!strcmp(argv[1], "framing"))
+	{
+		if (!strcmp(argv[2], "rtu")) { value = MB_FRAMING_RTU; }
+		else if (!strcmp(argv[2], "ascii")) { value = MB_FRAMING_ASCII; }
+		else { return CLI_E_INVALID_ARGS; }
+	}
+	else
+	{
+		value = strtoul(argv[2], NULL, 10);
+	}
+	
+	if (!nvconfig_set(argv[1], value))
+		return CLI_E_INVALID_ARGS;
+	
+	puts("Set, not saved");
+	return CLI_OK;
+}
+
+static cli_status_t cli_cmd_boot(int argc, char **argv)
+{
+	boot_print();
+	return CLI_OK;
+}
+
+static cli_status_t cli_cmd_bus(int argc, char **argv)
+{
+	mb_print_bus_stats();
+	return CLI_OK;
+}
+
+static cli_status_t cli_cmd_master(int argc, char **argv)
+{
+	#if MB_MASTER
+		if (argc == 2 && !strncmp(argv[1], "reset", 5))
+		{
+			mb_master_reset_stats();
+			puts("Master statistics cleared");
+			return CLI_OK;
+		}
+		
+		if (argc != 1)
+			return CLI_E_INVALID_ARGS;
+		
+		mb_master_print_stats();
+	#else
+		puts("Built without MB_MASTER, the port answers as a slave");
+	#endif
+	return CLI_OK;
+}
+
+static cli_status_t cli_cmd_logic(int argc, char **argv)
+{
+	if (argc == 2 && !strncmp(argv[1], "reset", 5))
+	{
+		logic_reset_stats();
+		puts("Logic statistics cleared");
+		return CLI_OK;
+	}
+	
+	if (argc == 2)
+	{
+		uint16_t command;
+		if (!strcmp(argv[1], "run")) { command = LOGIC_CMD_RUN; }
+		else if (!strcmp(argv[1], "stop")) { command = LOGIC_CMD_STOP; }
+		else if (!strcmp(argv[1], "save")) { command = LOGIC_CMD_SAVE; }
+		else { return CLI_E_INVALID_ARGS; }
+		
+		uint8_t result = logic_command(command);
+		if (result == MB_EXCEPTION_BUSY) { puts("Busy saving"); }
+		else if (result == MB_EXCEPTION_ILLEGAL_DATA) { puts("Staged program rejected"); }
+		else if (result == MB_EXCEPTION_ACK) { puts("Saving when the bus is quiet"); }
+	}
+	else if (argc != 1)
+	{
+		return CLI_E_INVALID_ARGS;
+	}
+	
+	logic_print_stats();
+	return CLI_OK;
+}
+
+static cli_status_t cli_cmd_history(int argc, char **argv)
+{
+	history_print_stats();
+	return CLI_OK;
+}
+
+static cli_status_t cli_cmd_image(int argc, char **argv)
+{
+	image_print_stats();
+	return CLI_OK;
+}
@@ -33,6 +33,13 @@ extern "C" {
 #define VSENSE_5V_PIN 28
 #define VSENSE_12V_PIN 29
 
+// Sense divider ratios as (R_top + R_bottom) / R_bottom, adjust to match the fitted resistors
+#define VSENSE_ADC_VREF_MV 3300
+#define VSENSE_5V_DIVIDER_NUM 2
+#define VSENSE_5V_DIVIDER_DEN 1
+#define VSENSE_12V_DIVIDER_NUM 11
+#define VSENSE_12V_DIVIDER_DEN 2
+
 #ifdef __cplusplus
 }
 #endif
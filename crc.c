@@ -12,4 +12,12 @@ uint16_t CRC16(uint8_t *msg, uint16_t data_len)
 		crc_hi = auchCRCLo[uIndex];
 	}
 	return (crc_hi << 8 | crc_low) ;
-} 
\ No newline at end of file
+} 
+
+uint16_t CRC16_update(uint16_t crc, uint8_t data)
+{
+	unsigned uIndex = (crc & 0xFF) ^ data;
+	uint8_t crc_low = (crc >> 8) ^ auchCRCHi[uIndex];
+	uint8_t crc_hi = auchCRCLo[uIndex];
+	return (crc_hi << 8 | crc_low);
+}
@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 uint16_t CRC16(uint8_t *puchMsg, uint16_t usDataLen); /* The function returns the CRC as a unsigned short type */
+uint16_t CRC16_update(uint16_t crc, uint8_t data); /* Adds one byte to a running CRC, start from 0xFFFF */
 
 static unsigned char auchCRCHi[] = {
 	0x00,
@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "flash_io.h"
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#if !BOOTLOADER
+#include "mb.h"
+#endif
+
+// Core 1 is not started; if it ever is, it has to be locked out here as well
+
+static uint32_t flash_io_begin()
+{
+	#if BOOTLOADER
+		return save_and_disable_interrupts();
+	#else
+		return mb_flash_lockout();
+	#endif
+}
+
+static void flash_io_end(uint32_t state)
+{
+	#if BOOTLOADER
+		restore_interrupts(state);
+	#else
+		mb_flash_release(state);
+	#endif
+}
+
+void flash_io_erase(uint32_t offset, uint32_t size)
+{
+	uint32_t state = flash_io_begin();
+	flash_range_erase(offset, size);
+	flash_io_end(state);
+}
+
+void flash_io_program(uint32_t offset, const uint8_t *data, uint32_t size)
+{
+	uint32_t state = flash_io_begin();
+	flash_range_program(offset, data, size);
+	flash_io_end(state);
+}
+
+#if !BOOTLOADER
+bool flash_io_ready(uint32_t quiet_us, uint64_t deadline_us)
+{
+	uint32_t idle_us = mb_bus_idle_us();
+	if (idle_us >= quiet_us)
+	{
+		return true;
+	}
+	// Past the deadline T3.5 is enough: the last frame is over and the lockout
+	// takes the next one in, it is only answered late
+	return deadline_us && time_us_64() >= deadline_us && idle_us >= mb_t35_us();
+}
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+// Every flash erase and program goes through here. XIP is gone while flash is
+// busy, so only code in RAM may run: the application keeps just the RS485
+// receive interrupt on, switched to a RAM handler that queues characters and
+// hands them to mb.c when flash is back (mb_flash_lockout()). A sector erase
+// takes about 45 ms, a page about 1 ms; the port keeps receiving throughout,
+// only the replies wait.
+//
+// The bootloader (built with BOOTLOADER=1) has nothing to keep running and
+// masks all interrupts instead.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	void flash_io_erase(uint32_t offset, uint32_t size);
+
+	void flash_io_program(uint32_t offset, const uint8_t *data, uint32_t size);
+
+	#if !BOOTLOADER
+		// Whether a flash operation may start now: once the bus has been quiet
+		// for quiet_us, or past deadline_us (0 for none) as soon as the port is
+		// between frames. Never while a frame is coming in or a reply going out.
+		bool flash_io_ready(uint32_t quiet_us, uint64_t deadline_us);
+	#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,459 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "history.h"
+#include "mb.h"
+#include "bsp_functions.h"
+#include "pulse_counter.h"
+#include "vsense.h"
+#include "scheduler.h"
+#include "flash_io.h"
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+#define HISTORY_NO_SECTOR -1
+#define HISTORY_EVENT_MAX_SIZE 11 // tag, time varint, 32-bit payload varint
+
+#if HISTORY_PAGES % HISTORY_FILE_PAGES
+#error "The log has to divide into whole files"
+#endif
+
+typedef struct
+{
+	uint32_t sequence;
+	uint32_t base_ms;
+	uint16_t magic;
+} __attribute__((packed)) history_header_t;
+
+_Static_assert(sizeof(history_header_t) == HISTORY_HEADER_SIZE, "history page header size");
+
+typedef union
+{
+	history_header_t header;
+	uint8_t bytes[FLASH_PAGE_SIZE];
+} history_page_t;
+
+// Change below which a steady value is not logged again
+static const uint32_t s_deadband[HISTORY_SAMPLE_COUNT] = { 50, 100, 1000, 1000 };
+
+// Staging ring: s_staged closed pages from s_first, then the open page
+static history_page_t s_pages[HISTORY_STAGING_PAGES];
+static uint8_t s_first = 0;
+static uint8_t s_staged = 0;
+static uint16_t s_open_used = 0;
+static uint32_t s_open_sequence = 0;
+static uint32_t s_last_event_ms = 0;
+static uint32_t s_page_samples[HISTORY_SAMPLE_COUNT]; // delta base within the open page
+
+static uint32_t s_oldest = 0;
+static int8_t s_erase_ahead = HISTORY_NO_SECTOR;
+static uint32_t s_logged[HISTORY_SAMPLE_COUNT];
+static uint32_t s_logged_ms[HISTORY_SAMPLE_COUNT];
+static bool s_sampled = false;
+
+static uint32_t s_events = 0;
+static uint32_t s_event_bytes = 0;
+static uint32_t s_dropped = 0;
+static uint32_t s_unlogged = 0; // dropped since the last HISTORY_EVENT_DROPPED made it into a page
+static uint64_t s_flash_due_us = 0; // when the pending erase or program first waited for the bus, 0 for none
+static uint32_t s_programs = 0;
+static uint32_t s_erases = 0;
+
+static const history_page_t *history_slot(uint32_t slot)
+{
+	return (const history_page_t *)(XIP_BASE + HISTORY_FLASH_OFFSET + slot * FLASH_PAGE_SIZE);
+}
+
+static bool history_slot_valid(uint32_t slot)
+{
+	const history_header_t *header = &history_slot(slot)->header;
+	return header->magic == HISTORY_MAGIC && header->sequence % HISTORY_PAGES == slot;
+}
+
+static bool history_blank(uint32_t slot, uint32_t pages)
+{
+	const uint32_t *word = (const uint32_t *)history_slot(slot);
+	for (uint32_t i = 0; i < pages * FLASH_PAGE_SIZE / sizeof(uint32_t); i++)
+	{
+		if (word[i] != 0xFFFFFFFF)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static uint32_t history_now_ms()
+{
+	return (uint32_t)(time_us_64() / 1000);
+}
+
+static history_page_t *history_open_page()
+{
+	return &s_pages[(s_first + s_staged) % HISTORY_STAGING_PAGES];
+}
+
+static void history_start_page(uint32_t sequence)
+{
+	history_page_t *page = history_open_page();
+	memset(page->bytes, HISTORY_END, sizeof(page->bytes));
+	page->header.sequence = sequence;
+	page->header.base_ms = history_now_ms();
+	page->header.magic = HISTORY_MAGIC;
+	s_open_sequence = sequence;
+	s_open_used = HISTORY_HEADER_SIZE;
+	s_last_event_ms = page->header.base_ms;
+	memset(s_page_samples, 0, sizeof(s_page_samples));
+}
+
+// Returns false when every staging page is full and the open one has to stay open
+static bool history_close_page()
+{
+	if (s_staged == HISTORY_STAGING_PAGES - 1)
+	{
+		return false;
+	}
+	s_staged++;
+	history_start_page(s_open_sequence + 1);
+	sched_post(SCHED_TASK_HISTORY);
+	return true;
+}
+
+static uint8_t history_varint(uint8_t *out, uint32_t value)
+{
+	uint8_t length = 0;
+	while (value >= 0x80)
+	{
+		out[length++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[length++] = value;
+	return length;
+}
+
+static uint8_t history_encode(uint8_t *out, uint8_t tag, const uint32_t *sample, uint8_t channel)
+{
+	uint32_t now = history_now_ms();
+	uint8_t length = 0;
+	out[length++] = tag;
+	length += history_varint(out + length, now - s_last_event_ms);
+	if (tag >> 5 == HISTORY_EVENT_DROPPED)
+	{
+		length += history_varint(out + length, s_unlogged);
+	}
+	else if (sample)
+	{
+		int32_t delta = (int32_t)(*sample - s_page_samples[channel]);
+		length += history_varint(out + length, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31)); // zigzag
+	}
+	return length;
+}
+
+// Returns false when the open page is full and no staging page is free
+static bool history_write(uint8_t event, uint8_t argument, const uint32_t *sample)
+{
+	uint8_t tag = (event << 5) | argument;
+	uint8_t encoded[HISTORY_EVENT_MAX_SIZE];
+	uint8_t length = history_encode(encoded, tag, sample, argument);
+	if (s_open_used + length > FLASH_PAGE_SIZE)
+	{
+		if (!history_close_page())
+		{
+			return false;
+		}
+		length = history_encode(encoded, tag, sample, argument); // relative to the new page
+	}
+
+	memcpy(history_open_page()->bytes + s_open_used, encoded, length);
+	s_open_used += length;
+	s_last_event_ms = history_now_ms();
+	if (sample)
+	{
+		s_page_samples[argument] = *sample;
+	}
+	s_events++;
+	s_event_bytes += length;
+	return true;
+}
+
+static void history_log(uint8_t event, uint8_t argument, const uint32_t *sample)
+{
+	// A gap is marked in the log where it happened, ahead of the first event that fits again
+	if (s_unlogged && history_write(HISTORY_EVENT_DROPPED, 0, NULL))
+	{
+		s_unlogged = 0;
+	}
+	if (s_unlogged || !history_write(event, argument, sample))
+	{
+		s_dropped++;
+		s_unlogged++;
+	}
+}
+
+void history_init()
+{
+	// Sequences are checked against their slot, so stray data in the area is ignored
+	bool found = false;
+	uint32_t newest = 0;
+	for (uint32_t slot = 0; slot < HISTORY_PAGES; slot++)
+	{
+		if (!history_slot_valid(slot))
+		{
+			continue;
+		}
+		uint32_t sequence = history_slot(slot)->header.sequence;
+		if (!found || sequence > newest)
+		{
+			newest = sequence;
+		}
+		if (!found || sequence < s_oldest)
+		{
+			s_oldest = sequence;
+		}
+		found = true;
+	}
+
+	uint32_t next = found ? newest + 1 : 0;
+	if (!history_blank(next % HISTORY_PAGES, 1))
+	{
+		// Programming was cut short, carry on from the next sector
+		next += HISTORY_PAGES_PER_SECTOR - next % HISTORY_PAGES_PER_SECTOR;
+	}
+	if (!found)
+	{
+		s_oldest = next;
+	}
+	history_start_page(next);
+
+	uint32_t ahead = (next / HISTORY_PAGES_PER_SECTOR + 1) % HISTORY_SECTORS;
+	if (!history_blank(ahead * HISTORY_PAGES_PER_SECTOR, HISTORY_PAGES_PER_SECTOR))
+	{
+		s_erase_ahead = ahead;
+	}
+
+	history_log(HISTORY_EVENT_BOOT, 0, NULL);
+	for (uint8_t i = 0; i < NUM_INPUTS; i++)
+	{
+		history_input(i, get_input(i));
+	}
+}
+
+void history_input(uint8_t channel, bool state)
+{
+	history_log(HISTORY_EVENT_INPUT, (channel << 1) | state, NULL);
+}
+
+void history_output(uint8_t channel)
+{
+	history_log(HISTORY_EVENT_OUTPUT, channel, NULL);
+}
+
+static void history_sample()
+{
+	uint32_t values[HISTORY_SAMPLE_COUNT] =
+	{
+		vsense_get_mv(VSENSE_5V),
+		vsense_get_mv(VSENSE_12V),
+		pulse_counter_get_frequency_mhz(0),
+		pulse_counter_get_frequency_mhz(1)
+	};
+	uint32_t now = history_now_ms();
+	for (uint8_t i = 0; i < HISTORY_SAMPLE_COUNT; i++)
+	{
+		uint32_t change = values[i] > s_logged[i] ? values[i] - s_logged[i] : s_logged[i] - values[i];
+		if (!s_sampled || change >= s_deadband[i] || now - s_logged_ms[i] >= HISTORY_SAMPLE_MAX_MS)
+		{
+			history_log(HISTORY_EVENT_SAMPLE, i, &values[i]);
+			s_logged[i] = values[i];
+			s_logged_ms[i] = now;
+		}
+	}
+	s_sampled = true;
+}
+
+static void history_erase(uint8_t sector)
+{
+	const history_page_t *head = history_slot(sector * HISTORY_PAGES_PER_SECTOR);
+	if (history_slot_valid(sector * HISTORY_PAGES_PER_SECTOR) && head->header.sequence + HISTORY_PAGES_PER_SECTOR > s_oldest)
+	{
+		s_oldest = head->header.sequence + HISTORY_PAGES_PER_SECTOR;
+	}
+
+	flash_io_erase(HISTORY_FLASH_OFFSET + sector * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+	s_erases++;
+}
+
+// Whether the pending flash operation may start: after quiet_us of bus
+// silence, or once it has waited HISTORY_FLASH_TIMEOUT_US at the next gap
+// between frames, so steady traffic cannot hold the log up until events are
+// dropped. Sets the time to wait otherwise.
+static bool history_flash_ready(uint32_t quiet_us, uint32_t *wait_us)
+{
+	uint64_t now = time_us_64();
+	if (!s_flash_due_us)
+	{
+		s_flash_due_us = now;
+	}
+	uint64_t deadline_us = s_flash_due_us + HISTORY_FLASH_TIMEOUT_US;
+	if (flash_io_ready(quiet_us, deadline_us))
+	{
+		s_flash_due_us = 0;
+		return true;
+	}
+	if (now >= deadline_us)
+	{
+		*wait_us = NVCONFIG_RETRY_US; // waiting for a gap between frames
+	}
+	else
+	{
+		uint32_t idle_us = mb_bus_idle_us();
+		*wait_us = idle_us < quiet_us ? quiet_us - idle_us : NVCONFIG_RETRY_US;
+		if (*wait_us > deadline_us - now)
+		{
+			*wait_us = deadline_us - now;
+		}
+	}
+	return false;
+}
+
+// Writes the oldest staged page once the bus allows, returns the time to wait otherwise
+static uint32_t history_program()
+{
+	uint32_t wait_us = 0;
+	uint32_t sequence = s_open_sequence - s_staged;
+	uint32_t slot = sequence % HISTORY_PAGES;
+	uint8_t sector = slot / HISTORY_PAGES_PER_SECTOR;
+	if (slot % HISTORY_PAGES_PER_SECTOR == 0)
+	{
+		if (!history_blank(slot, HISTORY_PAGES_PER_SECTOR))
+		{
+			// Erase ahead has not found a quiet bus yet
+			if (!history_flash_ready(NVCONFIG_ERASE_IDLE_US, &wait_us))
+			{
+				return wait_us;
+			}
+			history_erase(sector);
+			return 0;
+		}
+		s_erase_ahead = (sector + 1) % HISTORY_SECTORS;
+	}
+	if (!history_flash_ready(HISTORY_IDLE_US, &wait_us))
+	{
+		return wait_us;
+	}
+
+	flash_io_program(HISTORY_FLASH_OFFSET + slot * FLASH_PAGE_SIZE, s_pages[s_first].bytes, FLASH_PAGE_SIZE);
+	s_programs++;
+
+	s_first = (s_first + 1) % HISTORY_STAGING_PAGES;
+	s_staged--;
+	return 0;
+}
+
+void history_task()
+{
+	static uint64_t s_next_sample_us = 0;
+	uint64_t now = time_us_64();
+	if (now >= s_next_sample_us)
+	{
+		history_sample();
+		s_next_sample_us = now + HISTORY_SAMPLE_US;
+		if (s_open_used > HISTORY_HEADER_SIZE && history_now_ms() - history_open_page()->header.base_ms >= HISTORY_FLUSH_MS)
+		{
+			history_close_page();
+		}
+	}
+
+	// One flash operation per run, the task comes straight back for the next
+	uint32_t wait_us = s_staged ? history_program() : 0;
+	if (s_staged && !wait_us)
+	{
+		sched_post(SCHED_TASK_HISTORY);
+		return;
+	}
+
+	if (s_erase_ahead != HISTORY_NO_SECTOR && !wait_us)
+	{
+		if (history_flash_ready(NVCONFIG_ERASE_IDLE_US, &wait_us))
+		{
+			// The sector after the one being written holds the oldest pages
+			if (!history_blank(s_erase_ahead * HISTORY_PAGES_PER_SECTOR, HISTORY_PAGES_PER_SECTOR))
+			{
+				history_erase(s_erase_ahead);
+			}
+			s_erase_ahead = HISTORY_NO_SECTOR;
+		}
+	}
+
+	if (wait_us)
+	{
+		sched_post_at(SCHED_TASK_HISTORY, now + wait_us);
+	}
+}
+
+uint8_t history_file_read(uint16_t file, uint16_t record, uint16_t count, uint8_t *data)
+{
+	uint32_t slot = (file - MB_FILE_HISTORY) * HISTORY_FILE_PAGES + record / (FLASH_PAGE_SIZE / 2);
+	uint32_t offset = (record % (FLASH_PAGE_SIZE / 2)) * 2;
+	if (record + count > HISTORY_FILE_PAGES * FLASH_PAGE_SIZE / 2)
+	{
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+
+	for (uint32_t remaining = count * 2; remaining; slot++, offset = 0)
+	{
+		// Staged and open pages are served from RAM, their slot still holds an older page
+		const uint8_t *bytes = history_slot(slot)->bytes;
+		uint32_t age = (s_open_sequence % HISTORY_PAGES + HISTORY_PAGES - slot) % HISTORY_PAGES; // pages before the open one
+		if (age <= s_staged)
+		{
+			bytes = s_pages[(s_first + s_staged - age) % HISTORY_STAGING_PAGES].bytes;
+		}
+		uint32_t length = FLASH_PAGE_SIZE - offset < remaining ? FLASH_PAGE_SIZE - offset : remaining;
+		memcpy(data, bytes + offset, length);
+		data += length;
+		remaining -= length;
+	}
+	return 0;
+}
+
+static uint16_t history_saturate16(uint32_t value)
+{
+	return value > UINT16_MAX ? UINT16_MAX : value;
+}
+
+uint16_t history_stats_read(uint16_t addr)
+{
+	switch (addr - MB_IR_HISTORY)
+	{
+	case HISTORY_STAT_OPEN_HIGH:
+		return s_open_sequence >> 16;
+	case HISTORY_STAT_OPEN_LOW:
+		return s_open_sequence & 0xFFFF;
+	case HISTORY_STAT_OLDEST_HIGH:
+		return s_oldest >> 16;
+	case HISTORY_STAT_OLDEST_LOW:
+		return s_oldest & 0xFFFF;
+	case HISTORY_STAT_PAGES:
+		return HISTORY_PAGES;
+	case HISTORY_STAT_STAGED:
+		return s_staged;
+	case HISTORY_STAT_DROPPED:
+		return history_saturate16(s_dropped);
+	default:
+		return 0;
+	}
+}
+
+void history_print_stats()
+{
+	printf("** HISTORY **\r\n");
+	printf("PAGES\t\t= %lu to %lu of %u (%u staged)\r\n", s_oldest, s_open_sequence, HISTORY_PAGES, s_staged);
+	printf("OPEN PAGE\t= %u of %u bytes\r\n", s_open_used, FLASH_PAGE_SIZE);
+	printf("EVENTS\t\t= %lu (%lu.%02lu bytes each)\r\n", s_events,
+		s_events ? s_event_bytes / s_events : 0, s_events ? s_event_bytes * 100 / s_events % 100 : 0);
+	printf("DROPPED\t\t= %lu\r\n", s_dropped);
+	printf("PROGRAMS\t= %lu\r\n", s_programs);
+	printf("ERASES\t\t= %lu\r\n", s_erases);
+}
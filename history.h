@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "logic.h"
+
+// Event history kept through a master outage. Events are packed into pages in
+// RAM and programmed into a circular log of HISTORY_SECTORS flash sectors below
+// the logic program, one page at a time while the bus is quiet. Under steady
+// traffic a write waits at most HISTORY_FLASH_TIMEOUT_US and then goes ahead
+// between frames; the port keeps receiving (flash_io.h), only replies wait for
+// it. Page n of the log lives in slot
+// n % HISTORY_PAGES and starts from scratch (time base and sample values), so
+// any page decodes on its own.
+#define HISTORY_SECTORS 32 // 128 KB
+#define HISTORY_FLASH_OFFSET (LOGIC_FLASH_OFFSET - HISTORY_SECTORS * FLASH_SECTOR_SIZE)
+#define HISTORY_PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define HISTORY_PAGES (HISTORY_SECTORS * HISTORY_PAGES_PER_SECTOR)
+#define HISTORY_STAGING_PAGES 8 // pages held in RAM waiting for a quiet bus, events are dropped beyond that
+#define HISTORY_IDLE_US 2000 // quiet time before programming a page (about 1 ms, replies wait meanwhile)
+#define HISTORY_FLASH_TIMEOUT_US 1000000 // a program or erase waiting this long for a quiet bus goes ahead at the next gap between frames
+#define HISTORY_FLUSH_MS 60000 // a page is closed after this long even if not full, bounding loss at power off
+#define HISTORY_SAMPLE_US 1000000 // how often analog values are checked against their deadband
+#define HISTORY_SAMPLE_MAX_MS 600000 // a value is logged at least this often even if steady
+
+// FC14 file records: file MB_FILE_HISTORY + n holds slots n * HISTORY_FILE_PAGES
+// onwards, FLASH_PAGE_SIZE / 2 records (registers) per slot, bytes in order,
+// first byte high. Records within a file stay below the 10000 the spec allows.
+#define HISTORY_FILE_PAGES 64
+#define HISTORY_FILES (HISTORY_PAGES / HISTORY_FILE_PAGES)
+
+// Page layout: header, then events until a 0xFF tag or the end of the page.
+// An event is a tag byte (HISTORY_EVENT_* << 5 | argument), the ms since the
+// previous event on the page (since base_ms for the first) as a varint, then
+// any payload. Varints are 7 bits per byte, low group first, top bit set on all
+// but the last byte.
+#define HISTORY_MAGIC 0x484C // "HL"
+#define HISTORY_HEADER_SIZE 10 // sequence (4), base_ms (4), magic (2), little endian
+#define HISTORY_END 0xFF
+
+enum HISTORY_EVENTS
+{
+	HISTORY_EVENT_BOOT, // first event after power up, times restart from 0
+	HISTORY_EVENT_INPUT, // argument: input << 1 | state
+	HISTORY_EVENT_OUTPUT, // argument: output, a pulse started (coil command, CLI or logic)
+	HISTORY_EVENT_SAMPLE, // argument: HISTORY_SAMPLES, payload: zigzag varint change from the previous sample on the page
+	HISTORY_EVENT_DROPPED // argument 0, payload: varint count of events lost to a full staging area just before this one
+};
+
+enum HISTORY_SAMPLES
+{
+	HISTORY_SAMPLE_5V, // mV
+	HISTORY_SAMPLE_12V, // mV
+	HISTORY_SAMPLE_FREQ_1, // mHz
+	HISTORY_SAMPLE_FREQ_2,
+	HISTORY_SAMPLE_COUNT
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// Input registers from MB_IR_HISTORY
+	enum HISTORY_STATS
+	{
+		HISTORY_STAT_OPEN_HIGH, // sequence of the page being filled, readable like the others
+		HISTORY_STAT_OPEN_LOW,
+		HISTORY_STAT_OLDEST_HIGH, // oldest sequence still in flash
+		HISTORY_STAT_OLDEST_LOW,
+		HISTORY_STAT_PAGES, // HISTORY_PAGES, slots in the log
+		HISTORY_STAT_STAGED, // closed pages waiting for a quiet bus
+		HISTORY_STAT_DROPPED, // events lost to a full staging area, saturates at 65535; each gap is also logged as HISTORY_EVENT_DROPPED
+		HISTORY_STAT_COUNT
+	};
+
+	// Finds the end of the log, before anything logs
+	void history_init();
+
+	void history_task();
+
+	void history_input(uint8_t channel, bool state);
+
+	void history_output(uint8_t channel);
+
+	// FC14 callback for MB_FILE_HISTORY onwards
+	uint8_t history_file_read(uint16_t file, uint16_t record, uint16_t count, uint8_t *data);
+
+	uint16_t history_stats_read(uint16_t addr);
+
+	void history_print_stats();
+
+#ifdef __cplusplus
+}
+#endif
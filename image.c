@@ -0,0 +1,567 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "image.h"
+#include "bootloader.h"
+#include "mb.h"
+#include "crc.h"
+#include "scheduler.h"
+#include "flash_io.h"
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/watchdog.h"
+#include "hardware/structs/watchdog.h"
+
+#define IMAGE_NO_SECTOR -1
+#define IMAGE_SECTOR_PAGES (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+
+typedef struct
+{
+	int16_t sector; // within the slot, IMAGE_NO_SECTOR when free
+	uint16_t dirty; // bit per page written since it was last programmed
+	bool filling; // the stream may still write here, so it is not programmed yet
+	uint8_t bytes[FLASH_SECTOR_SIZE]; // 0xFF where nothing was written, programming leaves those bits alone
+} image_buffer_t;
+
+typedef struct
+{
+	uint32_t first; // byte within the slot
+	uint32_t end; // byte after the last
+} image_range_t;
+
+static image_buffer_t s_buffers[IMAGE_BUFFERS];
+static image_range_t s_refused[IMAGE_REFUSED_MAX];
+static uint8_t s_refused_count = 0;
+static bool s_refused_lost = false;
+static uint8_t s_state = IMAGE_IDLE;
+static uint32_t s_size = 0;
+static uint16_t s_erase_next = 0; // sector
+static uint32_t s_crc_next = 0; // byte
+static uint16_t s_crc = 0xFFFF;
+static uint8_t s_boot = IMAGE_BOOT_NORMAL;
+static bool s_confirm = false;
+
+extern char __flash_binary_end; // from the linker script
+
+static uint64_t s_begin_us = 0;
+static uint32_t s_transfer_us = 0; // begin to done
+static uint32_t s_bytes = 0; // written by FC15, retries included
+static uint32_t s_busy = 0; // writes refused for want of a buffer
+static uint32_t s_programs = 0;
+static uint32_t s_erases = 0;
+
+static const uint8_t *image_flash(uint32_t offset)
+{
+	return (const uint8_t *)(XIP_BASE + IMAGE_FLASH_OFFSET + offset);
+}
+
+static bool image_sector_blank(uint16_t sector)
+{
+	const uint32_t *word = (const uint32_t *)image_flash(sector * FLASH_SECTOR_SIZE);
+	for (uint32_t i = 0; i < FLASH_SECTOR_SIZE / sizeof(uint32_t); i++)
+	{
+		if (word[i] != 0xFFFFFFFF)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static void image_reset_buffers()
+{
+	for (uint8_t i = 0; i < IMAGE_BUFFERS; i++)
+	{
+		s_buffers[i].sector = IMAGE_NO_SECTOR;
+		s_buffers[i].dirty = 0;
+		s_buffers[i].filling = false;
+	}
+}
+
+// Buffer collecting writes to the sector. Moving on to a new sector hands the
+// one being filled over for programming. NULL while every buffer still waits.
+static image_buffer_t *image_buffer(uint16_t sector)
+{
+	for (uint8_t i = 0; i < IMAGE_BUFFERS; i++)
+	{
+		if (s_buffers[i].sector == sector)
+		{
+			return &s_buffers[i]; // also a retry into a sector not yet programmed
+		}
+	}
+
+	for (uint8_t i = 0; i < IMAGE_BUFFERS; i++)
+	{
+		s_buffers[i].filling = false;
+	}
+	sched_post(SCHED_TASK_IMAGE);
+
+	for (uint8_t i = 0; i < IMAGE_BUFFERS; i++)
+	{
+		image_buffer_t *buffer = &s_buffers[i];
+		if (buffer->sector == IMAGE_NO_SECTOR)
+		{
+			buffer->sector = sector;
+			buffer->dirty = 0;
+			buffer->filling = true;
+			memset(buffer->bytes, 0xFF, sizeof(buffer->bytes));
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+static void image_refuse(uint32_t first, uint32_t end)
+{
+	for (uint8_t i = 0; i < s_refused_count; i++)
+	{
+		image_range_t *range = &s_refused[i];
+		if (first <= range->end && end >= range->first)
+		{
+			range->first = first < range->first ? first : range->first; // frames refused back to back, or again
+			range->end = end > range->end ? end : range->end;
+			return;
+		}
+	}
+	if (s_refused_count == IMAGE_REFUSED_MAX)
+	{
+		s_refused_lost = true;
+		return;
+	}
+	s_refused[s_refused_count].first = first;
+	s_refused[s_refused_count].end = end;
+	s_refused_count++;
+}
+
+// A range only partly covered keeps its uncovered end; one covered in the middle is kept whole
+static void image_accept(uint32_t first, uint32_t end)
+{
+	for (uint8_t i = 0; i < s_refused_count;)
+	{
+		image_range_t *range = &s_refused[i];
+		if (first <= range->first && end >= range->end)
+		{
+			*range = s_refused[--s_refused_count];
+			continue;
+		}
+		if (first <= range->first && end > range->first)
+		{
+			range->first = end;
+		}
+		else if (first < range->end && end >= range->end)
+		{
+			range->end = first;
+		}
+		i++;
+	}
+}
+
+// An image linked to run after the bootloader: stack in RAM, reset handler within the image
+static bool image_bootable()
+{
+	const uint32_t *vectors = (const uint32_t *)image_flash(BOOTLOADER_APP_VECTORS);
+	return s_size >= BOOTLOADER_APP_VECTORS + 2 * sizeof(uint32_t)
+		&& vectors[0] >= SRAM_BASE && vectors[0] <= SRAM_END
+		&& vectors[1] >= XIP_BASE + BOOTLOADER_APP_OFFSET && vectors[1] < XIP_BASE + BOOTLOADER_APP_OFFSET + s_size;
+}
+
+static uint8_t image_command(uint16_t command)
+{
+	switch (command)
+	{
+	case IMAGE_CMD_BEGIN:
+		if (s_size == 0 || s_size > IMAGE_SLOT_SIZE)
+		{
+			return MB_EXCEPTION_ILLEGAL_DATA;
+		}
+		if (s_boot == IMAGE_BOOT_TRIAL)
+		{
+			return MB_EXCEPTION_BUSY; // the slot holds the firmware to fall back to until confirmed
+		}
+		image_reset_buffers();
+		s_erase_next = 0;
+		s_begin_us = time_us_64();
+		s_bytes = 0;
+		s_busy = 0;
+		s_refused_count = 0;
+		s_refused_lost = false;
+		s_state = IMAGE_ERASING;
+		sched_post(SCHED_TASK_IMAGE);
+		return MB_EXCEPTION_ACK; // accepted, completion via the command register
+	case IMAGE_CMD_FINISH:
+		if (s_state != IMAGE_RECEIVING)
+		{
+			return MB_EXCEPTION_ILLEGAL_DATA;
+		}
+		for (uint8_t i = 0; i < IMAGE_BUFFERS; i++)
+		{
+			s_buffers[i].filling = false;
+		}
+		s_crc_next = 0;
+		s_crc = 0xFFFF;
+		s_state = IMAGE_FINISHING;
+		sched_post(SCHED_TASK_IMAGE);
+		return MB_EXCEPTION_ACK;
+	case IMAGE_CMD_ABORT:
+		image_reset_buffers();
+		s_state = IMAGE_IDLE;
+		return 0;
+	case IMAGE_CMD_ACTIVATE:
+		if (s_state != IMAGE_DONE || !image_bootable())
+		{
+			return MB_EXCEPTION_ILLEGAL_DATA;
+		}
+		s_state = IMAGE_ACTIVATING;
+		sched_post(SCHED_TASK_IMAGE);
+		return MB_EXCEPTION_ACK;
+	case IMAGE_CMD_CONFIRM:
+		if (s_boot != IMAGE_BOOT_TRIAL)
+		{
+			return MB_EXCEPTION_ILLEGAL_DATA;
+		}
+		s_confirm = true;
+		sched_post(SCHED_TASK_IMAGE);
+		return 0;
+	case IMAGE_CMD_REOPEN:
+		if (s_state != IMAGE_DONE)
+		{
+			return MB_EXCEPTION_ILLEGAL_DATA;
+		}
+		s_state = IMAGE_RECEIVING; // finished again afterwards
+		return 0;
+	default:
+		return MB_EXCEPTION_ILLEGAL_DATA;
+	}
+}
+
+static void image_program_page(image_buffer_t *buffer)
+{
+	uint8_t page = __builtin_ctz(buffer->dirty);
+	uint32_t offset = buffer->sector * FLASH_SECTOR_SIZE + page * FLASH_PAGE_SIZE;
+	flash_io_program(IMAGE_FLASH_OFFSET + offset, buffer->bytes + page * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
+	s_programs++;
+
+	buffer->dirty &= ~(1 << page);
+	if (!buffer->dirty)
+	{
+		buffer->sector = IMAGE_NO_SECTOR;
+	}
+}
+
+void image_init()
+{
+	switch (BOOTLOG_EVENT(bootlog_last()))
+	{
+	case BOOTLOG_TRIAL:
+		s_boot = IMAGE_BOOT_TRIAL;
+		watchdog_enable(BOOTLOADER_WATCHDOG_MS, true); // the reload value set by the bootloader is not known here
+		sched_post(SCHED_TASK_IMAGE);
+		break;
+	case BOOTLOG_CONFIRMED:
+		s_boot = IMAGE_BOOT_UPDATED;
+		break;
+	case BOOTLOG_REVERTED:
+		s_boot = IMAGE_BOOT_REVERTED;
+		break;
+	}
+}
+
+// A hang stops the feeding and the bootloader puts the old firmware back.
+// Without IMAGE_CMD_CONFIRM the run confirms itself after IMAGE_TRIAL_US only
+// once it has answered a request addressed to it on the bus, so firmware that
+// boots but cannot talk stays on trial.
+static void image_trial(uint64_t now, uint32_t idle_us)
+{
+	watchdog_update();
+	if (s_confirm || (now >= IMAGE_TRIAL_US && mb_first_reply_us()))
+	{
+		if (idle_us >= IMAGE_IDLE_US)
+		{
+			bootlog_append(BOOTLOG_ENTRY(BOOTLOG_CONFIRMED, 0));
+			hw_clear_bits(&watchdog_hw->ctrl, WATCHDOG_CTRL_ENABLE_BITS);
+			s_boot = IMAGE_BOOT_UPDATED;
+			return;
+		}
+		sched_post_at(SCHED_TASK_IMAGE, now + IMAGE_IDLE_US - idle_us);
+		return;
+	}
+	uint64_t next_us = now + IMAGE_WATCHDOG_US;
+	if (now < IMAGE_TRIAL_US && next_us > IMAGE_TRIAL_US)
+	{
+		next_us = IMAGE_TRIAL_US;
+	}
+	sched_post_at(SCHED_TASK_IMAGE, next_us);
+}
+
+static void image_activate(uint64_t now, uint32_t idle_us)
+{
+	if (idle_us < IMAGE_ERASE_IDLE_US)
+	{
+		sched_post_at(SCHED_TASK_IMAGE, now + IMAGE_ERASE_IDLE_US - idle_us);
+		return;
+	}
+	// Whichever is longer, the running firmware or the new one, is swapped
+	uint32_t running = (uintptr_t)&__flash_binary_end - XIP_BASE - BOOTLOADER_APP_OFFSET;
+	uint32_t bytes = running > s_size ? running : s_size;
+	bootlog_start(BOOTLOG_ENTRY(BOOTLOG_PENDING, (bytes + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE));
+	watchdog_reboot(0, 0, 1);
+	while (true)
+	{
+		tight_loop_contents();
+	}
+}
+
+void image_task()
+{
+	uint64_t now = time_us_64();
+	uint32_t idle_us = mb_bus_idle_us();
+
+	if (s_boot == IMAGE_BOOT_TRIAL)
+	{
+		image_trial(now, idle_us);
+	}
+
+	if (s_state == IMAGE_ACTIVATING)
+	{
+		image_activate(now, idle_us);
+		return;
+	}
+
+	if (s_state == IMAGE_ERASING)
+	{
+		uint16_t sectors = (s_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+		if (s_erase_next == sectors)
+		{
+			s_state = IMAGE_RECEIVING;
+			return;
+		}
+		if (image_sector_blank(s_erase_next))
+		{
+			s_erase_next++; // one sector checked per run, reading it takes a while too
+			sched_post(SCHED_TASK_IMAGE);
+			return;
+		}
+		if (idle_us < IMAGE_ERASE_IDLE_US)
+		{
+			sched_post_at(SCHED_TASK_IMAGE, now + IMAGE_ERASE_IDLE_US - idle_us);
+			return;
+		}
+		flash_io_erase(IMAGE_FLASH_OFFSET + s_erase_next * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+		s_erases++;
+		s_erase_next++;
+		sched_post(SCHED_TASK_IMAGE);
+		return;
+	}
+
+	if (s_state != IMAGE_RECEIVING && s_state != IMAGE_FINISHING)
+	{
+		return;
+	}
+
+	// One page per run, between frames, the task comes straight back for the next
+	for (uint8_t i = 0; i < IMAGE_BUFFERS; i++)
+	{
+		image_buffer_t *buffer = &s_buffers[i];
+		if (buffer->sector != IMAGE_NO_SECTOR && !buffer->filling && buffer->dirty)
+		{
+			if (idle_us < IMAGE_IDLE_US)
+			{
+				sched_post_at(SCHED_TASK_IMAGE, now + IMAGE_IDLE_US - idle_us);
+				return;
+			}
+			image_program_page(buffer);
+			sched_post(SCHED_TASK_IMAGE);
+			return;
+		}
+	}
+
+	if (s_state == IMAGE_FINISHING)
+	{
+		uint32_t end = s_crc_next + IMAGE_CRC_CHUNK < s_size ? s_crc_next + IMAGE_CRC_CHUNK : s_size;
+		const uint8_t *bytes = image_flash(0);
+		for (; s_crc_next < end; s_crc_next++)
+		{
+			s_crc = CRC16_update(s_crc, bytes[s_crc_next]);
+		}
+		if (s_crc_next == s_size)
+		{
+			s_transfer_us = (uint32_t)(time_us_64() - s_begin_us);
+			s_state = IMAGE_DONE;
+			return;
+		}
+		sched_post(SCHED_TASK_IMAGE);
+	}
+}
+
+uint16_t image_hr_read(uint16_t addr)
+{
+	switch (addr - MB_HR_IMAGE)
+	{
+	case IMAGE_HR_COMMAND:
+		return s_state;
+	case IMAGE_HR_SIZE_HIGH:
+		return s_size >> 16;
+	case IMAGE_HR_SIZE_LOW:
+		return s_size & 0xFFFF;
+	case IMAGE_HR_CRC:
+		return s_state == IMAGE_DONE || s_state == IMAGE_ACTIVATING ? s_crc : 0;
+	case IMAGE_HR_BOOT:
+		return s_boot;
+	case IMAGE_HR_REFUSED:
+		return s_refused_lost ? IMAGE_REFUSED_LOST : s_refused_count;
+	default:
+		return 0;
+	}
+}
+
+uint8_t image_hr_write(uint16_t addr, uint16_t value)
+{
+	switch (addr - MB_HR_IMAGE)
+	{
+	case IMAGE_HR_COMMAND:
+		return image_command(value);
+	case IMAGE_HR_SIZE_HIGH:
+		if (s_state == IMAGE_ERASING || s_state == IMAGE_RECEIVING || s_state == IMAGE_FINISHING)
+		{
+			return MB_EXCEPTION_BUSY; // abort the transfer first
+		}
+		s_size = (s_size & 0xFFFF) | ((uint32_t)value << 16);
+		return 0;
+	case IMAGE_HR_SIZE_LOW:
+		if (s_state == IMAGE_ERASING || s_state == IMAGE_RECEIVING || s_state == IMAGE_FINISHING)
+		{
+			return MB_EXCEPTION_BUSY;
+		}
+		s_size = (s_size & 0xFFFF0000) | value;
+		return 0;
+	default:
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+}
+
+uint8_t image_file_read(uint16_t file, uint16_t record, uint16_t count, uint8_t *data)
+{
+	if (record + count > IMAGE_FILE_RECORDS)
+	{
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+	uint32_t offset = (file - MB_FILE_IMAGE) * IMAGE_FILE_RECORDS * 2 + record * 2;
+	memcpy(data, image_flash(offset), count * 2);
+
+	// Pages not programmed yet read as they will once they are
+	for (uint8_t i = 0; i < IMAGE_BUFFERS; i++)
+	{
+		const image_buffer_t *buffer = &s_buffers[i];
+		for (uint32_t n = 0; buffer->dirty && n < count * 2u; n++)
+		{
+			uint32_t byte = offset + n;
+			if (byte / FLASH_SECTOR_SIZE == buffer->sector && buffer->dirty & (1 << (byte % FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)))
+			{
+				data[n] &= buffer->bytes[byte % FLASH_SECTOR_SIZE];
+			}
+		}
+	}
+	return 0;
+}
+
+uint8_t image_file_write(uint16_t file, uint16_t record, uint16_t count, const uint8_t *data)
+{
+	if (s_state != IMAGE_RECEIVING)
+	{
+		return s_state == IMAGE_ERASING || s_state == IMAGE_FINISHING ? MB_EXCEPTION_BUSY : MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+	uint32_t offset = (file - MB_FILE_IMAGE) * IMAGE_FILE_RECORDS * 2 + record * 2;
+	uint32_t remaining = count * 2;
+	if (record + count > IMAGE_FILE_RECORDS || offset + remaining > s_size)
+	{
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+
+	while (remaining)
+	{
+		image_buffer_t *buffer = image_buffer(offset / FLASH_SECTOR_SIZE);
+		if (buffer == NULL)
+		{
+			s_busy++;
+			image_refuse(offset, offset + remaining); // a broadcast is not repeated, the sender asks later
+			return MB_EXCEPTION_BUSY; // the sender repeats the frame, writes are idempotent
+		}
+		uint32_t within = offset % FLASH_SECTOR_SIZE;
+		uint32_t length = FLASH_SECTOR_SIZE - within < remaining ? FLASH_SECTOR_SIZE - within : remaining;
+		memcpy(buffer->bytes + within, data, length);
+		image_accept(offset, offset + length);
+		for (uint32_t page = within / FLASH_PAGE_SIZE; page <= (within + length - 1) / FLASH_PAGE_SIZE; page++)
+		{
+			buffer->dirty |= 1 << page;
+		}
+		data += length;
+		offset += length;
+		remaining -= length;
+		s_bytes += length;
+	}
+	return 0;
+}
+
+uint8_t image_refused_read(uint16_t file, uint16_t record, uint16_t count, uint8_t *data)
+{
+	if (record + count > IMAGE_REFUSED_MAX * IMAGE_REFUSED_RECORDS)
+	{
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+	for (uint16_t n = record; n < record + count; n++)
+	{
+		// Ranges past the count read as empty
+		const image_range_t *range = &s_refused[n / IMAGE_REFUSED_RECORDS];
+		uint32_t value = n / IMAGE_REFUSED_RECORDS >= s_refused_count ? 0 : n % IMAGE_REFUSED_RECORDS < 2 ? range->first : range->end;
+		uint16_t word = n % 2 ? value & 0xFFFF : value >> 16;
+		*data++ = word >> 8;
+		*data++ = word & 0xFF;
+	}
+	return 0;
+}
+
+uint8_t image_sector_crc_read(uint16_t file, uint16_t record, uint16_t count, uint8_t *data)
+{
+	if (record + count > IMAGE_SECTORS)
+	{
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+	if (count > IMAGE_SECTOR_CRC_MAX)
+	{
+		return MB_EXCEPTION_ILLEGAL_DATA;
+	}
+	if (s_state != IMAGE_IDLE && s_state != IMAGE_DONE)
+	{
+		return MB_EXCEPTION_BUSY; // pages may still be waiting in RAM
+	}
+	for (uint16_t sector = record; sector < record + count; sector++)
+	{
+		uint16_t crc = CRC16((uint8_t *)image_flash(sector * FLASH_SECTOR_SIZE), FLASH_SECTOR_SIZE);
+		*data++ = crc >> 8;
+		*data++ = crc & 0xFF;
+	}
+	return 0;
+}
+
+void image_print_stats()
+{
+	static const char *state_names[] = { "IDLE", "ERASING", "RECEIVING", "FINISHING", "DONE", "ACTIVATING" };
+	static const char *boot_names[] = { "NORMAL", "TRIAL", "UPDATED", "REVERTED" };
+
+	printf("** IMAGE SLOT **\r\n");
+	printf("BOOT\t\t= %s\r\n", boot_names[s_boot]);
+	printf("STATE\t\t= %s\r\n", state_names[s_state]);
+	printf("SIZE\t\t= %lu of %u bytes\r\n", s_size, IMAGE_SLOT_SIZE);
+	if (s_state == IMAGE_DONE)
+	{
+		printf("CRC\t\t= %04X\r\n", s_crc);
+		printf("TRANSFER\t= %lu ms, %lu bytes/s\r\n", s_transfer_us / 1000,
+			s_transfer_us ? (uint32_t)((uint64_t)s_size * 1000000 / s_transfer_us) : 0);
+	}
+	printf("BYTES WRITTEN\t= %lu\r\n", s_bytes);
+	printf("BUSY REPLIES\t= %lu\r\n", s_busy);
+	printf("REFUSED\t\t= %u ranges%s\r\n", s_refused_count, s_refused_lost ? ", more lost" : "");
+	printf("PAGES\t\t= %lu\r\n", s_programs);
+	printf("ERASES\t\t= %lu\r\n", s_erases);
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "history.h"
+
+// Staging slot for bulk transfers such as firmware images, written with FC15
+// and read back with FC14. It is also the other half of a firmware update, see
+// bootloader.h. A transfer erases the sectors it needs up front, then
+// collects writes in IMAGE_BUFFERS sector buffers in RAM: the stream fills one
+// while the task programs the other a page at a time in the gaps between
+// frames. A write needing a third buffer is refused with BUSY until one is
+// programmed, so the sender slows to what flash can take.
+#define IMAGE_SLOT_SIZE (512 * 1024)
+#define IMAGE_FLASH_OFFSET (HISTORY_FLASH_OFFSET - IMAGE_SLOT_SIZE)
+#define IMAGE_SECTORS (IMAGE_SLOT_SIZE / FLASH_SECTOR_SIZE)
+#define IMAGE_BUFFERS 2
+#define IMAGE_IDLE_US 1000 // quiet time before programming a page
+#define IMAGE_ERASE_IDLE_US 20000 // quiet time before erasing a sector (about 45 ms, replies wait meanwhile)
+#define IMAGE_CRC_CHUNK 4096 // bytes checked per task run once the transfer is finished
+#define IMAGE_WATCHDOG_US 1000000 // how often a trial run feeds the watchdog
+#define IMAGE_TRIAL_US 60000000 // a trial run that has answered on the bus confirms itself after this long unless told to sooner
+
+// FC14/FC15 file records: file MB_FILE_IMAGE + n holds slot bytes from
+// n * IMAGE_FILE_RECORDS * 2, a register per record, first byte high. Files
+// cover whole sectors.
+#define IMAGE_FILE_RECORDS 8192
+#define IMAGE_FILES (IMAGE_SLOT_SIZE / (IMAGE_FILE_RECORDS * 2))
+
+// A broadcast refused with BUSY gets no reply, so refused writes are kept as
+// byte ranges of the slot until a later write covers them. File
+// MB_FILE_IMAGE_REFUSED reads them back, IMAGE_REFUSED_RECORDS registers per
+// range: first byte (high word first) then end byte, IMAGE_HR_REFUSED says how
+// many there are. Adjacent ranges are joined; past IMAGE_REFUSED_MAX of them
+// only the fact is kept.
+#define IMAGE_REFUSED_MAX 64
+#define IMAGE_REFUSED_RECORDS 4
+#define IMAGE_REFUSED_LOST 0xFFFF // IMAGE_HR_REFUSED once more were refused than could be kept
+
+// File MB_FILE_IMAGE_CRC: record n is the Modbus CRC16 of slot sector n as
+// programmed, for finding what a unit missed when the whole CRC does not
+// match. Read in IDLE or DONE, at most IMAGE_SECTOR_CRC_MAX records a request
+// (about 0.5 ms of CRC each). IMAGE_CMD_REOPEN goes back to RECEIVING so the
+// sectors can be sent again and finished again, a write in DONE is refused.
+#define IMAGE_SECTOR_CRC_MAX 4
+
+#define IMAGE_CMD_BEGIN 1 // erase for IMAGE_HR_SIZE bytes, then take writes
+#define IMAGE_CMD_FINISH 2 // program what is buffered, then compute the CRC
+#define IMAGE_CMD_ABORT 3
+#define IMAGE_CMD_ACTIVATE 4 // after DONE, restart into the image through the bootloader
+#define IMAGE_CMD_CONFIRM 5 // keep the firmware on trial now
+#define IMAGE_CMD_REOPEN 6 // after DONE, take writes again to repair the image
+
+enum IMAGE_STATES
+{
+	IMAGE_IDLE,
+	IMAGE_ERASING,
+	IMAGE_RECEIVING,
+	IMAGE_FINISHING,
+	IMAGE_DONE, // IMAGE_HR_CRC is valid
+	IMAGE_ACTIVATING // restarting once the bus is quiet
+};
+
+enum IMAGE_BOOTS
+{
+	IMAGE_BOOT_NORMAL, // no update since the bootloader was programmed
+	IMAGE_BOOT_TRIAL, // this firmware was just activated and is not confirmed yet
+	IMAGE_BOOT_UPDATED, // this firmware was activated and confirmed
+	IMAGE_BOOT_REVERTED // the last update failed its trial, this is the firmware from before it
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// Holding registers from MB_HR_IMAGE
+	enum IMAGE_REGISTERS
+	{
+		IMAGE_HR_COMMAND, // write IMAGE_CMD_*, reads IMAGE_STATES
+		IMAGE_HR_SIZE_HIGH, // bytes to transfer, set before IMAGE_CMD_BEGIN
+		IMAGE_HR_SIZE_LOW,
+		IMAGE_HR_CRC, // Modbus CRC16 of the first size bytes of the slot, read only
+		IMAGE_HR_BOOT, // IMAGE_BOOTS, read only
+		IMAGE_HR_REFUSED, // refused ranges in MB_FILE_IMAGE_REFUSED or IMAGE_REFUSED_LOST, read only
+		IMAGE_HR_COUNT
+	};
+
+	// Picks up a trial run from the boot log, before the scheduler starts
+	void image_init();
+
+	void image_task();
+
+	uint16_t image_hr_read(uint16_t addr);
+
+	uint8_t image_hr_write(uint16_t addr, uint16_t value);
+
+	uint8_t image_file_read(uint16_t file, uint16_t record, uint16_t count, uint8_t *data);
+
+	uint8_t image_file_write(uint16_t file, uint16_t record, uint16_t count, const uint8_t *data);
+
+	uint8_t image_refused_read(uint16_t file, uint16_t record, uint16_t count, uint8_t *data);
+
+	uint8_t image_sector_crc_read(uint16_t file, uint16_t record, uint16_t count, uint8_t *data);
+
+	void image_print_stats();
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,631 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "logic.h"
+#include "mb.h"
+#include "crc.h"
+#include "bsp_functions.h"
+#include "scheduler.h"
+#include "flash_io.h"
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/clocks.h"
+#include "hardware/structs/systick.h"
+
+// Programs are checked once when they are loaded: every opcode and operand is
+// in range, the stack never underflows or exceeds LOGIC_STACK_DEPTH and END
+// is reached. With no jumps the stack depth at each instruction is fixed, so
+// the scan itself runs without any checks and costs the same every time.
+
+#define LOGIC_MAGIC 0x4C4F4743 // "LOGC"
+#define LOGIC_NO_ERROR 0
+
+typedef struct
+{
+	uint32_t magic;
+	uint16_t size;
+	uint16_t crc; // over the first size bytes of program
+	uint8_t program[LOGIC_PROGRAM_SIZE];
+} logic_record_t;
+
+#define LOGIC_RECORD_PAGES ((sizeof(logic_record_t) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE)
+
+// Programmed from RAM, flash cannot be read while it is being written
+static union
+{
+	logic_record_t record;
+	uint8_t bytes[LOGIC_RECORD_PAGES * FLASH_PAGE_SIZE];
+} s_flash;
+
+static uint8_t s_staging[LOGIC_PROGRAM_SIZE];
+static uint16_t s_staging_size = 0;
+static uint16_t s_error = LOGIC_NO_ERROR;
+
+static uint8_t s_program[LOGIC_PROGRAM_SIZE + 3]; // operands decoded past a final END stay inside
+static uint16_t s_program_size = 0;
+static bool s_running = false;
+static bool s_save_pending = false;
+static uint64_t s_save_requested_us = 0;
+
+// Program state, cleared each time a program starts
+static uint32_t s_markers = 0;
+static uint16_t s_timer_running = 0;
+static uint16_t s_timer_out = 0;
+static uint32_t s_timer_start_ms[LOGIC_TIMERS];
+static uint16_t s_edges = 0;
+static uint8_t s_counter_inputs = 0;
+static uint8_t s_counter_out = 0;
+static uint16_t s_counter_value[LOGIC_COUNTERS];
+static uint8_t s_output_requests = 0; // last value stored to each output, pulses start on the rising edge
+
+static uint32_t s_now_ms = 0; // one time base for the whole scan
+static uint8_t s_inputs = 0; // sampled once per scan
+
+static uint64_t s_input_changed_us = 0; // 0 when no change is waiting for a scan
+static uint32_t s_scans = 0;
+static uint32_t s_scan_last_ns = 0;
+static uint32_t s_scan_max_ns = 0;
+static uint64_t s_scan_total_ns = 0;
+static uint32_t s_reaction_max_us = 0;
+static uint32_t s_saves = 0;
+
+static bool logic_ref_valid(uint8_t ref, bool store)
+{
+	uint8_t index = ref & 0x1F;
+	switch (ref >> 5)
+	{
+	case LOGIC_REF_INPUT:
+		return !store && index < NUM_INPUTS;
+	case LOGIC_REF_COIL:
+		return index < NUM_OUTPUTS;
+	case LOGIC_REF_MARKER:
+		return index < LOGIC_MARKERS;
+	case LOGIC_REF_TIMER:
+		return !store && index < LOGIC_TIMERS;
+	case LOGIC_REF_COUNTER:
+		return !store && index < LOGIC_COUNTERS;
+	case LOGIC_REF_OUTPUT:
+	case LOGIC_REF_INHIBIT:
+		return index < NUM_OUTPUTS;
+	case LOGIC_REF_CONST:
+		return !store && index < 2;
+	default:
+		return false;
+	}
+}
+
+// Returns LOGIC_NO_ERROR or the offset + 1 of the first instruction at fault
+static uint16_t logic_validate(const uint8_t *program, uint16_t size)
+{
+	uint8_t depth = 0;
+	uint16_t pc = 0;
+	while (pc < size)
+	{
+		uint8_t op = program[pc];
+		uint8_t length;
+		uint8_t needs; // stack entries the instruction takes
+		int8_t change;
+		bool ok = true;
+		switch (op)
+		{
+		case LOGIC_OP_END:
+			return LOGIC_NO_ERROR;
+		case LOGIC_OP_LD:
+		case LOGIC_OP_LDN:
+			length = 2; needs = 0; change = 1;
+			ok = pc + 1 < size && logic_ref_valid(program[pc + 1], false);
+			break;
+		case LOGIC_OP_AND:
+		case LOGIC_OP_OR:
+		case LOGIC_OP_XOR:
+			length = 1; needs = 2; change = -1;
+			break;
+		case LOGIC_OP_NOT:
+			length = 1; needs = 1; change = 0;
+			break;
+		case LOGIC_OP_DUP:
+			length = 1; needs = 1; change = 1;
+			break;
+		case LOGIC_OP_ST:
+			length = 2; needs = 1; change = -1;
+			ok = pc + 1 < size && logic_ref_valid(program[pc + 1], true);
+			break;
+		case LOGIC_OP_SET:
+		case LOGIC_OP_RST:
+			// A pulse starts on an edge, so outputs can only be stored
+			length = 2; needs = 1; change = -1;
+			ok = pc + 1 < size && logic_ref_valid(program[pc + 1], true) && program[pc + 1] >> 5 != LOGIC_REF_OUTPUT;
+			break;
+		case LOGIC_OP_TON:
+		case LOGIC_OP_TOF:
+			length = 4; needs = 1; change = 0;
+			ok = pc + 1 < size && program[pc + 1] < LOGIC_TIMERS;
+			break;
+		case LOGIC_OP_RTRIG:
+		case LOGIC_OP_FTRIG:
+			length = 2; needs = 1; change = 0;
+			ok = pc + 1 < size && program[pc + 1] < LOGIC_EDGES;
+			break;
+		case LOGIC_OP_CTU:
+			length = 4; needs = 2; change = -1;
+			ok = pc + 1 < size && program[pc + 1] < LOGIC_COUNTERS;
+			break;
+		case LOGIC_OP_CMP:
+			length = 6; needs = 0; change = 1;
+			ok = pc + 1 < size && (program[pc + 1] & 0x0F) <= LOGIC_CMP_LE
+				&& (program[pc + 1] >> 4 == MB_FUNC_READ_HOLDING_REGISTERS || program[pc + 1] >> 4 == MB_FUNC_READ_INPUT_REGISTER);
+			break;
+		default:
+			return pc + 1;
+		}
+		if (!ok || pc + length > size || depth < needs || depth + change > LOGIC_STACK_DEPTH)
+		{
+			return pc + 1;
+		}
+		depth += change;
+		pc += length;
+	}
+	return pc + 1; // ran off the end without END
+}
+
+static bool logic_load(uint8_t ref)
+{
+	uint8_t index = ref & 0x1F;
+	switch (ref >> 5)
+	{
+	case LOGIC_REF_INPUT:
+		return s_inputs & (1 << index);
+	case LOGIC_REF_COIL:
+		return mb_get_coil(index);
+	case LOGIC_REF_MARKER:
+		return s_markers & (1u << index);
+	case LOGIC_REF_TIMER:
+		return s_timer_out & (1 << index);
+	case LOGIC_REF_COUNTER:
+		return s_counter_out & (1 << index);
+	case LOGIC_REF_OUTPUT:
+		return output_busy(index);
+	case LOGIC_REF_INHIBIT:
+		return output_inhibited(index);
+	default:
+		return index;
+	}
+}
+
+static void logic_store(uint8_t ref, bool value)
+{
+	uint8_t index = ref & 0x1F;
+	switch (ref >> 5)
+	{
+	case LOGIC_REF_COIL:
+		if (value != mb_get_coil(index))
+		{
+			mb_set_coil(index, value);
+			sched_post(SCHED_TASK_OUTPUTS);
+		}
+		break;
+	case LOGIC_REF_MARKER:
+		s_markers = value ? s_markers | (1u << index) : s_markers & ~(1u << index);
+		break;
+	case LOGIC_REF_OUTPUT:
+		if (value && !(s_output_requests & (1 << index)))
+		{
+			pulse_output(index); // refused while busy or inhibited, like a coil write
+		}
+		s_output_requests = value ? s_output_requests | (1 << index) : s_output_requests & ~(1 << index);
+		break;
+	case LOGIC_REF_INHIBIT:
+		set_output_inhibit(index, value);
+		break;
+	}
+}
+
+static bool logic_compare(uint8_t table_op, uint16_t addr, uint16_t value)
+{
+	uint16_t current = table_op >> 4 == MB_FUNC_READ_HOLDING_REGISTERS ? mb_get_holding_register(addr) : mb_get_input_register(addr);
+	switch (table_op & 0x0F)
+	{
+	case LOGIC_CMP_EQ: return current == value;
+	case LOGIC_CMP_NE: return current != value;
+	case LOGIC_CMP_LT: return current < value;
+	case LOGIC_CMP_GE: return current >= value;
+	case LOGIC_CMP_GT: return current > value;
+	default: return current <= value;
+	}
+}
+
+static void logic_scan()
+{
+	uint32_t stack = 0; // top of stack in bit 0
+	const uint8_t *pc = s_program;
+
+	s_now_ms = (uint32_t)(time_us_64() / 1000);
+	s_inputs = 0;
+	for (uint8_t i = 0; i < NUM_INPUTS; i++)
+	{
+		s_inputs |= get_input(i) ? (1 << i) : 0;
+	}
+
+	for (;;)
+	{
+		uint8_t op = pc[0];
+		uint8_t n = pc[1];
+		uint16_t preset = (pc[2] << 8) | pc[3];
+		bool top = stack & 1;
+		switch (op)
+		{
+		case LOGIC_OP_END:
+			return;
+		case LOGIC_OP_LD:
+		case LOGIC_OP_LDN:
+			stack = (stack << 1) | (logic_load(n) ^ (op == LOGIC_OP_LDN));
+			pc += 2;
+			break;
+		case LOGIC_OP_AND:
+			stack = (stack >> 1) & (top ? ~0u : ~1u);
+			pc += 1;
+			break;
+		case LOGIC_OP_OR:
+			stack = (stack >> 1) | top;
+			pc += 1;
+			break;
+		case LOGIC_OP_XOR:
+			stack = (stack >> 1) ^ top;
+			pc += 1;
+			break;
+		case LOGIC_OP_NOT:
+			stack ^= 1;
+			pc += 1;
+			break;
+		case LOGIC_OP_DUP:
+			stack = (stack << 1) | top;
+			pc += 1;
+			break;
+		case LOGIC_OP_ST:
+			logic_store(n, top);
+			stack >>= 1;
+			pc += 2;
+			break;
+		case LOGIC_OP_SET:
+		case LOGIC_OP_RST:
+			if (top)
+			{
+				logic_store(n, op == LOGIC_OP_SET);
+			}
+			stack >>= 1;
+			pc += 2;
+			break;
+		case LOGIC_OP_TON:
+		case LOGIC_OP_TOF:
+		{
+			// TON times while its input is true, TOF while it is false after being true
+			uint16_t bit = 1 << n;
+			bool on_delay = op == LOGIC_OP_TON;
+			if (top == on_delay && (on_delay || (s_timer_out & bit)))
+			{
+				if (!(s_timer_running & bit))
+				{
+					s_timer_running |= bit;
+					s_timer_start_ms[n] = s_now_ms;
+				}
+				if (s_now_ms - s_timer_start_ms[n] >= preset)
+				{
+					s_timer_out = on_delay ? s_timer_out | bit : s_timer_out & ~bit;
+				}
+			}
+			else
+			{
+				s_timer_running &= ~bit;
+				s_timer_out = top && !on_delay ? s_timer_out | bit : on_delay ? s_timer_out & ~bit : s_timer_out;
+			}
+			stack = (stack & ~1u) | !!(s_timer_out & bit);
+			pc += 4;
+			break;
+		}
+		case LOGIC_OP_RTRIG:
+		case LOGIC_OP_FTRIG:
+		{
+			uint16_t bit = 1 << n;
+			bool previous = s_edges & bit;
+			s_edges = top ? s_edges | bit : s_edges & ~bit;
+			stack = (stack & ~1u) | (op == LOGIC_OP_RTRIG ? top && !previous : !top && previous);
+			pc += 2;
+			break;
+		}
+		case LOGIC_OP_CTU:
+		{
+			uint8_t bit = 1 << n;
+			bool count = (stack >> 1) & 1;
+			if (top)
+			{
+				s_counter_value[n] = 0;
+			}
+			else if (count && !(s_counter_inputs & bit) && s_counter_value[n] < UINT16_MAX)
+			{
+				s_counter_value[n]++;
+			}
+			s_counter_inputs = count ? s_counter_inputs | bit : s_counter_inputs & ~bit;
+			s_counter_out = s_counter_value[n] >= preset ? s_counter_out | bit : s_counter_out & ~bit;
+			stack = ((stack >> 1) & ~1u) | !!(s_counter_out & bit);
+			pc += 4;
+			break;
+		}
+		default: // LOGIC_OP_CMP, validation lets nothing else through
+			stack = (stack << 1) | logic_compare(n, preset, (pc[4] << 8) | pc[5]);
+			pc += 6;
+			break;
+		}
+	}
+}
+
+static void logic_reset_state()
+{
+	s_markers = 0;
+	s_timer_running = 0;
+	s_timer_out = 0;
+	s_edges = 0;
+	s_counter_inputs = 0;
+	s_counter_out = 0;
+	memset(s_counter_value, 0, sizeof(s_counter_value));
+	s_output_requests = 0;
+	// Inhibits belong to the program, a stopped or replaced one must not leave outputs locked
+	for (uint8_t i = 0; i < NUM_OUTPUTS; i++)
+	{
+		set_output_inhibit(i, false);
+	}
+}
+
+static void logic_start(const uint8_t *program, uint16_t size)
+{
+	memcpy(s_program, program, size);
+	s_program_size = size;
+	logic_reset_state();
+	s_running = true;
+	sched_post(SCHED_TASK_LOGIC);
+}
+
+static void logic_write()
+{
+	memset(s_flash.bytes, 0xFF, sizeof(s_flash.bytes));
+	s_flash.record.magic = LOGIC_MAGIC;
+	s_flash.record.size = s_running ? s_program_size : 0;
+	memcpy(s_flash.record.program, s_program, s_flash.record.size);
+	s_flash.record.crc = CRC16(s_flash.record.program, s_flash.record.size);
+
+	flash_io_erase(LOGIC_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+	flash_io_program(LOGIC_FLASH_OFFSET, s_flash.bytes, sizeof(s_flash.bytes));
+	s_saves++;
+}
+
+void logic_init()
+{
+	const logic_record_t *record = (const logic_record_t *)(XIP_BASE + LOGIC_FLASH_OFFSET);
+	if (record->magic == LOGIC_MAGIC && record->size > 0 && record->size <= LOGIC_PROGRAM_SIZE
+		&& record->crc == CRC16((uint8_t *)record->program, record->size)
+		&& logic_validate(record->program, record->size) == LOGIC_NO_ERROR)
+	{
+		logic_start(record->program, record->size);
+	}
+}
+
+uint8_t logic_command(uint16_t command)
+{
+	switch (command)
+	{
+	case LOGIC_CMD_STOP:
+		if (s_save_pending)
+		{
+			return MB_EXCEPTION_BUSY; // the save would no longer store what was asked for
+		}
+		s_running = false;
+		logic_reset_state();
+		return 0;
+	case LOGIC_CMD_RUN:
+		if (s_save_pending)
+		{
+			return MB_EXCEPTION_BUSY;
+		}
+		s_error = logic_validate(s_staging, s_staging_size);
+		if (s_error != LOGIC_NO_ERROR)
+		{
+			return MB_EXCEPTION_ILLEGAL_DATA;
+		}
+		logic_start(s_staging, s_staging_size);
+		return 0;
+	case LOGIC_CMD_SAVE:
+		// Stopped saves an empty record, so the board boots without a program
+		if (!s_save_pending)
+		{
+			s_save_pending = true;
+			s_save_requested_us = time_us_64();
+		}
+		sched_post(SCHED_TASK_LOGIC);
+		return MB_EXCEPTION_ACK; // accepted, completion via the command register
+	default:
+		return MB_EXCEPTION_ILLEGAL_DATA;
+	}
+}
+
+void logic_task()
+{
+	if (s_save_pending)
+	{
+		uint64_t now = time_us_64();
+		uint64_t deadline_us = s_save_requested_us + NVCONFIG_SAVE_TIMEOUT_US;
+		if (flash_io_ready(NVCONFIG_ERASE_IDLE_US, deadline_us))
+		{
+			logic_write();
+			s_save_pending = false;
+		}
+		else if (now >= deadline_us)
+		{
+			sched_post_at(SCHED_TASK_LOGIC, now + NVCONFIG_RETRY_US); // waiting for a gap between frames
+		}
+		else
+		{
+			uint64_t retry_us = now + NVCONFIG_ERASE_IDLE_US - mb_bus_idle_us();
+			sched_post_at(SCHED_TASK_LOGIC, retry_us < deadline_us ? retry_us : deadline_us);
+		}
+	}
+
+	if (!s_running)
+	{
+		s_input_changed_us = 0;
+		return;
+	}
+
+	uint32_t start_cycles = systick_hw->cvr;
+	if (s_input_changed_us)
+	{
+		uint32_t reaction_us = (uint32_t)(time_us_64() - s_input_changed_us);
+		if (reaction_us > s_reaction_max_us)
+		{
+			s_reaction_max_us = reaction_us;
+		}
+		s_input_changed_us = 0;
+	}
+
+	logic_scan();
+	sched_post_at(SCHED_TASK_LOGIC, time_us_64() + LOGIC_SCAN_US);
+
+	uint32_t cycles = (start_cycles - systick_hw->cvr) & 0x00FFFFFF; // SysTick counts down
+	s_scan_last_ns = (uint32_t)((uint64_t)cycles * 1000000000 / clock_get_hz(clk_sys));
+	if (s_scan_last_ns > s_scan_max_ns)
+	{
+		s_scan_max_ns = s_scan_last_ns;
+	}
+	s_scan_total_ns += s_scan_last_ns;
+	s_scans++;
+}
+
+void logic_input_changed()
+{
+	if (!s_running)
+	{
+		return;
+	}
+	if (!s_input_changed_us)
+	{
+		s_input_changed_us = time_us_64();
+	}
+	sched_post(SCHED_TASK_LOGIC);
+}
+
+static uint16_t logic_saturate16(uint32_t value)
+{
+	return value > UINT16_MAX ? UINT16_MAX : value;
+}
+
+uint16_t logic_hr_read(uint16_t addr)
+{
+	uint16_t offset = addr - MB_HR_LOGIC;
+	switch (offset)
+	{
+	case LOGIC_HR_COMMAND:
+		return s_save_pending ? LOGIC_SAVING : s_running ? LOGIC_RUNNING : LOGIC_STOPPED;
+	case LOGIC_HR_SIZE:
+		return s_staging_size;
+	case LOGIC_HR_ERROR:
+		return s_error;
+	default:
+		offset = (offset - LOGIC_HR_PROGRAM) * 2;
+		return (s_staging[offset] << 8) | s_staging[offset + 1];
+	}
+}
+
+uint8_t logic_hr_write(uint16_t addr, uint16_t value)
+{
+	uint16_t offset = addr - MB_HR_LOGIC;
+	switch (offset)
+	{
+	case LOGIC_HR_COMMAND:
+		return logic_command(value);
+	case LOGIC_HR_SIZE:
+		if (value > LOGIC_PROGRAM_SIZE)
+		{
+			return MB_EXCEPTION_ILLEGAL_DATA;
+		}
+		s_staging_size = value;
+		return 0;
+	case LOGIC_HR_ERROR:
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	default:
+		// Staging is separate from the running program, which only changes on LOGIC_CMD_RUN
+		offset = (offset - LOGIC_HR_PROGRAM) * 2;
+		s_staging[offset] = value >> 8;
+		s_staging[offset + 1] = value & 0xFF;
+		return 0;
+	}
+}
+
+uint8_t logic_file_read(uint16_t file, uint16_t record, uint16_t count, uint8_t *data)
+{
+	if (record + count > LOGIC_PROGRAM_SIZE / 2)
+	{
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+	memcpy(data, s_staging + record * 2, count * 2);
+	return 0;
+}
+
+uint8_t logic_file_write(uint16_t file, uint16_t record, uint16_t count, const uint8_t *data)
+{
+	if (record + count > LOGIC_PROGRAM_SIZE / 2)
+	{
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+	memcpy(s_staging + record * 2, data, count * 2);
+	return 0;
+}
+
+uint16_t logic_stats_read(uint16_t addr)
+{
+	switch (addr - MB_IR_LOGIC_STATS)
+	{
+	case LOGIC_STAT_STATE:
+		return logic_hr_read(MB_HR_LOGIC + LOGIC_HR_COMMAND);
+	case LOGIC_STAT_SCANS_HIGH:
+		return s_scans >> 16;
+	case LOGIC_STAT_SCANS_LOW:
+		return s_scans & 0xFFFF;
+	case LOGIC_STAT_SCAN_LAST_NS:
+		return logic_saturate16(s_scan_last_ns);
+	case LOGIC_STAT_SCAN_AVG_NS:
+		return s_scans ? logic_saturate16(s_scan_total_ns / s_scans) : 0;
+	case LOGIC_STAT_SCAN_MAX_NS:
+		return logic_saturate16(s_scan_max_ns);
+	case LOGIC_STAT_REACTION_MAX_US:
+		return logic_saturate16(s_reaction_max_us);
+	default:
+		return 0;
+	}
+}
+
+void logic_print_stats()
+{
+	static const char *state_names[] = { "STOPPED", "RUNNING", "SAVING" };
+
+	printf("** LOGIC **\r\n");
+	printf("STATE\t\t= %s\r\n", state_names[logic_hr_read(MB_HR_LOGIC + LOGIC_HR_COMMAND)]);
+	printf("PROGRAM\t\t= %u bytes (%u staged)\r\n", s_program_size, s_staging_size);
+	if (s_error != LOGIC_NO_ERROR)
+	{
+		printf("REJECTED AT\t= %u\r\n", s_error - 1);
+	}
+	printf("SCANS\t\t= %lu\r\n", s_scans);
+	printf("SCAN LAST\t= %lu ns\r\n", s_scan_last_ns);
+	printf("SCAN AVG\t= %lu ns\r\n", s_scans ? (uint32_t)(s_scan_total_ns / s_scans) : 0);
+	printf("SCAN MAX\t= %lu ns\r\n", s_scan_max_ns);
+	printf("REACTION MAX\t= %lu us (debounced input to scan)\r\n", s_reaction_max_us);
+	printf("SAVES\t\t= %lu\r\n", s_saves);
+}
+
+void logic_reset_stats()
+{
+	s_scans = 0;
+	s_scan_last_ns = 0;
+	s_scan_max_ns = 0;
+	s_scan_total_ns = 0;
+	s_reaction_max_us = 0;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "nvconfig.h"
+
+// Local interlocks without a bus round trip. A program is a straight list of
+// instructions over a bit stack (no jumps), run once per scan: every
+// LOGIC_SCAN_US and straight after a debounced input change, so a scan costs
+// the same every time and an input reaches an output within one task run.
+// The task is only woken while a program runs.
+//
+// A program is staged through LOGIC_HR_PROGRAM or as records of file
+// MB_FILE_LOGIC: LOGIC_PROGRAM_SIZE / 2 records, first byte high, the same
+// bytes the registers show. An FC15 request carries at most 122 records, so a
+// full program takes three, like FC16. The size still goes to LOGIC_HR_SIZE
+// and LOGIC_CMD_RUN loads it.
+#define LOGIC_SCAN_US 1000
+#define LOGIC_PROGRAM_SIZE 512 // bytes
+#define LOGIC_STACK_DEPTH 32
+#define LOGIC_MARKERS 32
+#define LOGIC_TIMERS 16
+#define LOGIC_EDGES 16
+#define LOGIC_COUNTERS 8
+
+// Stored in its own sector below the configuration log
+#define LOGIC_FLASH_OFFSET (NVCONFIG_FLASH_OFFSET - FLASH_SECTOR_SIZE)
+
+// Opcodes, operands follow in the listed order, 16-bit values high byte first
+enum LOGIC_OPCODES
+{
+	LOGIC_OP_END, // last instruction
+	LOGIC_OP_LD, // ref: push it
+	LOGIC_OP_LDN, // ref: push its inverse
+	LOGIC_OP_AND, // pop two, push both
+	LOGIC_OP_OR,
+	LOGIC_OP_XOR,
+	LOGIC_OP_NOT, // invert the top
+	LOGIC_OP_DUP,
+	LOGIC_OP_ST, // ref: pop into a coil, marker, output or inhibit
+	LOGIC_OP_SET, // ref: pop, set it when true
+	LOGIC_OP_RST, // ref: pop, clear it when true
+	LOGIC_OP_TON, // timer, preset ms: pop input, push true once it has been true for preset
+	LOGIC_OP_TOF, // timer, preset ms: pop input, push true until it has been false for preset
+	LOGIC_OP_RTRIG, // edge: pop, push true on the scan it turned true
+	LOGIC_OP_FTRIG, // edge: pop, push true on the scan it turned false
+	LOGIC_OP_CTU, // counter, preset: pop reset, pop count, push count >= preset
+	LOGIC_OP_CMP, // (table << 4) | LOGIC_CMP_*, register, value: push the comparison
+	LOGIC_OP_COUNT
+};
+
+// Operand of LD/LDN/ST/SET/RST: (type << 5) | index
+#define LOGIC_REF(type, index) (((type) << 5) | (index))
+enum LOGIC_REF_TYPES
+{
+	LOGIC_REF_INPUT, // debounced discrete input, read only
+	LOGIC_REF_COIL,
+	LOGIC_REF_MARKER, // internal bit
+	LOGIC_REF_TIMER, // output of TON/TOF n as last run, read only
+	LOGIC_REF_COUNTER, // output of CTU n as last run, read only
+	LOGIC_REF_OUTPUT, // reads busy; stored true starts a pulse when it turns true
+	LOGIC_REF_INHIBIT, // while set the output refuses to start, from logic, coils or the CLI
+	LOGIC_REF_CONST // index 0 or 1, read only
+};
+
+// Register tables for CMP are named by the function code that reads them
+enum LOGIC_CMP_OPS
+{
+	LOGIC_CMP_EQ,
+	LOGIC_CMP_NE,
+	LOGIC_CMP_LT,
+	LOGIC_CMP_GE,
+	LOGIC_CMP_GT,
+	LOGIC_CMP_LE
+};
+
+#define LOGIC_CMD_STOP 1
+#define LOGIC_CMD_RUN 2 // checks the staged program and runs it
+#define LOGIC_CMD_SAVE 3 // stores the running program, loaded again at boot
+
+enum LOGIC_STATES
+{
+	LOGIC_STOPPED,
+	LOGIC_RUNNING,
+	LOGIC_SAVING // running, the flash write waits for a quiet bus
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	// Holding registers from MB_HR_LOGIC
+	enum LOGIC_REGISTERS
+	{
+		LOGIC_HR_COMMAND, // write LOGIC_CMD_*, reads LOGIC_STATES
+		LOGIC_HR_SIZE, // bytes staged
+		LOGIC_HR_ERROR, // offset + 1 of the instruction the last run command rejected, 0 if it loaded
+		LOGIC_HR_PROGRAM, // LOGIC_PROGRAM_SIZE / 2 registers of staged program, first byte high
+		LOGIC_HR_COUNT = LOGIC_HR_PROGRAM + LOGIC_PROGRAM_SIZE / 2
+	};
+
+	// Input registers from MB_IR_LOGIC_STATS
+	enum LOGIC_STATS
+	{
+		LOGIC_STAT_STATE,
+		LOGIC_STAT_SCANS_HIGH,
+		LOGIC_STAT_SCANS_LOW,
+		LOGIC_STAT_SCAN_LAST_NS, // scan times saturate at 65535
+		LOGIC_STAT_SCAN_AVG_NS,
+		LOGIC_STAT_SCAN_MAX_NS,
+		LOGIC_STAT_REACTION_MAX_US, // debounced input change to the scan that saw it
+		LOGIC_STAT_COUNT
+	};
+
+	// Loads the stored program and runs it, after mb_init() has set up SysTick
+	void logic_init();
+
+	void logic_task();
+
+	// LOGIC_CMD_*, as written to LOGIC_HR_COMMAND. Returns an exception code or 0.
+	uint8_t logic_command(uint16_t command);
+
+	// A debounced input changed, scan straight away
+	void logic_input_changed();
+
+	void logic_print_stats();
+
+	void logic_reset_stats();
+
+	uint16_t logic_hr_read(uint16_t addr);
+
+	uint8_t logic_hr_write(uint16_t addr, uint16_t value);
+
+	uint16_t logic_stats_read(uint16_t addr);
+
+	uint8_t logic_file_read(uint16_t file, uint16_t record, uint16_t count, uint8_t *data);
+
+	uint8_t logic_file_write(uint16_t file, uint16_t record, uint16_t count, const uint8_t *data);
+
+#ifdef __cplusplus
+}
+#endif
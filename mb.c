@@ -1,14 +1,41 @@
 #include "mb.h"
 #include "pico/stdlib.h"
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include "crc.h"
+#include "build_version.h"
+#include "build_number.h"
 #include "bsp_functions.h"
+#include "scheduler.h"
+#include "nvconfig.h"
+#include "mb_master.h"
+#include "logic.h"
+#include "history.h"
+#include "image.h"
+#include "hardware/timer.h"
+#include "hardware/sync.h"
+#include "hardware/irq.h"
+#include "hardware/structs/systick.h"
+#include "hardware/structs/scb.h"
+#include "hardware/regs/m0plus.h"
+#if RS485_USE_PIO
+#include "rs485_pio.h"
+#endif
+
+#if MB_FAST_TURNAROUND && MB_DEBUG_ENABLE
+#error "MB_FAST_TURNAROUND handles frames in interrupt context where the debug output cannot be printed"
+#endif
+#if MB_MASTER && MB_FAST_TURNAROUND
+#error "MB_FAST_TURNAROUND answers requests, a master port has none to answer"
+#endif
 
-static const uint16_t MB_INTER_CHARACTER_DELAY = 750;
-static const uint16_t MB_INTER_FRAME_DELAY = 1750;
+static uint32_t s_t15_us = 750; // T1.5, set from the baud rate in mb_init()
+static uint32_t s_t35_us = 1750; // T3.5
 
+static uint8_t s_rx_buffer[MB_BUFFER_SIZE]; // filled by the receive interrupt, copied out once the frame is checked
+static uint16_t s_rx_count = 0;
 static uint8_t s_input_buffer[MB_BUFFER_SIZE];
 static uint16_t s_input_buffer_count = 0;
 static uint8_t s_output_buffer[MB_BUFFER_SIZE];
@@ -17,8 +44,33 @@ static uint8_t s_address = 0;
 static volatile enum MB_STATES s_mb_state = MB_INIT;
 static enum FRAME_STATUS s_mb_frame_status = MB_FRAME_OK;
 static uint64_t s_last_byte_us = 0;
-static uint16_t s_mb_serial_counters[8] = { 0 };
+static uint64_t s_echo_guard_us = 0; // turnaround residue before this time is not a new frame
+static volatile uint64_t s_first_reply_us = 0;
+static uint32_t s_char_time_us = 0;
+static uint8_t s_sym_size = RS485_SYM_SIZE; // bits per character on the line
+static uint32_t s_response_delay_us = MB_RESPONSE_DELAY_US;
+#if MB_FAST_TURNAROUND
+static int s_fast_alarm;
+#endif
+#if RS485_USE_PIO
+static bool s_pio_skipping = false; // characters coming in belong to a frame started while busy with the last
+#else
 static uart_hw_t *s_device;
+#endif
+
+// Flash lockout, see mb_flash_lockout(). mb_rx_capture() fills these while
+// flash is busy, mb_receive_char() takes them in order once it is back.
+#if RS485_USE_PIO
+static uint32_t s_rx_capture[MB_RX_CAPTURE_SIZE]; // raw RX FIFO words and RS485_PIO_FRAME_END_WORD
+#else
+static uint16_t s_rx_capture[MB_RX_CAPTURE_SIZE]; // UARTDR, character and error bits
+static uint32_t s_rx_capture_at[MB_RX_CAPTURE_SIZE]; // low word of the timer when read
+#endif
+static volatile uint16_t s_rx_capture_count = 0;
+static uint16_t s_rx_capture_next = 0;
+static bool s_rx_replay = false; // characters come from s_rx_capture, not the port
+static uint64_t s_rx_capture_base_us = 0; // time_us_64() at the release, dates the timer words
+static uint32_t s_flash_nvic_enabled = 0;
 
 #if MB_INPUTS
 static uint16_t s_mb_inputs[MB_INPUTS / 16 + (MB_INPUTS % 16 ? 1 : 0)] = { 0 };
@@ -28,16 +80,47 @@ static uint16_t s_mb_inputs[MB_INPUTS / 16 + (MB_INPUTS % 16 ? 1 : 0)] = { 0 };
 static uint16_t s_mb_coils[MB_COILS / 16 + (MB_COILS % 16 ? 1 : 0)] = { 0 };
 #endif
 
+typedef uint16_t (*mb_read_cb_t)(uint16_t addr);
+typedef uint8_t (*mb_write_cb_t)(uint16_t addr, uint16_t value); // returns an exception code or 0
+
+typedef struct
+{
+	uint16_t first;
+	uint16_t count;
+	uint16_t *storage; // NULL for callback blocks
+	mb_read_cb_t read;
+	mb_write_cb_t write;
+} mb_range_t;
+
+typedef struct
+{
+	const mb_range_t *ranges;
+	uint16_t range_count;
+	uint8_t table; // generation bumped on writes
+} mb_map_t;
+
+#define MB_RANGE_COUNT(ranges) (sizeof(ranges) / sizeof(ranges[0]))
+#define MB_NO_STORAGE(first, count)
+#define MB_NO_CALLBACK(first, count, read, write)
+#define MB_CALLBACK_RANGE(first, count, read, write) { first, count, NULL, read, write },
+
 #if MB_INPUT_REGISTERS
-static uint16_t s_mb_input_regsiters[MB_INPUT_REGISTERS] = { 0 };			  
+#define MB_IR_STORAGE(first, count) static uint16_t s_mb_ir_##first[count] = { 0 };
+#define MB_IR_RANGE(first, count) { first, count, s_mb_ir_##first, NULL, NULL },
+MB_INPUT_REGISTER_RANGES(MB_IR_STORAGE, MB_NO_CALLBACK)
+static const mb_range_t s_mb_input_register_ranges[] = { MB_INPUT_REGISTER_RANGES(MB_IR_RANGE, MB_CALLBACK_RANGE) };
 #endif 
 
 #if MB_HOLDING_REGISTERS
-static uint16_t s_mb_holding_regsiters[MB_HOLDING_REGISTERS] = { 0 };		
+#define MB_HR_STORAGE(first, count) static uint16_t s_mb_hr_##first[count] = { 0 };
+#define MB_HR_RANGE(first, count) { first, count, s_mb_hr_##first, NULL, NULL },
+MB_HOLDING_REGISTER_RANGES(MB_HR_STORAGE, MB_NO_CALLBACK)
+static const mb_range_t s_mb_holding_register_ranges[] = { MB_HOLDING_REGISTER_RANGES(MB_HR_RANGE, MB_CALLBACK_RANGE) };
 #endif
 
 
 
+// In FC08 sub-function order, counter n is returned by MB_DIAG_MSG_COUNT + n
 enum MB_COUNTERS
 {
 	MB_BUS_MESSAGE,
@@ -47,12 +130,309 @@ enum MB_COUNTERS
 	MB_NO_RESPONSE,
 	MB_NAK,
 	MB_BUSY,
-	MB_OVERRUN
+	MB_OVERRUN,
+	MB_COUNTER_COUNT
+};
+
+// Counted from the receive interrupt, the task and, with MB_FAST_TURNAROUND,
+// the T3.5 alarm, so every read-modify-write goes through MB_COUNT() or runs
+// with interrupts masked. The event log and FC0B counter below likewise.
+static volatile uint32_t s_mb_serial_counters[MB_COUNTER_COUNT] = { 0 };
+
+#define MB_COUNT(counter) \
+	do \
+	{ \
+		uint32_t irq_state = save_and_disable_interrupts(); \
+		s_mb_serial_counters[counter]++; \
+		restore_interrupts(irq_state); \
+	} while (0)
+
+// FC0C event bytes
+#define MB_EVENT_RESTART 0x00
+#define MB_EVENT_ENTERED_LISTEN_ONLY 0x04
+#define MB_EVENT_RECEIVE 0x80
+#define MB_EVENT_RECEIVE_COM_ERROR 0x02
+#define MB_EVENT_RECEIVE_OVERRUN 0x10
+#define MB_EVENT_RECEIVE_BROADCAST 0x40
+#define MB_EVENT_SEND 0x40
+#define MB_EVENT_SEND_READ_EXCEPTION 0x01 // exception codes 1-3
+#define MB_EVENT_SEND_ABORT_EXCEPTION 0x02 // code 4
+#define MB_EVENT_SEND_BUSY_EXCEPTION 0x04 // codes 5-6
+#define MB_EVENT_SEND_NAK_EXCEPTION 0x08 // code 7
+#define MB_EVENT_LISTEN_ONLY 0x20 // on receive and send events
+
+static uint8_t s_event_log[MB_EVENT_LOG_SIZE];
+static uint8_t s_event_head = 0; // slot the next event goes to
+static uint8_t s_event_count = 0;
+static uint32_t s_comm_event_counter = 0; // requests completed without an exception, FC0B
+static bool s_listen_only = false; // FC08 sub 04, left only through sub 01
+static bool s_frame_overrun = false;
+
+// ASCII framing, chosen at mb_init(). Hex pairs are decoded into s_rx_buffer
+// as they arrive with the LRC and CRC kept running, so the end of a frame has
+// nothing left to walk over: the LRC byte is swapped for the CRC and the rest
+// of the stack sees the same frame RTU would have delivered.
+static bool s_ascii = false;
+static uint8_t s_ascii_delimiter = MB_ASCII_DELIMITER;
+static bool s_ascii_nibble = false; // high nibble of s_ascii_byte is in, waiting for the low one
+static uint8_t s_ascii_byte = 0;
+static bool s_ascii_cr = false;
+static uint8_t s_ascii_lrc = 0; // sums to zero over the frame and its LRC
+static uint16_t s_ascii_crc = 0xFFFF;
+static uint16_t s_ascii_crc_prev = 0xFFFF; // CRC before the last byte, the frame without its LRC
+static uint8_t s_ascii_output[MB_ASCII_BUFFER_SIZE];
+
+// Bus telemetry, one bucket per second. Buckets are claimed by the first
+// writer of a new second and stamped with it, so a quiet second simply leaves
+// a stale stamp that the window sums skip.
+typedef struct
+{
+	uint32_t second; // s_bus_second the counts belong to
+	uint32_t chars; // received and sent
+	uint16_t frames_ours; // CRC-valid and addressed to one of our units or broadcast
+	uint16_t frames_other;
+	uint16_t crc_errors;
+	uint16_t parity_errors;
+	uint16_t framing_errors;
+	uint16_t overruns;
+	uint16_t gap_count; // master gaps, end of our reply to the start of the next frame
+	uint32_t gap_total_us;
+	uint32_t gap_min_us;
+	uint32_t gap_max_us;
+} mb_bus_bucket_t;
+
+typedef struct
+{
+	uint32_t second; // s_bus_second the sums were taken at
+	uint32_t chars;
+	uint32_t frames_ours;
+	uint32_t frames_other;
+	uint32_t crc_errors;
+	uint32_t parity_errors;
+	uint32_t framing_errors;
+	uint32_t overruns;
+	uint32_t gap_count;
+	uint64_t gap_total_us;
+	uint32_t gap_min_us;
+	uint32_t gap_max_us;
+} mb_bus_window_t;
+
+static const uint8_t s_bus_window_seconds[MB_BUS_WINDOWS] = { 1, 10, 60 };
+static mb_bus_bucket_t s_bus_buckets[MB_BUS_HISTORY_S + 1]; // the current second is never summed
+static mb_bus_window_t s_bus_windows[MB_BUS_WINDOWS]; // recomputed once per second when read
+static uint32_t s_bus_second = 0;
+static uint64_t s_bus_second_end_us = 1000000;
+static uint32_t s_baud = 0;
+static uint64_t s_frame_start_us = 0;
+static uint64_t s_reply_end_us = 0; // 0 once the following frame was timed
+
+#define MB_TURNAROUND_BUCKETS 16 // log2 buckets of how late a reply started
+
+enum MB_TURNAROUND_CLASSES
+{
+	MB_TURNAROUND_FC02,
+	MB_TURNAROUND_FC05,
+	MB_TURNAROUND_OTHER,
+	MB_TURNAROUND_CLASS_COUNT
+};
+
+typedef struct
+{
+	uint32_t count;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t total_us;
+	uint32_t late[MB_TURNAROUND_BUCKETS]; // past the earliest allowed start, bucket n < 2^n us
+} mb_turnaround_t;
+
+static mb_turnaround_t s_turnaround[MB_TURNAROUND_CLASS_COUNT];
+
+enum MB_TABLES
+{
+	MB_TABLE_INPUTS,
+	MB_TABLE_COILS,
+	MB_TABLE_INPUT_REGISTERS,
+	MB_TABLE_HOLDING_REGISTERS,
+	MB_TABLE_COUNT
+};
+
+static uint32_t s_table_generation[MB_TABLE_COUNT] = { 0 }; // bumped whenever a value in the table changes
+static bool s_reply_uncacheable = false; // set when a reply read a callback block
+static bool s_reply_suppressed = false; // set by the FC08 sub-functions that are never answered
+static volatile bool s_transport_busy = false; // a frame from another transport holds the buffers
+
+#if MB_INPUT_REGISTERS
+static const mb_map_t s_mb_input_register_map = { s_mb_input_register_ranges, MB_RANGE_COUNT(s_mb_input_register_ranges), MB_TABLE_INPUT_REGISTERS };
+#endif
+#if MB_HOLDING_REGISTERS
+static const mb_map_t s_mb_holding_register_map = { s_mb_holding_register_ranges, MB_RANGE_COUNT(s_mb_holding_register_ranges), MB_TABLE_HOLDING_REGISTERS };
+#endif
+static uint16_t mb_diagnostic_read(uint16_t addr);
+static const mb_range_t s_mb_diagnostic_ranges[] = { { 0, MB_COUNTER_COUNT * 2, NULL, mb_diagnostic_read, NULL } };
+static const mb_map_t s_mb_diagnostic_map = { s_mb_diagnostic_ranges, MB_RANGE_COUNT(s_mb_diagnostic_ranges), MB_TABLE_COUNT };
+
+typedef struct
+{
+	uint8_t id; // unused for the first unit, it answers to s_address
+	bool bits; // coils and discrete inputs visible
+	const mb_map_t *input_registers; // NULL when the table is not built
+	const mb_map_t *holding_registers;
+} mb_unit_t;
+
+// Views of the virtual units from MB_UNITS(), aliasing the same block storage
+#define MB_NO_VIEW(MB_ALIAS)
+#define MB_IR_ALIAS(first, count, block, offset) { first, count, s_mb_ir_##block + (offset), NULL, NULL },
+#define MB_HR_ALIAS(first, count, block, offset) { first, count, s_mb_hr_##block + (offset), NULL, NULL },
+#define MB_IR_ALIAS_CHECK(first, count, block, offset) \
+	_Static_assert((offset) + (count) <= MB_RANGE_COUNT(s_mb_ir_##block), "unit view runs past input register block " #block);
+#define MB_HR_ALIAS_CHECK(first, count, block, offset) \
+	_Static_assert((offset) + (count) <= MB_RANGE_COUNT(s_mb_hr_##block), "unit view runs past holding register block " #block);
+#define MB_UNIT_VIEWS(id, bits, ir, hr) \
+	ir(MB_IR_ALIAS_CHECK) \
+	hr(MB_HR_ALIAS_CHECK) \
+	static const mb_range_t s_mb_unit##id##_ir_ranges[] = { ir(MB_IR_ALIAS) }; \
+	static const mb_range_t s_mb_unit##id##_hr_ranges[] = { hr(MB_HR_ALIAS) }; \
+	static const mb_map_t s_mb_unit##id##_ir_map = { s_mb_unit##id##_ir_ranges, MB_RANGE_COUNT(s_mb_unit##id##_ir_ranges), MB_TABLE_INPUT_REGISTERS }; \
+	static const mb_map_t s_mb_unit##id##_hr_map = { s_mb_unit##id##_hr_ranges, MB_RANGE_COUNT(s_mb_unit##id##_hr_ranges), MB_TABLE_HOLDING_REGISTERS };
+#define MB_UNIT_ENTRY(id, bits, ir, hr) { id, bits, &s_mb_unit##id##_ir_map, &s_mb_unit##id##_hr_map },
+MB_UNITS(MB_UNIT_VIEWS)
+
+static const mb_unit_t s_mb_units[] =
+{
+	{
+		0,
+		true,
+	#if MB_INPUT_REGISTERS
+		&s_mb_input_register_map,
+	#else
+		NULL,
+	#endif
+	#if MB_HOLDING_REGISTERS
+		&s_mb_holding_register_map,
+	#else
+		NULL,
+	#endif
+	},
+	MB_UNITS(MB_UNIT_ENTRY)
 };
+static const mb_unit_t *s_unit = &s_mb_units[0]; // unit the frame being handled is for
+static uint32_t s_unit_bitmap[256 / 32] = { 0 }; // bit per unit id answered, the address filter is one test
+
+#if MB_RESPONSE_CACHE_ENTRIES
+#define MB_CACHE_KEY_SIZE 6 // unit id, function, start and quantity, CRC excluded
+
+typedef struct
+{
+	uint8_t request[MB_CACHE_KEY_SIZE];
+	uint8_t table;
+	uint32_t generation; // table generation the reply was built from
+	uint16_t response_count; // 0 = empty slot
+	uint8_t response[MB_RESPONSE_CACHE_FRAME_SIZE];
+} mb_cache_entry_t;
+
+static mb_cache_entry_t s_cache[MB_RESPONSE_CACHE_ENTRIES];
+static uint8_t s_cache_next = 0;
+static uint32_t s_cache_hits = 0;
+static uint32_t s_cache_misses = 0;
+static uint64_t s_cache_hit_cycles = 0;
+static uint64_t s_cache_miss_cycles = 0;
+
+static bool mb_cache_lookup(bool *missed);
+static void mb_cache_store();
+#endif
+
+static void mb_frame_check();
+static uint32_t mb_frame_gap_us();
+static void mb_driver_enable();
+static uint32_t mb_reply_holdoff_us();
+static void mb_record_turnaround(uint8_t function, uint32_t turnaround_us);
+#if MB_FAST_TURNAROUND
+static void mb_fast_arm(uint64_t when_us);
+static void mb_fast_alarm_callback(uint alarm_num);
+#endif
+static uint16_t mb_parse_word(uint16_t offset);
+static void mb_map_check(const mb_map_t *map);
+static void mb_units_update();
+static bool mb_map_covers(const mb_map_t *map, uint16_t addr, uint16_t quantity, bool write);
+static uint16_t mb_map_read(const mb_map_t *map, uint16_t addr);
+static uint8_t mb_map_write(const mb_map_t *map, uint16_t addr, uint16_t value);
+static void mb_map_copy(const mb_map_t *map, uint16_t addr, uint16_t quantity);
+#if MB_INPUT_REGISTERS || MB_HOLDING_REGISTERS
+static void mb_read_registers(const mb_map_t *map);
+#endif
+static void mb_scatter_read();
+static void mb_read_file_record();
+static void mb_write_file_record();
+static void mb_diagnostics();
+static void mb_get_comm_event_counter();
+static void mb_get_comm_event_log();
+static void mb_report_server_id();
+static void mb_read_device_id();
+static void mb_log_event(uint8_t event);
+static void mb_request_done();
+static mb_bus_bucket_t *mb_bus_bucket();
 
-void mb_init(uint8_t address)
+// Adds to a bucket field the receive interrupt counts into as well
+#define MB_BUS_ADD(field, n) \
+	do \
+	{ \
+		uint32_t irq_state = save_and_disable_interrupts(); \
+		mb_bus_bucket()->field += (n); \
+		restore_interrupts(irq_state); \
+	} while (0)
+
+void mb_init(uint8_t address, uint32_t baud, uart_parity_t parity, uint8_t framing)
 {
 	s_address = address;
+	s_ascii = framing == MB_FRAMING_ASCII && !MB_MASTER; // the master only speaks RTU
+	mb_reset_turnaround();
+	for (uint8_t i = 0; i < MB_BUS_WINDOWS; i++)
+	{
+		s_bus_windows[i].second = UINT32_MAX;
+	}
+	#if MB_INPUT_REGISTERS
+		mb_map_check(&s_mb_input_register_map);
+	#endif
+	#if MB_HOLDING_REGISTERS
+		mb_map_check(&s_mb_holding_register_map);
+	#endif
+	for (uint8_t i = 1; i < MB_RANGE_COUNT(s_mb_units); i++)
+	{
+		if (s_mb_units[i].id == MB_BROADCAST_ID || s_mb_units[i].id > 247)
+		{
+			panic("Modbus unit id %u out of range", s_mb_units[i].id);
+		}
+		mb_map_check(s_mb_units[i].input_registers);
+		mb_map_check(s_mb_units[i].holding_registers);
+	}
+	mb_units_update();
+	
+	// SysTick free-runs on the CPU clock, only used to time function processing
+	systick_hw->rvr = 0x00FFFFFF;
+	systick_hw->cvr = 0;
+	systick_hw->csr = 0x5;
+	
+	// Above 19200 baud the spec fixes T1.5/T3.5 at 750/1750 us
+	if (baud <= 19200)
+	{
+		s_t15_us = 3 * RS485_SYM_SIZE * 1000000 / (2 * baud);
+		s_t35_us = 7 * RS485_SYM_SIZE * 1000000 / (2 * baud);
+	}
+	
+#if MB_FAST_TURNAROUND
+	s_fast_alarm = hardware_alarm_claim_unused(true);
+	hardware_alarm_set_callback(s_fast_alarm, mb_fast_alarm_callback);
+#endif
+	
+#if RS485_USE_PIO
+	// The RX state machine only reports a character once T3.5 has passed since
+	// the last one, so the bus is known idle without waiting here
+	rs485_pio_init(baud, parity, mb_receive_char);
+	s_baud = baud;
+	s_char_time_us = (s_sym_size * 1000000 + baud - 1) / baud;
+	s_last_byte_us = time_us_64();
+	s_mb_state = MB_IDLE;
+#else
 	s_device = uart_get_hw(RS485_DEV);
 	gpio_set_function(RS485_TX_PIN, GPIO_FUNC_UART);
 	gpio_set_function(RS485_RX_PIN, GPIO_FUNC_UART);
@@ -62,202 +442,773 @@ void mb_init(uint8_t address)
 	gpio_init(RS485_RX_EN_PIN);
 	gpio_set_dir(RS485_RX_EN_PIN, GPIO_OUT);
 	
-	uint baud = uart_init(RS485_DEV, RS485_BAUD);
+	baud = uart_init(RS485_DEV, baud);
 	#if MB_DEBUG_ENABLE
-		printf("Baud Actual: %d", baud);
+		printf("Baud Actual: %lu", baud);
 	#endif // MB_DEBUG_ENABLE == 1
-	uart_set_format(RS485_DEV, RS485_DATA_BITS, RS485_STOP_BITS, RS485_PARITY);
+	uint8_t data_bits = s_ascii ? MB_ASCII_DATA_BITS : RS485_DATA_BITS;
+	s_baud = baud;
+	s_sym_size = 1 + data_bits + RS485_STOP_BITS + 1;
+	s_char_time_us = (s_sym_size * 1000000 + baud - 1) / baud;
+	uart_set_format(RS485_DEV, data_bits, RS485_STOP_BITS, parity);
 	uart_set_hw_flow(RS485_DEV, false, false);
 	uart_set_fifo_enabled(RS485_DEV, true);
 	
+	// Joining mid-frame, so everything is dropped until the bus has been idle
+	// for T3.5. The task does the waiting, the rest of boot carries on meanwhile.
 	s_last_byte_us = time_us_64();
-	while (uart_is_readable_within_us(RS485_DEV, MB_INTER_FRAME_DELAY))
-	{
-		uart_getc(RS485_DEV); //drop chars until bus is idle for T3.5
-	}
+	s_mb_frame_status = MB_FRAME_NOK;
+	s_mb_state = MB_DISCARD;
 	
 	irq_set_exclusive_handler(RS485_IRQ, mb_receive_char);
 	irq_set_enabled(RS485_IRQ, true);
 	uart_set_irq_enables(RS485_DEV, true, false);
-	s_mb_state = MB_IDLE;
+	sched_post(SCHED_TASK_MODBUS);
+#endif
 }
 
 void mb_set_id(uint8_t address)
 {
 	s_address = address;
+	mb_units_update();
 }
 
-void mb_receive_char()
+static void mb_units_update()
 {
-	if (s_mb_state == MB_IDLE)
+	uint32_t bitmap[MB_RANGE_COUNT(s_unit_bitmap)] = { 0 };
+	bitmap[s_address / 32] |= 1u << (s_address % 32);
+	for (uint8_t i = 1; i < MB_RANGE_COUNT(s_mb_units); i++)
+	{
+		bitmap[s_mb_units[i].id / 32] |= 1u << (s_mb_units[i].id % 32);
+	}
+	
+	// Word by word, a frame checked meanwhile sees either the old or the new id
+	for (uint8_t i = 0; i < MB_RANGE_COUNT(s_unit_bitmap); i++)
+	{
+		s_unit_bitmap[i] = bitmap[i];
+	}
+}
+
+static const mb_unit_t *mb_unit_find(uint8_t unit)
+{
+	for (uint8_t i = 1; i < MB_RANGE_COUNT(s_mb_units); i++)
+	{
+		if (s_mb_units[i].id == unit && unit != s_address)
+		{
+			return &s_mb_units[i];
+		}
+	}
+	return &s_mb_units[0]; // the DIP switch address and broadcasts
+}
+
+void mb_print_units()
+{
+	printf("Unit IDs: %u", s_address);
+	for (uint8_t i = 1; i < MB_RANGE_COUNT(s_mb_units); i++)
+	{
+		printf(", %u%s", s_mb_units[i].id, s_mb_units[i].id == s_address ? " (shadowed)" : "");
+	}
+	printf("\r\n");
+}
+
+static int8_t mb_hex_value(uint8_t c)
+{
+	if (c >= '0' && c <= '9') { return c - '0'; }
+	if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+	if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+	return -1;
+}
+
+// One character of an ASCII frame, receive interrupt only. Silence means
+// nothing here, a ':' starts a frame wherever it turns up and CR followed by
+// the delimiter hands it to the task.
+static void mb_ascii_receive(uint8_t c, mb_bus_bucket_t *bucket)
+{
+	if (c == MB_ASCII_START && (s_mb_state == MB_IDLE || s_mb_state == MB_RECEPTION))
 	{
-		s_input_buffer_count = 0; 
+		s_rx_count = 0;
 		s_mb_frame_status = MB_FRAME_OK;
+		s_frame_overrun = false;
+		s_frame_start_us = s_last_byte_us - s_char_time_us;
+		s_ascii_nibble = false;
+		s_ascii_cr = false;
+		s_ascii_lrc = 0;
+		s_ascii_crc = 0xFFFF;
+		s_ascii_crc_prev = 0xFFFF;
 		s_mb_state = MB_RECEPTION;
-		while (uart_is_readable_within_us(RS485_DEV, MB_INTER_CHARACTER_DELAY))
+		return;
+	}
+	if (s_mb_state != MB_RECEPTION)
+	{
+		return; // between frames, or still handling the last one
+	}
+	
+	if (s_ascii_cr)
+	{
+		// Anything but the delimiter after CR spoils the frame, it still ends here
+		if (c != s_ascii_delimiter || s_ascii_nibble)
 		{
-			if (s_input_buffer_count < MB_BUFFER_SIZE)
-			{
-				s_input_buffer[s_input_buffer_count++] = uart_getc(RS485_DEV);
-			}
-			else
-			{
-				uart_getc(RS485_DEV);
-				s_mb_frame_status = MB_FRAME_NOK; // overrun error
-				s_mb_serial_counters[MB_OVERRUN]++;
-			}
-			s_last_byte_us = time_us_64();
+			s_mb_frame_status = MB_FRAME_NOK;
+		}
+		else if (s_ascii_lrc)
+		{
+			s_mb_frame_status = MB_FRAME_NOK;
+			bucket->crc_errors++;
+		}
+		else if (s_rx_count)
+		{
+			s_rx_buffer[s_rx_count - 1] = s_ascii_crc_prev & 0xFF;
+			s_rx_buffer[s_rx_count++] = s_ascii_crc_prev >> 8;
 		}
 		s_mb_state = MB_WAITING;
+		return;
 	}
-	else if (s_mb_state == MB_WAITING || s_mb_state == MB_PROCESSING_RESPONSE || s_mb_state == MB_PROCESSING_NO_RESPONSE)
+	if (c == '\r')
 	{
-		// incomplete frame discard until idle
-		while (uart_is_readable(RS485_DEV))
-		{
-			uart_getc(RS485_DEV);
-			s_mb_frame_status = MB_FRAME_NOK;
-			s_last_byte_us = time_us_64();
-		}	
+		s_ascii_cr = true;
+		return;
+	}
+	
+	int8_t value = mb_hex_value(c);
+	if (value < 0)
+	{
+		s_mb_frame_status = MB_FRAME_NOK;
+		return;
+	}
+	if (!s_ascii_nibble)
+	{
+		s_ascii_byte = value << 4;
+		s_ascii_nibble = true;
+		return;
 	}
+	s_ascii_nibble = false;
 	
-	if (s_device->dr & (UART_UARTDR_PE_BITS | UART_UARTDR_FE_BITS | UART_UARTDR_OE_BITS))
+	uint8_t byte = s_ascii_byte | value;
+	if (s_rx_count >= MB_BUFFER_SIZE - 1) // the LRC grows into a two byte CRC
 	{
-		s_mb_frame_status = MB_FRAME_NOK; // mark frame bad
-		s_device->rsr = 0; // clear error
+		s_mb_frame_status = MB_FRAME_NOK; // overrun error
+		MB_COUNT(MB_OVERRUN);
+		s_frame_overrun = true;
+		bucket->overruns++;
+		return;
 	}
+	s_rx_buffer[s_rx_count++] = byte;
+	s_ascii_lrc += byte;
+	s_ascii_crc_prev = s_ascii_crc;
+	s_ascii_crc = CRC16_update(s_ascii_crc, byte);
 }
 
-void mb_process()
+static const char s_hex_digits[] = "0123456789ABCDEF";
+
+// Writes the reply in s_output_buffer as an ASCII frame, its CRC replaced by an LRC
+static uint16_t mb_ascii_encode()
 {
-	uint64_t diffTime = time_us_64() - s_last_byte_us;
-	switch (s_mb_state)
+	uint16_t count = 0;
+	uint8_t lrc = 0;
+	s_ascii_output[count++] = MB_ASCII_START;
+	for (uint16_t i = 0; i < s_output_buffer_count - 2; i++)
 	{
-	case MB_WAITING:
-		if (s_mb_frame_status != MB_FRAME_OK || s_input_buffer_count <= 3)
-		{
-			s_mb_serial_counters[MB_BUS_COM_ERROR]++;
-			s_mb_state = MB_DISCARD;
-			#if MB_DEBUG_ENABLE		
-				printf("FRAME NOT OK!\r\n");
-				printf("Frame (Size = %d):\r\n", s_input_buffer_count);		
-				for (uint8_t i = 0; i < s_input_buffer_count; i++)
-				{
-					printf("%02X ", s_input_buffer[i]);
-				}
-				printf("\r\n");		 	
-			#endif // MB_DEBUG_ENABLE == 1
-			
-			break;
-		}
-		// FRAME OK, LENGTH OK
-		uint16_t frame_crc = ((uint16_t)s_input_buffer[s_input_buffer_count - 1]) << 8;
-		frame_crc |= s_input_buffer[s_input_buffer_count - 2];
+		lrc += s_output_buffer[i];
+		s_ascii_output[count++] = s_hex_digits[s_output_buffer[i] >> 4];
+		s_ascii_output[count++] = s_hex_digits[s_output_buffer[i] & 0x0F];
+	}
+	lrc = -lrc;
+	s_ascii_output[count++] = s_hex_digits[lrc >> 4];
+	s_ascii_output[count++] = s_hex_digits[lrc & 0x0F];
+	s_ascii_output[count++] = '\r';
+	s_ascii_output[count++] = s_ascii_delimiter;
+	return count;
+}
+
+#if RS485_USE_PIO
+// Next character, from the flash lockout capture while it is replayed
+static bool mb_pio_getc(uint8_t *c, uint8_t *flags)
+{
+	if (!s_rx_replay)
+	{
+		return rs485_pio_getc(c, flags);
+	}
+	if (s_rx_capture_next == s_rx_capture_count || s_rx_capture[s_rx_capture_next] == RS485_PIO_FRAME_END_WORD)
+	{
+		return false;
+	}
+	rs485_pio_decode(s_rx_capture[s_rx_capture_next++], c, flags);
+	return true;
+}
+
+static bool mb_pio_frame_end()
+{
+	if (!s_rx_replay)
+	{
+		return rs485_pio_frame_end();
+	}
+	if (s_rx_capture_next < s_rx_capture_count && s_rx_capture[s_rx_capture_next] == RS485_PIO_FRAME_END_WORD)
+	{
+		s_rx_capture_next++;
+		return true;
+	}
+	return false;
+}
 
-		if (frame_crc != CRC16(s_input_buffer, s_input_buffer_count - 2))
+void mb_receive_char()
+{
+	uint8_t c;
+	uint8_t flags;
+	mb_bus_bucket_t *bucket = mb_bus_bucket();
+	while (mb_pio_getc(&c, &flags))
+	{
+		s_last_byte_us = time_us_64();
+		if (s_mb_state == MB_IDLE && s_last_byte_us < s_echo_guard_us)
 		{
-			s_mb_serial_counters[MB_BUS_COM_ERROR]++;
-			s_mb_state = MB_DISCARD;
-			#if MB_DEBUG_ENABLE	
-				printf("CRC NOT OK!");
-			#endif // MB_DEBUG_ENABLE == 1
-			break;
+			continue; // line settling after we released the driver
 		}
-		//CRC OK
 		
-		s_mb_serial_counters[MB_BUS_MESSAGE]++;
+		bucket->chars++;
+		bucket->framing_errors += (flags & RS485_PIO_FRAMING_ERROR) ? 1 : 0;
+		bucket->parity_errors += (flags & RS485_PIO_PARITY_ERROR) ? 1 : 0;
 		
-		if (s_input_buffer[0] != s_address && s_input_buffer[0] != 0)
+		if (s_ascii)
 		{
-			// MSG NOT FOR ME
-			s_mb_state = MB_DISCARD;
-			break;
+			mb_ascii_receive(c, bucket);
+			if (s_mb_state == MB_RECEPTION && (flags & (RS485_PIO_FRAMING_ERROR | RS485_PIO_PARITY_ERROR)))
+			{
+				s_mb_frame_status = MB_FRAME_NOK;
+			}
+			continue;
 		}
-
-		// MSG FOR ME
-		s_mb_serial_counters[MB_MESSAGE]++;
-		if (s_input_buffer[0] == 0)
+		
+		if (s_mb_state == MB_RECEPTION && (flags & RS485_PIO_GAP_T35))
 		{
-			s_mb_serial_counters[MB_NO_RESPONSE]++;
-			s_mb_state = MB_PROCESSING_NO_RESPONSE;
-			break;
+			// Previous frame ended before we saw the end-of-frame flag. We only
+			// hold one frame, so this one is lost without spoiling the last.
+			s_mb_state = MB_WAITING;
+			s_pio_skipping = true;
+			continue;
 		}
-		s_mb_state = MB_PROCESSING_RESPONSE;
-		break;
-		// \/ Intentional Fall Through \/
-	case MB_PROCESSING_RESPONSE:	
-	case MB_PROCESSING_NO_RESPONSE:
-	case MB_DISCARD:
-		if (s_mb_frame_status == MB_FRAME_NOK)
-			s_mb_state = MB_DISCARD;
-		
-		if (diffTime < MB_INTER_FRAME_DELAY)
-			break;
 		
-		if (s_mb_state == MB_DISCARD)
+		if (s_mb_state == MB_IDLE)
 		{
-			s_mb_state = MB_IDLE;
-			break;
+			s_pio_skipping = false;
+			s_rx_count = 0;
+			s_mb_frame_status = MB_FRAME_OK;
+			s_frame_overrun = false;
+			s_frame_start_us = s_last_byte_us - s_char_time_us; // reported once the stop bit is in
+			s_mb_state = MB_RECEPTION;
 		}
-		
-		mb_function_process();
-		
-		//s_input_buffer_count = 0; // Discard Packet
-		if (s_mb_state == MB_PROCESSING_NO_RESPONSE)
+		else if (s_mb_state != MB_RECEPTION)
 		{
-			s_mb_state = MB_IDLE;
-			return;
+			// T1.5 < gap < T3.5 after a complete frame spoils it, a new frame is
+			// just not heard. Only its first character carries the T3.5 flag, the
+			// rest of it must leave the finished frame alone.
+			if (flags & RS485_PIO_GAP_T35)
+			{
+				s_pio_skipping = true;
+			}
+			else if (!s_pio_skipping)
+			{
+				s_mb_frame_status = MB_FRAME_NOK;
+			}
+			continue;
 		}
 		
-		s_mb_state = MB_EMISSION;
-		break;
-		
-	case MB_EMISSION:
+		if (flags & (RS485_PIO_FRAMING_ERROR | RS485_PIO_PARITY_ERROR))
+		{
+			s_mb_frame_status = MB_FRAME_NOK;
+		}
+		if ((flags & RS485_PIO_GAP_T15) && s_rx_count)
+		{
+			s_mb_frame_status = MB_FRAME_NOK; // inter-character gap over T1.5
+		}
 		
-		#if MB_DEBUG_ENABLE	
-			printf("Frame (Size = %d):\r\n", s_input_buffer_count);		
-			for (uint8_t i = 0; i < s_input_buffer_count; i++)
+		if (s_rx_count < MB_BUFFER_SIZE)
+		{
+			s_rx_buffer[s_rx_count++] = c;
+		}
+		else
+		{
+			s_mb_frame_status = MB_FRAME_NOK; // overrun error
+			MB_COUNT(MB_OVERRUN);
+			s_frame_overrun = true;
+			bucket->overruns++;
+		}
+	}
+	
+	if (s_ascii)
+	{
+		mb_pio_frame_end(); // the gap timing is not used, the delimiter ends frames
+		if (s_mb_state == MB_WAITING)
+		{
+			sched_post(SCHED_TASK_MODBUS);
+		}
+		return;
+	}
+	
+	if (mb_pio_frame_end())
+	{
+		// T3.5 of silence measured by the hardware, the frame can be handled now
+		if (s_mb_state == MB_RECEPTION)
+		{
+			s_mb_state = MB_WAITING;
+		}
+		s_last_byte_us = time_us_64() - s_t35_us;
+		#if MB_FAST_TURNAROUND
+			if (s_mb_state == MB_WAITING)
 			{
-				printf("%02X ", s_input_buffer[i]);
+				mb_fast_arm(s_last_byte_us + mb_reply_holdoff_us()); // handled right here unless a delay is set
+				return;
 			}
-			printf("\r\n");
-		#endif // MB_DEBUG_ENABLE == 1
-		
-		mb_tx_enable();
-		uart_write_blocking(RS485_DEV, s_output_buffer, (size_t)s_output_buffer_count);
-		uart_tx_wait_blocking(RS485_DEV);
-		s_output_buffer_count = 0;
-		mb_tx_disable();
-		
-		s_mb_state = MB_IDLE;
-		break;
-		
-	default:
-		break;
+		#endif
 	}
+	
+	sched_post(SCHED_TASK_MODBUS);
 }
+#else
+// The port as the receive handler sees it: while the flash lockout capture is
+// replayed, its characters with the time they were read, then the UART again
 
-void mb_function_process()
+static uint64_t mb_uart_next_us()
 {
-	uint8_t mb_function = s_input_buffer[1];
-	uint16_t mb_mem_address;
-	switch (mb_function)
+	if (!s_rx_replay)
 	{
-	#if MB_INPUTS
-	case MB_FUNC_READ_DISCRETE_INPUTS:
-		if (s_input_buffer_count != 8)
-		{
-			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);	
-			break;
-		}
-		
-		mb_mem_address = mb_parse_addr();
-		if (mb_mem_address >= MB_INPUTS) // check memory address
-		{
-			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_ADDRESS);
-			break;
-		} 
-		
+		return time_us_64();
+	}
+	return s_rx_capture_base_us - (uint32_t)((uint32_t)s_rx_capture_base_us - s_rx_capture_at[s_rx_capture_next]);
+}
+
+static bool mb_uart_readable()
+{
+	return s_rx_replay ? s_rx_capture_next < s_rx_capture_count : uart_is_readable(RS485_DEV);
+}
+
+static bool mb_uart_readable_within_us(uint32_t us)
+{
+	if (!s_rx_replay)
+	{
+		return uart_is_readable_within_us(RS485_DEV, us);
+	}
+	return s_rx_capture_next < s_rx_capture_count && mb_uart_next_us() - s_last_byte_us <= us;
+}
+
+// Reads one character, stamps s_last_byte_us and accounts for the errors the UART latched with it
+static uint8_t mb_uart_getc(mb_bus_bucket_t *bucket)
+{
+	uint32_t dr;
+	s_last_byte_us = mb_uart_next_us();
+	if (s_rx_replay)
+	{
+		dr = s_rx_capture[s_rx_capture_next++];
+	}
+	else
+	{
+		dr = s_device->dr;
+	}
+	bucket->chars++;
+	if (dr & (UART_UARTDR_PE_BITS | UART_UARTDR_FE_BITS | UART_UARTDR_OE_BITS))
+	{
+		if (s_mb_state == MB_RECEPTION)
+		{
+			s_mb_frame_status = MB_FRAME_NOK;
+		}
+		bucket->parity_errors += (dr & UART_UARTDR_PE_BITS) ? 1 : 0;
+		bucket->framing_errors += (dr & UART_UARTDR_FE_BITS) ? 1 : 0;
+		if (dr & UART_UARTDR_OE_BITS)
+		{
+			// The FIFO was full, characters before this one were lost
+			MB_COUNT(MB_OVERRUN);
+			s_frame_overrun = true;
+			bucket->overruns++;
+		}
+	}
+	return dr & 0xFF;
+}
+
+void mb_receive_char()
+{
+	mb_bus_bucket_t *bucket = mb_bus_bucket();
+	if (!s_rx_replay && s_mb_state == MB_IDLE && time_us_64() < s_echo_guard_us)
+	{
+		// Line settling after we released the driver, a master cannot start before T3.5
+		while (uart_is_readable(RS485_DEV))
+		{
+			uart_getc(RS485_DEV);
+		}
+		s_device->rsr = 0;
+		return;
+	}
+	if (!mb_uart_readable())
+	{
+		return; // already taken by the replay of a flash lockout capture
+	}
+	
+	if (s_ascii)
+	{
+		// Characters can be up to a second apart, so this takes what the FIFO holds and leaves
+		while (mb_uart_readable())
+		{
+			uint8_t c = mb_uart_getc(bucket);
+			mb_ascii_receive(c, bucket);
+		}
+		s_device->rsr = 0;
+		if (s_mb_state == MB_WAITING)
+		{
+			sched_post(SCHED_TASK_MODBUS);
+		}
+		return;
+	}
+	
+	if (s_mb_state == MB_IDLE)
+	{
+		s_rx_count = 0; 
+		s_mb_frame_status = MB_FRAME_OK;
+		s_frame_overrun = false;
+		s_frame_start_us = mb_uart_next_us() - s_char_time_us; // late by up to the FIFO trigger level
+		s_mb_state = MB_RECEPTION;
+		do
+		{
+			if (s_rx_count < MB_BUFFER_SIZE)
+			{
+				s_rx_buffer[s_rx_count++] = mb_uart_getc(bucket);
+			}
+			else
+			{
+				mb_uart_getc(bucket);
+				s_mb_frame_status = MB_FRAME_NOK; // overrun error
+				MB_COUNT(MB_OVERRUN);
+				s_frame_overrun = true;
+				bucket->overruns++;
+			}
+		}
+		while (mb_uart_readable_within_us(s_t15_us));
+		s_mb_state = MB_WAITING;
+	}
+	else if (s_mb_state == MB_WAITING || s_mb_state == MB_PROCESSING_RESPONSE || s_mb_state == MB_PROCESSING_NO_RESPONSE || s_mb_state == MB_DISCARD)
+	{
+		// incomplete frame discard until idle. A replayed capture held the task
+		// up as well, so there a frame starting T3.5 after the last character is
+		// just not heard, as on the PIO port.
+		bool skipping = false;
+		while (mb_uart_readable())
+		{
+			skipping = skipping || (s_rx_replay && mb_uart_next_us() - s_last_byte_us >= s_t35_us);
+			mb_uart_getc(bucket);
+			if (!skipping)
+			{
+				s_mb_frame_status = MB_FRAME_NOK;
+			}
+		}	
+	}
+	s_device->rsr = 0; // clear error
+	
+	#if MB_FAST_TURNAROUND
+		if (s_mb_state == MB_WAITING)
+		{
+			mb_fast_arm(s_last_byte_us + mb_reply_holdoff_us()); // re-armed while characters keep coming
+			return;
+		}
+	#endif
+	sched_post(SCHED_TASK_MODBUS);
+}
+#endif
+
+// Receive interrupt while flash is busy, so registers and RAM only
+#if RS485_USE_PIO
+static void __not_in_flash_func(mb_rx_capture)()
+{
+	s_rx_capture_count = rs485_pio_capture(s_rx_capture, s_rx_capture_count, MB_RX_CAPTURE_SIZE);
+}
+#else
+static void __not_in_flash_func(mb_rx_capture)()
+{
+	// As mb_receive_char() does, a frame is taken whole until T1.5 passes
+	// without a character, each one stamped as it is read
+	uint32_t last = timer_hw->timerawl;
+	do
+	{
+		while (!(s_device->fr & UART_UARTFR_RXFE_BITS))
+		{
+			uint16_t dr = s_device->dr;
+			last = timer_hw->timerawl;
+			if (s_rx_capture_count < MB_RX_CAPTURE_SIZE)
+			{
+				s_rx_capture[s_rx_capture_count] = dr;
+				s_rx_capture_at[s_rx_capture_count++] = last;
+			}
+			else
+			{
+				s_rx_capture[MB_RX_CAPTURE_SIZE - 1] |= UART_UARTDR_OE_BITS; // out of room, counted as an overrun
+			}
+		}
+	}
+	while (timer_hw->timerawl - last < s_t15_us);
+	s_device->rsr = 0;
+}
+#endif
+
+static void mb_rx_vector(irq_handler_t handler)
+{
+	((irq_handler_t *)(uintptr_t)scb_hw->vtor)[VTABLE_FIRST_IRQ + RS485_IRQ] = handler;
+}
+
+uint32_t mb_flash_lockout()
+{
+	uint32_t irq_state = save_and_disable_interrupts();
+	s_flash_nvic_enabled = *(io_rw_32 *)(PPB_BASE + M0PLUS_NVIC_ISER_OFFSET);
+	*(io_rw_32 *)(PPB_BASE + M0PLUS_NVIC_ICER_OFFSET) = ~(1u << RS485_IRQ); // their handlers run from flash
+	s_rx_capture_count = 0;
+	if (s_mb_state != MB_INIT)
+	{
+		mb_rx_vector(mb_rx_capture);
+	}
+	restore_interrupts(irq_state);
+	return irq_state;
+}
+
+void mb_flash_release(uint32_t irq_state)
+{
+	save_and_disable_interrupts();
+	if (s_mb_state != MB_INIT)
+	{
+		// Through the normal path as if the interrupt had come in late, then
+		// the port takes over again
+		mb_rx_vector(mb_receive_char);
+		s_rx_capture_base_us = time_us_64();
+		s_rx_capture_next = 0;
+		s_rx_replay = true;
+		while (s_rx_capture_next < s_rx_capture_count)
+		{
+			uint16_t next = s_rx_capture_next;
+			mb_receive_char();
+			if (s_rx_capture_next == next)
+			{
+				break; // not receiving in this state, the interrupt is off for it as well
+			}
+		}
+		s_rx_replay = false;
+	}
+	*(io_rw_32 *)(PPB_BASE + M0PLUS_NVIC_ISER_OFFSET) = s_flash_nvic_enabled;
+	restore_interrupts(irq_state);
+}
+
+void mb_process()
+{
+	#if MB_FAST_TURNAROUND
+		if (!s_ascii && (s_mb_state == MB_WAITING || s_mb_state == MB_TRANSMITTING))
+		{
+			return; // owned by the alarm until it hands the frame over
+		}
+	#endif
+	
+	uint64_t diffTime = time_us_64() - s_last_byte_us;
+	switch (s_mb_state)
+	{
+	case MB_WAITING:
+		#if MB_MASTER
+			if (diffTime < s_t35_us)
+				break;
+			
+			// A reply is only complete after T3.5, by then the next request may go
+			memcpy(s_input_buffer, s_rx_buffer, s_rx_count);
+			s_input_buffer_count = s_rx_count;
+			s_mb_state = MB_IDLE;
+			mb_bus_bucket()->frames_ours++;
+			mb_master_reply(s_input_buffer, s_input_buffer_count, s_mb_frame_status == MB_FRAME_OK);
+			return;
+		#else
+			mb_frame_check();
+			break;
+		#endif
+		
+	case MB_PROCESSING_RESPONSE:	
+	case MB_PROCESSING_NO_RESPONSE:
+	case MB_DISCARD:
+		if (s_mb_frame_status == MB_FRAME_NOK)
+			s_mb_state = MB_DISCARD;
+		
+		if (diffTime < mb_frame_gap_us())
+			break;
+		
+		if (s_mb_state == MB_DISCARD)
+		{
+			s_mb_state = MB_IDLE;
+			break;
+		}
+		
+		mb_function_process();
+		
+		//s_input_buffer_count = 0; // Discard Packet
+		if (s_mb_state == MB_PROCESSING_NO_RESPONSE || s_reply_suppressed)
+		{
+			mb_request_done();
+			s_mb_state = MB_IDLE;
+			return;
+		}
+		
+		s_mb_state = MB_EMISSION;
+		// \/ Intentional Fall Through \/
+	case MB_EMISSION:
+		if (diffTime < s_response_delay_us)
+			break; // slow master, hold the reply
+		
+		#if MB_DEBUG_ENABLE	
+			printf("Frame (Size = %d):\r\n", s_input_buffer_count);		
+			for (uint8_t i = 0; i < s_input_buffer_count; i++)
+			{
+				printf("%02X ", s_input_buffer[i]);
+			}
+			printf("\r\n");
+		#endif // MB_DEBUG_ENABLE == 1
+		
+		const uint8_t *tx = s_output_buffer;
+		uint16_t tx_count = s_output_buffer_count;
+		if (s_ascii)
+		{
+			tx = s_ascii_output;
+			tx_count = mb_ascii_encode();
+		}
+		
+		mb_tx_enable();
+		#if RS485_USE_PIO
+			rs485_pio_write_blocking(tx, tx_count);
+		#else
+			uart_write_blocking(RS485_DEV, tx, (size_t)tx_count);
+			uart_tx_wait_blocking(RS485_DEV);
+		#endif
+		s_output_buffer_count = 0;
+		mb_tx_disable();
+		
+		s_mb_state = MB_IDLE;
+		break;
+		
+	default:
+		break;
+	}
+	
+	if (s_mb_state != MB_IDLE)
+	{
+		uint32_t wait_us = s_mb_state == MB_EMISSION ? mb_reply_holdoff_us() : mb_frame_gap_us();
+		sched_post_at(SCHED_TASK_MODBUS, s_last_byte_us + wait_us); // next T3.5 boundary or reply slot
+	}
+}
+
+static void mb_frame_check()
+{
+	// The receive interrupt is done with the frame until the state goes back to idle
+	memcpy(s_input_buffer, s_rx_buffer, s_rx_count);
+	s_input_buffer_count = s_rx_count;
+	
+	if (s_mb_frame_status != MB_FRAME_OK || s_input_buffer_count <= 3)
+	{
+		MB_COUNT(MB_BUS_COM_ERROR);
+		mb_log_event(MB_EVENT_RECEIVE | MB_EVENT_RECEIVE_COM_ERROR | (s_frame_overrun ? MB_EVENT_RECEIVE_OVERRUN : 0));
+		s_mb_state = MB_DISCARD;
+		#if MB_DEBUG_ENABLE	
+			printf("FRAME NOT OK!\r\n");
+			printf("Frame (Size = %d):\r\n", s_input_buffer_count);	
+			for (uint8_t i = 0; i < s_input_buffer_count; i++)
+			{
+				printf("%02X ", s_input_buffer[i]);
+			}
+			printf("\r\n");		 	
+		#endif // MB_DEBUG_ENABLE == 1
+		return;
+	}
+	// FRAME OK, LENGTH OK
+	uint16_t frame_crc = ((uint16_t)s_input_buffer[s_input_buffer_count - 1]) << 8;
+	frame_crc |= s_input_buffer[s_input_buffer_count - 2];
+
+	// ASCII frames had their LRC checked as they came in and carry a CRC made from the same bytes
+	if (!s_ascii && frame_crc != CRC16(s_input_buffer, s_input_buffer_count - 2))
+	{
+		MB_COUNT(MB_BUS_COM_ERROR);
+		MB_BUS_ADD(crc_errors, 1);
+		mb_log_event(MB_EVENT_RECEIVE | MB_EVENT_RECEIVE_COM_ERROR);
+		s_mb_state = MB_DISCARD;
+		#if MB_DEBUG_ENABLE	
+			printf("CRC NOT OK!");
+		#endif // MB_DEBUG_ENABLE == 1
+		return;
+	}
+	//CRC OK
+	
+	MB_COUNT(MB_BUS_MESSAGE);
+	
+	mb_bus_bucket_t *bucket = mb_bus_bucket();
+	if (s_reply_end_us && s_frame_start_us > s_reply_end_us)
+	{
+		// First frame after our reply, how long the master took to carry on
+		uint32_t gap_us = s_frame_start_us - s_reply_end_us;
+		bucket->gap_total_us += gap_us;
+		bucket->gap_min_us = bucket->gap_count == 0 || gap_us < bucket->gap_min_us ? gap_us : bucket->gap_min_us;
+		bucket->gap_max_us = gap_us > bucket->gap_max_us ? gap_us : bucket->gap_max_us;
+		bucket->gap_count++;
+		s_reply_end_us = 0;
+	}
+	
+	uint8_t unit = s_input_buffer[0];
+	if (!(s_unit_bitmap[unit / 32] & (1u << (unit % 32))) && unit != MB_BROADCAST_ID)
+	{
+		// MSG NOT FOR ME
+		bucket->frames_other++;
+		s_mb_state = MB_DISCARD;
+		return;
+	}
+	bucket->frames_ours++;
+
+	// MSG FOR ME
+	s_unit = mb_unit_find(unit);
+	MB_COUNT(MB_MESSAGE);
+	mb_log_event(MB_EVENT_RECEIVE | (unit == MB_BROADCAST_ID ? MB_EVENT_RECEIVE_BROADCAST : 0) | (s_listen_only ? MB_EVENT_LISTEN_ONLY : 0));
+	
+	if (s_listen_only && !(s_input_buffer[1] == MB_FUNC_DIAGNOSTICS && mb_parse_word(2) == MB_DIAG_RESTART_COM))
+	{
+		// Only monitoring, nothing is acted on until a restart request
+		MB_COUNT(MB_NO_RESPONSE);
+		s_mb_state = MB_DISCARD;
+		return;
+	}
+	
+	if (s_input_buffer[0] == 0)
+	{
+		MB_COUNT(MB_NO_RESPONSE);
+		s_mb_state = MB_PROCESSING_NO_RESPONSE;
+		return;
+	}
+	s_mb_state = MB_PROCESSING_RESPONSE;
+}
+
+void mb_function_process()
+{
+	s_reply_uncacheable = false;
+	s_reply_suppressed = false;
+	#if MB_RESPONSE_CACHE_ENTRIES
+		uint32_t start_cycles = systick_hw->cvr;
+		bool cache_missed = false;
+		if (mb_cache_lookup(&cache_missed))
+		{
+			s_cache_hit_cycles += (start_cycles - systick_hw->cvr) & 0x00FFFFFF; // SysTick counts down
+			return;
+		}
+	#endif
+	
+	uint8_t mb_function = s_input_buffer[1];
+	uint16_t mb_mem_address;
+	switch (mb_function)
+	{
+	#if MB_INPUTS
+	case MB_FUNC_READ_DISCRETE_INPUTS:
+		if (s_input_buffer_count != 8)
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);	
+			break;
+		}
+		
+		mb_mem_address = mb_parse_addr();
+		if (!s_unit->bits || mb_mem_address >= MB_INPUTS) // check memory address
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_ADDRESS);
+			break;
+		} 
+		
 		uint16_t inputs_to_read = ((uint16_t)s_input_buffer[4]) << 8;
 		inputs_to_read |= s_input_buffer[5];
 		#if MB_DEBUG_ENABLE
@@ -280,115 +1231,1374 @@ void mb_function_process()
 		memset(s_output_buffer + s_output_buffer_count, 0, byte_count);
 		for (uint16_t i = 0; i < inputs_to_read; i++)
 		{
-			if (i > 0 && (i % 8 == 0))
-			{
-				s_output_buffer_count++;
-			}
-			s_output_buffer[s_output_buffer_count] |= mb_get_discrete_input(i) << (i % 8);
+			if (i > 0 && (i % 8 == 0))
+			{
+				s_output_buffer_count++;
+			}
+			s_output_buffer[s_output_buffer_count] |= mb_get_discrete_input(i) << (i % 8);
+		}
+		s_output_buffer_count++;
+		mb_add_crc();
+		break;
+	#endif
+		
+	#if MB_COILS
+	case MB_FUNC_WRITE_SINGLE_COIL:	
+		if (s_input_buffer_count != 8)
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);	
+			break;
+		}
+		
+		mb_mem_address = mb_parse_addr();
+		if (!s_unit->bits || mb_mem_address >= MB_COILS) // check memory address
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_ADDRESS);
+			break;
+		}
+		
+		uint16_t output_value = ((uint16_t)s_input_buffer[4]) << 8;
+		output_value |= s_input_buffer[5];
+		
+		#if MB_DEBUG_ENABLE
+			printf("Output Value: %04X\r\n", output_value);
+		#endif // MB_DEBUG_ENABLE == 1
+		
+		if (output_value == 0x0000)
+		{
+			mb_set_coil(mb_mem_address, false);
+		}
+		else if (output_value == 0xFF00)
+		{
+			if (mb_get_coil(mb_mem_address) || output_busy(mb_mem_address) || output_inhibited(mb_mem_address))
+			{
+				MB_COUNT(MB_BUSY);
+				mb_set_output_as_error(MB_EXCEPTION_BUSY); // previous command still running, or interlocked
+				break;
+			}
+			
+			mb_set_coil(mb_mem_address, true);
+			if (output_run_time_ms(mb_mem_address) > MB_ACK_THRESHOLD_MS)
+			{
+				mb_set_output_as_error(MB_EXCEPTION_ACK); // accepted, completion via MB_IR_OUTPUT_STATUS
+				break;
+			}
+		}
+		else
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+			break;
+		}
+		
+		memcpy(s_output_buffer, s_input_buffer, s_input_buffer_count);
+		s_output_buffer_count = s_input_buffer_count;
+		
+		break;
+	#endif
+		
+	#if MB_INPUT_REGISTERS
+	case MB_FUNC_READ_INPUT_REGISTER:
+		mb_read_registers(s_unit->input_registers);
+		break;
+	#endif
+		
+	#if MB_HOLDING_REGISTERS
+	case MB_FUNC_READ_HOLDING_REGISTERS:
+		mb_read_registers(s_unit->holding_registers);
+		break;
+		
+	case MB_FUNC_WRITE_SINGLE_REGISTER:
+		if (s_input_buffer_count != 8)
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);	
+			break;
+		}
+		
+		mb_mem_address = mb_parse_addr();
+		if (!mb_map_covers(s_unit->holding_registers, mb_mem_address, 1, true))
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_ADDRESS);
+			break;
+		}
+		
+		uint8_t write_error = mb_map_write(s_unit->holding_registers, mb_mem_address, mb_parse_word(4));
+		if (write_error)
+		{
+			mb_set_output_as_error(write_error); // e.g. ACK for a configuration save
+			break;
+		}
+		
+		memcpy(s_output_buffer, s_input_buffer, s_input_buffer_count);
+		s_output_buffer_count = s_input_buffer_count;
+		break;
+		
+	case MB_FUNC_WRITE_MULTIPLE_REGISTERS:
+		{
+			mb_mem_address = mb_parse_addr();
+			uint16_t registers_to_write = mb_parse_word(4);
+			if (s_input_buffer_count < 9 || registers_to_write == 0 || registers_to_write > MB_MAX_WRITE_REGISTERS
+				|| s_input_buffer[6] != registers_to_write * 2 || s_input_buffer_count != 9 + registers_to_write * 2)
+			{
+				mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+				break;
+			}
+			
+			if (!mb_map_covers(s_unit->holding_registers, mb_mem_address, registers_to_write, true))
+			{
+				mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_ADDRESS);
+				break;
+			}
+			
+			uint8_t first_error = 0;
+			for (uint16_t i = 0; i < registers_to_write; i++)
+			{
+				uint8_t error = mb_map_write(s_unit->holding_registers, mb_mem_address + i, mb_parse_word(7 + 2 * i));
+				first_error = first_error ? first_error : error;
+			}
+			if (first_error)
+			{
+				mb_set_output_as_error(first_error);
+				break;
+			}
+			
+			memcpy(s_output_buffer, s_input_buffer, 6); // echo address, start and quantity
+			s_output_buffer_count = 6;
+			mb_add_crc();
+		}
+		break;
+	#endif
+	
+	case MB_FUNC_DIAGNOSTICS:
+		mb_diagnostics();
+		break;
+		
+	case MB_FUNC_GET_COM_EVENT_COUNTER:
+		mb_get_comm_event_counter();
+		break;
+		
+	case MB_FUNC_GET_COM_EVENT_LOG:
+		mb_get_comm_event_log();
+		break;
+		
+	case MB_FUNC_REPORT_SERVER_ID:
+		mb_report_server_id();
+		break;
+		
+	case MB_FUNC_READ_DEVICE_ID:
+		mb_read_device_id();
+		break;
+		
+	case MB_FUNC_SCATTER_READ:
+		mb_scatter_read();
+		break;
+		
+	case MB_FUNC_READ_FILE_RECORD:
+		mb_read_file_record();
+		break;
+		
+	case MB_FUNC_WRITE_FILE_RECORD:
+		mb_write_file_record();
+		break;
+		
+	default:
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_FUNCTION);
+		break;
+	}
+	
+	#if MB_RESPONSE_CACHE_ENTRIES
+		if (cache_missed)
+		{
+			mb_cache_store();
+			s_cache_miss_cycles += (start_cycles - systick_hw->cvr) & 0x00FFFFFF;
+		}
+	#endif
+}
+
+#if MB_RESPONSE_CACHE_ENTRIES
+static uint8_t mb_cache_table(uint8_t function)
+{
+	switch (function)
+	{
+	case MB_FUNC_READ_DISCRETE_INPUTS:
+		return MB_TABLE_INPUTS;
+	case MB_FUNC_READ_INPUT_REGISTER:
+		return MB_TABLE_INPUT_REGISTERS;
+	case MB_FUNC_READ_HOLDING_REGISTERS:
+		return MB_TABLE_HOLDING_REGISTERS;
+	default:
+		return MB_TABLE_COUNT; // not an idempotent read
+	}
+}
+
+// Sets missed only for a cacheable request that was not found, the one case
+// worth storing and timing against the hits
+static bool mb_cache_lookup(bool *missed)
+{
+	uint8_t table = mb_cache_table(s_input_buffer[1]);
+	if (table == MB_TABLE_COUNT || s_input_buffer_count != MB_CACHE_KEY_SIZE + 2)
+	{
+		return false;
+	}
+	
+	for (uint8_t i = 0; i < MB_RESPONSE_CACHE_ENTRIES; i++)
+	{
+		mb_cache_entry_t *entry = &s_cache[i];
+		if (entry->response_count && entry->table == table && entry->generation == s_table_generation[table]
+			&& !memcmp(entry->request, s_input_buffer, MB_CACHE_KEY_SIZE))
+		{
+			memcpy(s_output_buffer, entry->response, entry->response_count);
+			s_output_buffer_count = entry->response_count;
+			s_cache_hits++;
+			return true;
+		}
+	}
+	
+	s_cache_misses++;
+	*missed = true;
+	return false;
+}
+
+static void mb_cache_store()
+{
+	uint8_t table = mb_cache_table(s_input_buffer[1]);
+	if (table == MB_TABLE_COUNT || s_input_buffer_count != MB_CACHE_KEY_SIZE + 2 || s_reply_uncacheable
+		|| s_output_buffer[1] != s_input_buffer[1] || s_output_buffer_count > MB_RESPONSE_CACHE_FRAME_SIZE)
+	{
+		return; // exceptions are rebuilt so they keep being counted
+	}
+	
+	// Replace a stale copy of the same request before evicting anything else
+	mb_cache_entry_t *entry = NULL;
+	for (uint8_t i = 0; i < MB_RESPONSE_CACHE_ENTRIES; i++)
+	{
+		if (s_cache[i].response_count && !memcmp(s_cache[i].request, s_input_buffer, MB_CACHE_KEY_SIZE))
+		{
+			entry = &s_cache[i];
+			break;
+		}
+	}
+	if (entry == NULL)
+	{
+		entry = &s_cache[s_cache_next];
+		s_cache_next = (s_cache_next + 1) % MB_RESPONSE_CACHE_ENTRIES;
+	}
+	
+	memcpy(entry->request, s_input_buffer, MB_CACHE_KEY_SIZE);
+	entry->table = table;
+	entry->generation = s_table_generation[table];
+	memcpy(entry->response, s_output_buffer, s_output_buffer_count);
+	entry->response_count = s_output_buffer_count;
+}
+#endif
+
+void mb_add_crc()
+{
+	uint16_t crc = CRC16(s_output_buffer, s_output_buffer_count);
+	s_output_buffer[s_output_buffer_count] = crc & 0xFF;
+	s_output_buffer[s_output_buffer_count + 1] = (crc >> 8) & 0xFF;
+	s_output_buffer_count += 2;
+}
+
+void mb_tx_enable()
+{
+	mb_record_turnaround(s_input_buffer[1], time_us_64() - s_last_byte_us);
+	mb_request_done();
+	MB_BUS_ADD(chars, s_ascii ? 2 * s_output_buffer_count + 1 : s_output_buffer_count);
+	if (!s_first_reply_us)
+	{
+		s_first_reply_us = time_us_64();
+	}
+	
+	mb_driver_enable();
+}
+
+static void mb_driver_enable()
+{
+	//disable RX IRQ, then disable RX and enable the driver in a single SIO write
+	irq_set_enabled(RS485_IRQ, false);
+	#if !RS485_USE_PIO
+		gpio_put_masked((1u << RS485_RX_EN_PIN) | (1u << RS485_TX_EN_PIN), (1u << RS485_RX_EN_PIN) | (1u << RS485_TX_EN_PIN));
+	#endif // the PIO TX state machine switches DE and /RE itself around the start and stop bits
+	set_LED_state(true);
+}
+
+#if MB_MASTER
+uint32_t mb_send_request(const uint8_t *frame, uint16_t count)
+{
+	if (s_mb_state != MB_IDLE)
+	{
+		return s_t35_us; // a frame is still coming in or being handed over
+	}
+	uint64_t idle_us = time_us_64() - s_last_byte_us;
+	if (idle_us < s_t35_us)
+	{
+		return s_t35_us - idle_us;
+	}
+	
+	MB_BUS_ADD(chars, count);
+	mb_driver_enable();
+	#if RS485_USE_PIO
+		rs485_pio_write_blocking(frame, count);
+	#else
+		uart_write_blocking(RS485_DEV, frame, count);
+		uart_tx_wait_blocking(RS485_DEV);
+	#endif
+	mb_tx_disable();
+	return 0;
+}
+#endif
+
+void mb_tx_disable()
+{
+	// Called once the last stop bit has left the shift register
+	#if !RS485_USE_PIO
+		gpio_put_masked((1u << RS485_RX_EN_PIN) | (1u << RS485_TX_EN_PIN), 0);
+	#endif
+	s_last_byte_us = time_us_64(); // T3.5 now counts from our own last stop bit
+	s_echo_guard_us = s_last_byte_us + s_char_time_us;
+	s_reply_end_us = s_last_byte_us;
+	
+	#if RS485_USE_PIO
+		rs485_pio_rx_flush();
+	#else
+		// Only what was latched while the receiver was off is dropped. The pass
+		// is bounded by the FIFO depth and takes far less than a character time,
+		// so a byte sent after the release can never be caught by it.
+		for (uint8_t i = 0; i < RS485_UART_FIFO_DEPTH && !(s_device->fr & UART_UARTFR_RXFE_BITS); i++)
+		{
+			(void)s_device->dr;
+		}
+		s_device->rsr = 0; // reset any error
+	#endif
+	irq_set_enabled(RS485_IRQ, true);
+	set_LED_state(false);
+}
+
+#if MB_FAST_TURNAROUND
+static void mb_fast_arm(uint64_t when_us)
+{
+	if (hardware_alarm_set_target(s_fast_alarm, from_us_since_boot(when_us)))
+	{
+		mb_fast_alarm_callback(s_fast_alarm); // already due
+	}
+}
+
+static void mb_fast_alarm_callback(uint alarm_num)
+{
+	if (s_mb_state == MB_TRANSMITTING)
+	{
+		// Armed for the nominal end of the reply, at most a bit time is left to wait
+		#if RS485_USE_PIO
+			while (!rs485_pio_tx_done())
+			{
+				tight_loop_contents();
+			}
+		#else
+			uart_tx_wait_blocking(RS485_DEV);
+		#endif
+		s_output_buffer_count = 0;
+		mb_tx_disable();
+		s_mb_state = MB_IDLE;
+		return;
+	}
+	
+	if (s_mb_state != MB_WAITING)
+	{
+		return;
+	}
+	
+	uint64_t reply_us = s_last_byte_us + mb_reply_holdoff_us();
+	if (time_us_64() < reply_us)
+	{
+		mb_fast_arm(reply_us); // more characters arrived after the alarm was set
+		return;
+	}
+	
+	if (s_transport_busy)
+	{
+		mb_fast_arm(time_us_64() + s_char_time_us); // a USB frame holds the buffers, look again shortly
+		return;
+	}
+	
+	// Only FC02 and FC05 are answered here. Their data is a single word, so a
+	// task can never leave it half written under us. Everything else, including
+	// discards and broadcasts, carries on in the task as before.
+	mb_frame_check();
+	uint8_t mb_function = s_input_buffer[1];
+	if (s_mb_state != MB_PROCESSING_RESPONSE
+		|| (mb_function != MB_FUNC_READ_DISCRETE_INPUTS && mb_function != MB_FUNC_WRITE_SINGLE_COIL))
+	{
+		sched_post(SCHED_TASK_MODBUS);
+		return;
+	}
+	
+	mb_function_process();
+	mb_tx_enable();
+	#if RS485_USE_PIO
+		rs485_pio_write(s_output_buffer, s_output_buffer_count);
+	#else
+		uart_write_blocking(RS485_DEV, s_output_buffer, (size_t)s_output_buffer_count); // short enough for the TX FIFO
+	#endif
+	s_mb_state = MB_TRANSMITTING;
+	mb_fast_arm(time_us_64() + s_output_buffer_count * s_char_time_us);
+}
+#endif
+
+// Silence that has to follow a frame before it is acted on
+static uint32_t mb_frame_gap_us()
+{
+	return s_ascii ? 0 : s_t35_us;
+}
+
+static uint32_t mb_reply_holdoff_us()
+{
+	return s_response_delay_us > mb_frame_gap_us() ? s_response_delay_us : mb_frame_gap_us();
+}
+
+static void mb_record_turnaround(uint8_t function, uint32_t turnaround_us)
+{
+	uint8_t turnaround_class = MB_TURNAROUND_OTHER;
+	if (function == MB_FUNC_READ_DISCRETE_INPUTS)
+	{
+		turnaround_class = MB_TURNAROUND_FC02;
+	}
+	else if (function == MB_FUNC_WRITE_SINGLE_COIL)
+	{
+		turnaround_class = MB_TURNAROUND_FC05;
+	}
+	
+	mb_turnaround_t *t = &s_turnaround[turnaround_class];
+	uint32_t holdoff_us = mb_reply_holdoff_us();
+	uint32_t late_us = turnaround_us > holdoff_us ? turnaround_us - holdoff_us : 0;
+	uint8_t bucket = late_us ? 32 - __builtin_clz(late_us) : 0;
+	if (bucket >= MB_TURNAROUND_BUCKETS)
+	{
+		bucket = MB_TURNAROUND_BUCKETS - 1;
+	}
+	
+	// Recorded from the task and the fast path alarm, read and reset from the CLI
+	uint32_t irq_state = save_and_disable_interrupts();
+	t->count++;
+	t->total_us += turnaround_us;
+	if (turnaround_us < t->min_us) { t->min_us = turnaround_us; }
+	if (turnaround_us > t->max_us) { t->max_us = turnaround_us; }
+	t->late[bucket]++;
+	restore_interrupts(irq_state);
+}
+
+uint16_t mb_parse_addr()
+{
+	uint16_t addr = ((uint16_t)s_input_buffer[2]) << 8;
+	addr |= s_input_buffer[3];
+	return addr;
+}
+
+static uint16_t mb_parse_word(uint16_t offset)
+{
+	uint16_t word = ((uint16_t)s_input_buffer[offset]) << 8;
+	word |= s_input_buffer[offset + 1];
+	return word;
+}
+
+#if MB_INPUT_REGISTERS || MB_HOLDING_REGISTERS
+static void mb_read_registers(const mb_map_t *map)
+{
+	if (s_input_buffer_count != 8)
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+		return;
+	}
+	
+	uint16_t mb_mem_address = mb_parse_addr();
+	uint16_t registers_to_read = mb_parse_word(4);
+	if (registers_to_read == 0 || registers_to_read > MB_MAX_READ_REGISTERS)
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+		return;
+	}
+	
+	if (!mb_map_covers(map, mb_mem_address, registers_to_read, false))
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_ADDRESS);
+		return;
+	}
+	
+	memcpy(s_output_buffer, s_input_buffer, 2);
+	s_output_buffer_count = 2;
+	s_output_buffer[s_output_buffer_count++] = registers_to_read * 2;
+	mb_map_copy(map, mb_mem_address, registers_to_read);
+	mb_add_crc();
+}
+#endif
+
+// Binary search for the block holding addr, NULL if it is not mapped
+static const mb_range_t *mb_map_find(const mb_map_t *map, uint16_t addr)
+{
+	uint16_t low = 0;
+	uint16_t high = map->range_count;
+	while (low < high)
+	{
+		uint16_t mid = (low + high) / 2;
+		const mb_range_t *range = &map->ranges[mid];
+		if (addr < range->first)
+		{
+			high = mid;
+		}
+		else if (addr - range->first >= range->count)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			return range;
+		}
+	}
+	return NULL;
+}
+
+static void mb_map_check(const mb_map_t *map)
+{
+	for (uint16_t i = 0; i < map->range_count; i++)
+	{
+		const mb_range_t *range = &map->ranges[i];
+		if (range->count == 0 || (uint32_t)range->first + range->count > 0x10000
+			|| (i && (uint32_t)map->ranges[i - 1].first + map->ranges[i - 1].count > range->first))
+		{
+			panic("Modbus register map not sorted or overlapping at %u", range->first);
+		}
+	}
+}
+
+// True if every address in [addr, addr + quantity) is mapped, touching blocks may be crossed
+static bool mb_map_covers(const mb_map_t *map, uint16_t addr, uint16_t quantity, bool write)
+{
+	const mb_range_t *range = mb_map_find(map, addr);
+	uint32_t end = (uint32_t)addr + quantity;
+	while (range != NULL)
+	{
+		if (write && range->storage == NULL && range->write == NULL)
+		{
+			return false;
+		}
+		
+		uint32_t range_end = (uint32_t)range->first + range->count;
+		if (end <= range_end)
+		{
+			return true;
+		}
+		
+		range++;
+		if (range == map->ranges + map->range_count || range->first != range_end)
+		{
+			return false;
+		}
+	}
+	return false;
+}
+
+static uint16_t mb_map_read(const mb_map_t *map, uint16_t addr)
+{
+	const mb_range_t *range = mb_map_find(map, addr);
+	if (range == NULL)
+	{
+		return 0;
+	}
+	return range->storage ? range->storage[addr - range->first] : range->read(addr);
+}
+
+static uint8_t mb_map_write(const mb_map_t *map, uint16_t addr, uint16_t value)
+{
+	const mb_range_t *range = mb_map_find(map, addr);
+	if (range == NULL || map->table == MB_TABLE_COUNT) // no table, read only view such as the diagnostic counters
+	{
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+	
+	if (range->storage == NULL)
+	{
+		if (range->write == NULL)
+		{
+			return MB_EXCEPTION_ILLEGAL_ADDRESS;
+		}
+		s_table_generation[map->table]++;
+		return range->write(addr, value);
+	}
+	
+	uint16_t *word = &range->storage[addr - range->first];
+	if (*word != value)
+	{
+		*word = value;
+		s_table_generation[map->table]++;
+	}
+	return 0;
+}
+
+static void mb_print_map_ranges(const char *name, const mb_map_t *map)
+{
+	for (uint16_t i = 0; i < map->range_count; i++)
+	{
+		const mb_range_t *range = &map->ranges[i];
+		printf("%s\t%u-%u\t%s\r\n", name, range->first, range->first + range->count - 1,
+			range->storage ? "RAM" : range->write ? "CALLBACK" : "CALLBACK RO");
+	}
+}
+
+void mb_print_map()
+{
+	printf("** MODBUS REGISTER MAP **\r\n");
+	#if MB_INPUT_REGISTERS
+		mb_print_map_ranges("IR", &s_mb_input_register_map);
+	#endif
+	#if MB_HOLDING_REGISTERS
+		mb_print_map_ranges("HR", &s_mb_holding_register_map);
+	#endif
+}
+
+#if MB_MAP_BENCHMARK
+#define MB_BENCH_RANGES 200
+#define MB_BENCH_LOOKUPS 1000
+
+static uint16_t s_bench_storage[4];
+static mb_range_t s_bench_ranges[MB_BENCH_RANGES];
+
+// Blocks of 4 registers every 300 addresses, roughly how integrators spread them
+static void mb_map_benchmark_run(uint16_t range_count)
+{
+	for (uint16_t i = 0; i < range_count; i++)
+	{
+		s_bench_ranges[i] = (mb_range_t){ (uint16_t)(i * 300), 4, s_bench_storage, NULL, NULL };
+	}
+	mb_map_t map = { s_bench_ranges, range_count, MB_TABLE_COUNT };
+	
+	uint32_t found = 0;
+	uint32_t seed = 1;
+	uint32_t start_cycles = systick_hw->cvr;
+	for (uint16_t i = 0; i < MB_BENCH_LOOKUPS; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		uint16_t range = (seed >> 16) % range_count;
+		found += mb_map_find(&map, range * 300 + (seed & 3)) != NULL;
+	}
+	uint32_t cycles = (start_cycles - systick_hw->cvr) & 0x00FFFFFF;
+	printf("%u BLOCKS\t= %lu cycles per lookup (%lu/%u found)\r\n", range_count, cycles / MB_BENCH_LOOKUPS, found, MB_BENCH_LOOKUPS);
+}
+
+void mb_map_benchmark()
+{
+	mb_map_benchmark_run(10);
+	mb_map_benchmark_run(MB_BENCH_RANGES);
+}
+#endif
+
+// Appends quantity registers high byte first, the span must have passed mb_map_covers()
+static void mb_map_copy(const mb_map_t *map, uint16_t addr, uint16_t quantity)
+{
+	const mb_range_t *range = mb_map_find(map, addr);
+	while (quantity)
+	{
+		// One search per block, then a straight copy of the part inside it
+		uint16_t offset = addr - range->first;
+		uint16_t run = range->count - offset < quantity ? range->count - offset : quantity;
+		for (uint16_t i = 0; i < run; i++)
+		{
+			uint16_t value = range->storage ? range->storage[offset + i] : range->read(addr + i);
+			s_output_buffer[s_output_buffer_count++] = value >> 8;
+			s_output_buffer[s_output_buffer_count++] = value & 0xFF;
+		}
+		if (range->storage == NULL)
+		{
+			s_reply_uncacheable = true; // a callback value can change without a generation bump
+		}
+		addr += run;
+		quantity -= run;
+		range++;
+	}
+}
+
+// Appends one range of a scatter read to the reply, returns an exception code or 0
+static uint8_t mb_scatter_append(uint8_t table, uint16_t start, uint16_t quantity)
+{
+	const mb_map_t *map = NULL;
+	bool (*get_bit)(uint16_t) = NULL;
+	uint16_t table_size = 0;
+	switch (table)
+	{
+	#if MB_COILS
+	case MB_FUNC_READ_COILS:
+		get_bit = mb_get_coil;
+		table_size = s_unit->bits ? MB_COILS : 0;
+		break;
+	#endif
+	#if MB_INPUTS
+	case MB_FUNC_READ_DISCRETE_INPUTS:
+		get_bit = mb_get_discrete_input;
+		table_size = s_unit->bits ? MB_INPUTS : 0;
+		break;
+	#endif
+	#if MB_HOLDING_REGISTERS
+	case MB_FUNC_READ_HOLDING_REGISTERS:
+		map = s_unit->holding_registers;
+		break;
+	#endif
+	#if MB_INPUT_REGISTERS
+	case MB_FUNC_READ_INPUT_REGISTER:
+		map = s_unit->input_registers;
+		break;
+	#endif
+	case MB_FUNC_DIAGNOSTICS:
+		map = &s_mb_diagnostic_map;
+		break;
+	default:
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+	
+	if (quantity == 0)
+	{
+		return MB_EXCEPTION_ILLEGAL_DATA;
+	}
+	if (map ? !mb_map_covers(map, start, quantity, false) : (start >= table_size || start + quantity > table_size))
+	{
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+	
+	uint32_t byte_count = get_bit ? (quantity + 7) / 8 : quantity * 2;
+	if (s_output_buffer_count + byte_count + 2 > MB_BUFFER_SIZE)
+	{
+		return MB_EXCEPTION_ILLEGAL_DATA; // the whole reply has to fit one frame
+	}
+	
+	if (get_bit)
+	{
+		memset(s_output_buffer + s_output_buffer_count, 0, byte_count);
+		for (uint16_t i = 0; i < quantity; i++)
+		{
+			s_output_buffer[s_output_buffer_count + i / 8] |= get_bit(start + i) << (i % 8);
+		}
+		s_output_buffer_count += byte_count;
+		return 0;
+	}
+	
+	mb_map_copy(map, start, quantity);
+	return 0;
+}
+
+// Request: unit, 0x41, range count, then per range table, start and quantity
+// (start and quantity high byte first), CRC. A table is named by the function
+// code that reads it (01, 02, 03, 04), 08 reads the 32-bit bus diagnostic
+// counters as register pairs, high word first, in FC08 sub-function order.
+// Reply: unit, 0x41, byte count, the ranges back to back in request order,
+// bits packed LSB first per range and registers high byte first, CRC.
+static void mb_scatter_read()
+{
+	uint8_t range_count = s_input_buffer[2];
+	if (s_input_buffer_count < 5 || range_count == 0 || range_count > MB_SCATTER_MAX_RANGES
+		|| s_input_buffer_count != 5 + range_count * 5)
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+		return;
+	}
+	
+	s_output_buffer_count = 3;
+	for (uint8_t r = 0; r < range_count; r++)
+	{
+		uint16_t offset = 3 + r * 5;
+		uint8_t error = mb_scatter_append(s_input_buffer[offset], mb_parse_word(offset + 1), mb_parse_word(offset + 3));
+		if (error)
+		{
+			mb_set_output_as_error(error);
+			return;
+		}
+	}
+	
+	memcpy(s_output_buffer, s_input_buffer, 2);
+	s_output_buffer[2] = s_output_buffer_count - 3;
+	mb_add_crc();
+}
+
+typedef uint8_t (*mb_file_read_cb_t)(uint16_t file, uint16_t record, uint16_t count, uint8_t *data);
+typedef uint8_t (*mb_file_write_cb_t)(uint16_t file, uint16_t record, uint16_t count, const uint8_t *data);
+
+typedef struct
+{
+	uint16_t first;
+	uint16_t count;
+	mb_file_read_cb_t read;
+	mb_file_write_cb_t write;
+} mb_file_t;
+
+#define MB_FILE_ENTRY(first, count, read, write) { first, count, read, write },
+static const mb_file_t s_mb_files[] = { MB_FILES(MB_FILE_ENTRY) };
+
+static const mb_file_t *mb_file_find(uint16_t file)
+{
+	for (uint8_t i = 0; i < sizeof(s_mb_files) / sizeof(s_mb_files[0]); i++)
+	{
+		if (file >= s_mb_files[i].first && file - s_mb_files[i].first < s_mb_files[i].count)
+		{
+			return &s_mb_files[i];
+		}
+	}
+	return NULL;
+}
+
+// Request: unit, 0x14, byte count, then per sub-request reference type (6),
+// file, record and length in registers (high byte first), CRC. Reply: unit,
+// 0x14, byte count, then per sub-request its length in bytes (type included),
+// reference type and the registers, CRC. The whole reply has to fit one frame.
+static void mb_read_file_record()
+{
+	uint8_t byte_count = s_input_buffer[2];
+	if (s_input_buffer_count < 5 || byte_count < 7 || byte_count > 0xF5 || byte_count % 7
+		|| s_input_buffer_count != 5 + byte_count)
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+		return;
+	}
+	
+	s_output_buffer_count = 3;
+	for (uint16_t offset = 3; offset < 3 + byte_count; offset += 7)
+	{
+		uint16_t file = mb_parse_word(offset + 1);
+		uint16_t record = mb_parse_word(offset + 3);
+		uint16_t length = mb_parse_word(offset + 5);
+		if (s_input_buffer[offset] != MB_FILE_REFERENCE_TYPE || length == 0
+			|| s_output_buffer_count + 2 + length * 2 > 3 + 0xF5)
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+			return;
+		}
+		
+		const mb_file_t *entry = s_unit == &s_mb_units[0] ? mb_file_find(file) : NULL;
+		if (entry == NULL || record >= MB_FILE_RECORDS || record + length > MB_FILE_RECORDS)
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_ADDRESS);
+			return;
+		}
+		
+		s_output_buffer[s_output_buffer_count++] = 1 + length * 2;
+		s_output_buffer[s_output_buffer_count++] = MB_FILE_REFERENCE_TYPE;
+		uint8_t error = entry->read(file, record, length, s_output_buffer + s_output_buffer_count);
+		if (error)
+		{
+			mb_set_output_as_error(error);
+			return;
+		}
+		s_output_buffer_count += length * 2;
+	}
+	
+	memcpy(s_output_buffer, s_input_buffer, 2);
+	s_output_buffer[2] = s_output_buffer_count - 3;
+	mb_add_crc();
+}
+
+// Request: unit, 0x15, byte count, then per sub-request reference type (6),
+// file, record, length in registers and the registers, CRC. The reply echoes
+// the request. Every sub-request is checked before any is written; a write
+// refused part way (BUSY while flash catches up) may leave earlier ones done,
+// which is harmless as the master repeats the same frame.
+static void mb_write_file_record()
+{
+	uint8_t byte_count = s_input_buffer[2];
+	if (s_input_buffer_count < 5 || byte_count < 9 || byte_count > 0xFB
+		|| s_input_buffer_count != 5 + byte_count)
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+		return;
+	}
+	
+	uint16_t offset = 3;
+	while (offset < 3 + byte_count)
+	{
+		uint16_t file = mb_parse_word(offset + 1);
+		uint16_t record = mb_parse_word(offset + 3);
+		uint16_t length = mb_parse_word(offset + 5);
+		if (s_input_buffer[offset] != MB_FILE_REFERENCE_TYPE || length == 0
+			|| offset + 7 + length * 2 > 3 + byte_count)
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+			return;
+		}
+		
+		const mb_file_t *entry = s_unit == &s_mb_units[0] ? mb_file_find(file) : NULL;
+		if (entry == NULL || entry->write == NULL || record >= MB_FILE_RECORDS || record + length > MB_FILE_RECORDS)
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_ADDRESS);
+			return;
+		}
+		offset += 7 + length * 2;
+	}
+	
+	for (offset = 3; offset < 3 + byte_count; offset += 7 + mb_parse_word(offset + 5) * 2)
+	{
+		uint16_t file = mb_parse_word(offset + 1);
+		uint8_t error = mb_file_find(file)->write(file, mb_parse_word(offset + 3), mb_parse_word(offset + 5),
+			s_input_buffer + offset + 7);
+		if (error)
+		{
+			mb_set_output_as_error(error);
+			return;
+		}
+	}
+	
+	memcpy(s_output_buffer, s_input_buffer, 3 + byte_count);
+	s_output_buffer_count = 3 + byte_count;
+	mb_add_crc();
+}
+
+static uint16_t mb_diagnostic_read(uint16_t addr)
+{
+	// Each counter is two registers, high word first
+	uint32_t value = s_mb_serial_counters[addr / 2];
+	return addr & 1 ? value & 0xFFFF : value >> 16;
+}
+
+static void mb_clear_counters()
+{
+	uint32_t irq_state = save_and_disable_interrupts();
+	for (uint8_t i = 0; i < MB_COUNTER_COUNT; i++)
+	{
+		s_mb_serial_counters[i] = 0;
+	}
+	s_comm_event_counter = 0;
+	restore_interrupts(irq_state);
+}
+
+static void mb_log_event(uint8_t event)
+{
+	uint32_t irq_state = save_and_disable_interrupts();
+	s_event_log[s_event_head] = event;
+	s_event_head = (s_event_head + 1) % MB_EVENT_LOG_SIZE;
+	if (s_event_count < MB_EVENT_LOG_SIZE)
+	{
+		s_event_count++;
+	}
+	restore_interrupts(irq_state);
+}
+
+// Called once a request for us has been handled, whether or not a reply goes out
+static void mb_request_done()
+{
+	uint8_t event = MB_EVENT_SEND | (s_listen_only ? MB_EVENT_LISTEN_ONLY : 0);
+	if (s_output_buffer[1] & MB_FUNC_EXCEPTION_MODIFIER)
+	{
+		uint8_t code = s_output_buffer[2];
+		if (code <= MB_EXCEPTION_ILLEGAL_DATA)
+		{
+			event |= MB_EVENT_SEND_READ_EXCEPTION;
+		}
+		else if (code == MB_EXCEPTION_DEVICE_FAILURE)
+		{
+			event |= MB_EVENT_SEND_ABORT_EXCEPTION;
+		}
+		else if (code <= MB_EXCEPTION_BUSY)
+		{
+			event |= MB_EVENT_SEND_BUSY_EXCEPTION;
+		}
+		else
+		{
+			event |= MB_EVENT_SEND_NAK_EXCEPTION;
+		}
+	}
+	else if (s_input_buffer[1] != MB_FUNC_GET_COM_EVENT_COUNTER && s_input_buffer[1] != MB_FUNC_GET_COM_EVENT_LOG)
+	{
+		uint32_t irq_state = save_and_disable_interrupts();
+		s_comm_event_counter++;
+		restore_interrupts(irq_state);
+	}
+	mb_log_event(event);
+}
+
+// 0xFFFF while an earlier command is still running
+static uint16_t mb_comm_status()
+{
+	for (uint8_t i = 0; i < NUM_OUTPUTS; i++)
+	{
+		if (output_busy(i))
+		{
+			return 0xFFFF;
 		}
-		s_output_buffer_count++;
-		mb_add_crc();
+	}
+	return 0;
+}
+
+// Request and reply: unit, 08, sub-function, data (both high byte first), CRC.
+// The counter sub-functions answer with the low 16 bits of the 32-bit count.
+static void mb_diagnostics()
+{
+	if (s_input_buffer_count != 8)
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+		return;
+	}
+	
+	uint16_t sub_function = mb_parse_word(2);
+	uint16_t data = mb_parse_word(4);
+	switch (sub_function)
+	{
+	case MB_DIAG_SUB_QUERY_DATA:
 		break;
-	#endif
 		
-	#if MB_COILS
-	case MB_FUNC_WRITE_SINGLE_COIL:	
-		if (s_input_buffer_count != 8)
-		{
-			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);	
-			break;
-		}
-		
-		mb_mem_address = mb_parse_addr();
-		if (mb_mem_address >= MB_COILS) // check memory address
+	case MB_DIAG_RESTART_COM:
+		if (data != 0x0000 && data != 0xFF00)
 		{
-			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_ADDRESS);
-			break;
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+			return;
 		}
-		
-		uint16_t output_value = ((uint16_t)s_input_buffer[4]) << 8;
-		output_value |= s_input_buffer[5];
-		
-		#if MB_DEBUG_ENABLE
-			printf("Output Value: %04X\r\n", output_value);
-		#endif // MB_DEBUG_ENABLE == 1
-		
-		if (output_value == 0x0000)
+		if (data == 0xFF00)
 		{
-			mb_set_coil(mb_mem_address, false);
+			uint32_t irq_state = save_and_disable_interrupts();
+			s_event_head = 0;
+			s_event_count = 0;
+			restore_interrupts(irq_state);
 		}
-		else if (output_value == 0xFF00)
+		mb_clear_counters();
+		mb_log_event(MB_EVENT_RESTART);
+		if (s_listen_only)
 		{
-			mb_set_coil(mb_mem_address, true);
+			s_listen_only = false;
+			s_reply_suppressed = true; // the request that ends listen only mode is not answered
 		}
-		else
+		break;
+		
+	case MB_DIAG_RETURN_DIAG:
+		data = 0; // no device specific conditions to report
+		break;
+		
+	case MB_DIAG_CHANGE_ASCII_DEL:
+		if (data & 0xFF)
 		{
 			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
-			break;
+			return;
 		}
+		s_ascii_delimiter = data >> 8; // the reply already ends with it
+		break;
 		
-		memcpy(s_output_buffer, s_input_buffer, s_input_buffer_count);
-		s_output_buffer_count = s_input_buffer_count;
-		
+	case MB_DIAG_FORCE_LISTEN:
+		s_listen_only = true;
+		mb_log_event(MB_EVENT_ENTERED_LISTEN_ONLY);
+		s_reply_suppressed = true; // never answered, the echo below is only kept for the event log
 		break;
-	#endif
 		
-	#if MB_INPUT_REGISTERS
+	case MB_DIAG_CLEAR:
+		mb_clear_counters();
+		break;
 		
-	#endif
+	case MB_DIAG_MSG_COUNT:
+	case MB_DIAG_COM_ERROR_COUNT:
+	case MB_DIAG_EXCEPT_COUNT:
+	case MB_DIAG_SERVER_MSG_COUNT:
+	case MB_DIAG_SERVER_NO_RESP_COUNT:
+	case MB_DIAG_SERVER_NAK_COUNT:
+	case MB_DIAG_SERVER_BUSY_COUNT:
+	case MB_DIAG_BUS_OVERRUN_COUNT:
+		data = s_mb_serial_counters[sub_function - MB_DIAG_MSG_COUNT] & 0xFFFF;
+		break;
 		
-	#if MB_HOLDING_REGISTERS
+	case MB_DIAG_CLEAR_OVERRUN:
+		s_mb_serial_counters[MB_OVERRUN] = 0;
+		break;
 		
-	#endif
 	default:
 		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_FUNCTION);
-		break;
+		return;
 	}
 	
+	memcpy(s_output_buffer, s_input_buffer, 4);
+	s_output_buffer[4] = data >> 8;
+	s_output_buffer[5] = data & 0xFF;
+	s_output_buffer_count = 6;
+	mb_add_crc();
 }
 
-void mb_add_crc()
+// Reply: unit, 0B, status, event count (high byte first), CRC
+static void mb_get_comm_event_counter()
 {
-	uint16_t crc = CRC16(s_output_buffer, s_output_buffer_count);
-	s_output_buffer[s_output_buffer_count] = crc & 0xFF;
-	s_output_buffer[s_output_buffer_count + 1] = (crc >> 8) & 0xFF;
-	s_output_buffer_count += 2;
+	if (s_input_buffer_count != 4)
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+		return;
+	}
+	
+	uint16_t status = mb_comm_status();
+	memcpy(s_output_buffer, s_input_buffer, 2);
+	s_output_buffer[2] = status >> 8;
+	s_output_buffer[3] = status & 0xFF;
+	s_output_buffer[4] = (s_comm_event_counter >> 8) & 0xFF;
+	s_output_buffer[5] = s_comm_event_counter & 0xFF;
+	s_output_buffer_count = 6;
+	mb_add_crc();
 }
 
-void mb_tx_enable()
+// Reply: unit, 0C, byte count, status, event count, bus message count (high
+// byte first), then up to MB_EVENT_LOG_SIZE event bytes newest first, CRC
+static void mb_get_comm_event_log()
 {
-	//disable RX IRQ, disable RX, clear FIFO of garbage
-	irq_set_enabled(RS485_IRQ, false);
-	gpio_put(RS485_RX_EN_PIN, true);
-	gpio_put(RS485_TX_EN_PIN, true);
-	set_LED_state(true);
-	while (!gpio_get(RS485_TX_EN_PIN)) { tight_loop_contents(); }
+	if (s_input_buffer_count != 4)
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+		return;
+	}
+	
+	uint16_t status = mb_comm_status();
+	uint32_t irq_state = save_and_disable_interrupts();
+	uint32_t messages = s_mb_serial_counters[MB_BUS_MESSAGE];
+	memcpy(s_output_buffer, s_input_buffer, 2);
+	s_output_buffer[2] = 6 + s_event_count;
+	s_output_buffer[3] = status >> 8;
+	s_output_buffer[4] = status & 0xFF;
+	s_output_buffer[5] = (s_comm_event_counter >> 8) & 0xFF;
+	s_output_buffer[6] = s_comm_event_counter & 0xFF;
+	s_output_buffer[7] = (messages >> 8) & 0xFF;
+	s_output_buffer[8] = messages & 0xFF;
+	s_output_buffer_count = 9;
+	for (uint8_t i = 1; i <= s_event_count; i++)
+	{
+		s_output_buffer[s_output_buffer_count++] = s_event_log[(s_event_head + MB_EVENT_LOG_SIZE - i) % MB_EVENT_LOG_SIZE];
+	}
+	restore_interrupts(irq_state);
+	mb_add_crc();
 }
 
-void mb_tx_disable()
+// Identification objects laid out as they go on the wire, built by the
+// compiler into flash: a packed member per object holding its id, length and
+// text without the terminator. s_mb_device_offsets has where each starts,
+// with the total size last.
+#define MB_DEVICE_OBJECT_MEMBER(id, name, value) \
+	struct __attribute__((packed)) { uint8_t object; uint8_t length; char text[sizeof(value) - 1] __attribute__((nonstring)); } name;
+#define MB_DEVICE_OBJECT_INIT(id, name, value) .name = { id, sizeof(value) - 1, value },
+#define MB_DEVICE_OBJECT_OFFSET(id, name, value) offsetof(mb_device_objects_t, name),
+
+typedef struct __attribute__((packed))
 {
-	gpio_put(RS485_RX_EN_PIN, false);
-	gpio_put(RS485_TX_EN_PIN, false);
-	while (gpio_get(RS485_RX_EN_PIN)) { tight_loop_contents(); }
-	set_LED_state(false);
-	while (uart_is_readable(RS485_DEV))
+	MB_DEVICE_OBJECTS(MB_DEVICE_OBJECT_MEMBER)
+} mb_device_objects_t;
+
+static const mb_device_objects_t s_mb_device_objects = { MB_DEVICE_OBJECTS(MB_DEVICE_OBJECT_INIT) };
+static const uint8_t s_mb_device_offsets[] = { MB_DEVICE_OBJECTS(MB_DEVICE_OBJECT_OFFSET) sizeof(mb_device_objects_t) };
+#define MB_DEVICE_OBJECT_COUNT (sizeof(s_mb_device_offsets) - 1)
+
+// FC11 carries them all after the byte count, server id and run indicator
+_Static_assert(5 + sizeof(mb_device_objects_t) + 2 <= MB_BUFFER_SIZE, "MB_DEVICE_OBJECTS too long for FC11");
+
+static uint8_t mb_device_object_id(uint8_t index)
+{
+	return ((const uint8_t *)&s_mb_device_objects)[s_mb_device_offsets[index]];
+}
+
+// Reply: unit, 11, byte count, MB_SERVER_ID, run indicator (FF), then every
+// identification object as id, length and text, CRC
+static void mb_report_server_id()
+{
+	if (s_input_buffer_count != 4)
 	{
-		uart_getc(RS485_DEV);
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+		return;
 	}
-	s_device->rsr = 0; // reset any error
-	irq_set_enabled(RS485_IRQ, true);
+	
+	memcpy(s_output_buffer, s_input_buffer, 2);
+	s_output_buffer[2] = 2 + sizeof(s_mb_device_objects);
+	s_output_buffer[3] = MB_SERVER_ID;
+	s_output_buffer[4] = 0xFF; // running
+	memcpy(s_output_buffer + 5, &s_mb_device_objects, sizeof(s_mb_device_objects));
+	s_output_buffer_count = 5 + sizeof(s_mb_device_objects);
+	mb_add_crc();
 }
 
-uint16_t mb_parse_addr()
+// Request: unit, 2B, 0E, read code (1 basic, 2 regular, 3 extended: stream
+// the category and those below it from object id; 4: that object alone),
+// object id, CRC. Reply: unit, 2B, 0E, read code, conformity, more follows
+// (FF when the next object did not fit), next object id, object count, then
+// the objects as id, length and text, CRC.
+static void mb_read_device_id()
 {
-	uint16_t addr = ((uint16_t)s_input_buffer[2]) << 8;
-	addr |= s_input_buffer[3];
-	return addr;
+	if (s_input_buffer_count < 3 || s_input_buffer[2] != MB_MEI_READ_DEVICE_ID)
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_FUNCTION);
+		return;
+	}
+	uint8_t code = s_input_buffer[3];
+	uint8_t object = s_input_buffer[4];
+	if (s_input_buffer_count != 7 || code < 1 || code > 4)
+	{
+		mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_DATA);
+		return;
+	}
+	
+	uint8_t first = 0;
+	while (first < MB_DEVICE_OBJECT_COUNT && mb_device_object_id(first) != object)
+	{
+		first++;
+	}
+	uint8_t last_id = code == 1 ? 0x02 : code == 2 ? 0x7F : 0xFF;
+	uint8_t end = first + 1;
+	if (code == 4)
+	{
+		if (first == MB_DEVICE_OBJECT_COUNT)
+		{
+			mb_set_output_as_error(MB_EXCEPTION_ILLEGAL_ADDRESS);
+			return;
+		}
+	}
+	else
+	{
+		if (first == MB_DEVICE_OBJECT_COUNT || object > last_id)
+		{
+			first = 0; // the spec restarts a stream from an unknown object at the beginning
+		}
+		end = first;
+		while (end < MB_DEVICE_OBJECT_COUNT && mb_device_object_id(end) <= last_id
+			&& 8 + s_mb_device_offsets[end + 1] - s_mb_device_offsets[first] + 2 <= MB_BUFFER_SIZE)
+		{
+			end++;
+		}
+	}
+	
+	bool more = code != 4 && end < MB_DEVICE_OBJECT_COUNT && mb_device_object_id(end) <= last_id;
+	uint16_t length = s_mb_device_offsets[end] - s_mb_device_offsets[first];
+	memcpy(s_output_buffer, s_input_buffer, 4);
+	s_output_buffer[4] = MB_DEVICE_CONFORMITY;
+	s_output_buffer[5] = more ? 0xFF : 0x00;
+	s_output_buffer[6] = more ? mb_device_object_id(end) : 0x00;
+	s_output_buffer[7] = end - first;
+	memcpy(s_output_buffer + 8, (const uint8_t *)&s_mb_device_objects + s_mb_device_offsets[first], length);
+	s_output_buffer_count = 8 + length;
+	mb_add_crc();
+}
+
+// Bucket for the current second, claiming a new one when the second has
+// moved on. Called from both the receive interrupt and task context.
+static mb_bus_bucket_t *mb_bus_bucket()
+{
+	uint64_t now = time_us_64();
+	if (now >= s_bus_second_end_us)
+	{
+		uint32_t irq = save_and_disable_interrupts();
+		if (now >= s_bus_second_end_us)
+		{
+			uint32_t elapsed_s = (uint32_t)((now - s_bus_second_end_us) / 1000000) + 1;
+			s_bus_second += elapsed_s;
+			s_bus_second_end_us += (uint64_t)elapsed_s * 1000000;
+			mb_bus_bucket_t *bucket = &s_bus_buckets[s_bus_second % MB_RANGE_COUNT(s_bus_buckets)];
+			memset(bucket, 0, sizeof(*bucket));
+			bucket->second = s_bus_second;
+		}
+		restore_interrupts(irq);
+	}
+	return &s_bus_buckets[s_bus_second % MB_RANGE_COUNT(s_bus_buckets)];
+}
+
+// Sums over the last complete seconds of a window, cached until the next second
+static const mb_bus_window_t *mb_bus_window(uint8_t window)
+{
+	mb_bus_bucket();
+	mb_bus_window_t *sum = &s_bus_windows[window];
+	if (sum->second == s_bus_second)
+	{
+		return sum;
+	}
+	
+	memset(sum, 0, sizeof(*sum));
+	sum->second = s_bus_second;
+	for (uint8_t i = 1; i <= s_bus_window_seconds[window]; i++)
+	{
+		uint32_t second = s_bus_second - i;
+		const mb_bus_bucket_t *bucket = &s_bus_buckets[second % MB_RANGE_COUNT(s_bus_buckets)];
+		if (bucket->second != second || second > s_bus_second)
+		{
+			continue; // nothing happened that second, or before boot
+		}
+		sum->chars += bucket->chars;
+		sum->frames_ours += bucket->frames_ours;
+		sum->frames_other += bucket->frames_other;
+		sum->crc_errors += bucket->crc_errors;
+		sum->parity_errors += bucket->parity_errors;
+		sum->framing_errors += bucket->framing_errors;
+		sum->overruns += bucket->overruns;
+		if (bucket->gap_count)
+		{
+			sum->gap_min_us = sum->gap_count == 0 || bucket->gap_min_us < sum->gap_min_us ? bucket->gap_min_us : sum->gap_min_us;
+			sum->gap_max_us = bucket->gap_max_us > sum->gap_max_us ? bucket->gap_max_us : sum->gap_max_us;
+			sum->gap_count += bucket->gap_count;
+			sum->gap_total_us += bucket->gap_total_us;
+		}
+	}
+	return sum;
+}
+
+// Time the line carried characters, in 0.1 % of the window
+static uint32_t mb_bus_utilisation(const mb_bus_window_t *sum, uint8_t window)
+{
+	if (s_baud == 0)
+	{
+		return 0;
+	}
+	return (uint32_t)((uint64_t)sum->chars * s_sym_size * 1000 / ((uint64_t)s_baud * s_bus_window_seconds[window]));
+}
+
+static uint16_t mb_saturate16(uint32_t value)
+{
+	return value > UINT16_MAX ? UINT16_MAX : value;
+}
+
+uint16_t mb_bus_stats_read(uint16_t addr)
+{
+	uint8_t window = (addr - MB_IR_BUS_STATS) / MB_BUS_STAT_COUNT;
+	const mb_bus_window_t *sum = mb_bus_window(window);
+	switch ((addr - MB_IR_BUS_STATS) % MB_BUS_STAT_COUNT)
+	{
+	case MB_BUS_STAT_UTILISATION:
+		return mb_bus_utilisation(sum, window);
+	case MB_BUS_STAT_FRAMES_OURS:
+		return mb_saturate16(sum->frames_ours);
+	case MB_BUS_STAT_FRAMES_OTHER:
+		return mb_saturate16(sum->frames_other);
+	case MB_BUS_STAT_CRC_ERRORS:
+		return mb_saturate16(sum->crc_errors);
+	case MB_BUS_STAT_PARITY_ERRORS:
+		return mb_saturate16(sum->parity_errors);
+	case MB_BUS_STAT_FRAMING_ERRORS:
+		return mb_saturate16(sum->framing_errors);
+	case MB_BUS_STAT_OVERRUNS:
+		return mb_saturate16(sum->overruns);
+	case MB_BUS_STAT_GAP_AVG:
+		return sum->gap_count ? mb_saturate16(sum->gap_total_us / sum->gap_count) : 0;
+	case MB_BUS_STAT_GAP_MIN:
+		return mb_saturate16(sum->gap_min_us);
+	case MB_BUS_STAT_GAP_MAX:
+		return mb_saturate16(sum->gap_max_us);
+	default:
+		return 0;
+	}
+}
+
+void mb_print_bus_stats()
+{
+	printf("** BUS TELEMETRY ** (%lu baud, complete seconds only)\r\n", s_baud);
+	printf("WINDOW\tBUSY %%\tOURS/s\tOTHER/s\tCRC\tPARITY\tFRAMING\tOVERRUN\tMASTER GAP us (min/avg/max)\r\n");
+	for (uint8_t i = 0; i < MB_BUS_WINDOWS; i++)
+	{
+		const mb_bus_window_t *sum = mb_bus_window(i);
+		uint32_t seconds = s_bus_window_seconds[i];
+		uint32_t busy = mb_bus_utilisation(sum, i);
+		printf("%lu s\t%lu.%lu\t%lu.%lu\t%lu.%lu\t%lu\t%lu\t%lu\t%lu\t", seconds, busy / 10, busy % 10,
+			sum->frames_ours / seconds, sum->frames_ours * 10 / seconds % 10,
+			sum->frames_other / seconds, sum->frames_other * 10 / seconds % 10,
+			sum->crc_errors, sum->parity_errors, sum->framing_errors, sum->overruns);
+		if (sum->gap_count)
+		{
+			printf("%lu/%lu/%lu\r\n", sum->gap_min_us, (uint32_t)(sum->gap_total_us / sum->gap_count), sum->gap_max_us);
+		}
+		else
+		{
+			printf("-\r\n");
+		}
+	}
 }
 
 void mb_set_output_as_error(uint8_t error)
 {
-	s_output_buffer[0] = s_address;
+	MB_COUNT(MB_EXCEPTION);
+	s_output_buffer[0] = s_input_buffer[0]; // the unit that was addressed
 	s_output_buffer[1] = s_input_buffer[1] + MB_FUNC_EXCEPTION_MODIFIER;
 	s_output_buffer[2] = error;
 	s_output_buffer_count = 3;
@@ -398,14 +2608,186 @@ void mb_set_output_as_error(uint8_t error)
 void mb_print_stats()
 {
 	printf("** MODBUS STATISTICS **\r\n");
-	printf("BUS MESSAGE\t= %d\r\n", s_mb_serial_counters[MB_BUS_MESSAGE]);
-	printf("BUS COM ERROR\t= %d\r\n", s_mb_serial_counters[MB_BUS_COM_ERROR]);
-	printf("EXCEPTION\t= %d\r\n", s_mb_serial_counters[MB_EXCEPTION]);
-	printf("MESSAGE\t\t= %d\r\n", s_mb_serial_counters[MB_MESSAGE]);
-	printf("NO RESPONSE\t= %d\r\n", s_mb_serial_counters[MB_NO_RESPONSE]);
-	printf("NAK\t\t= %d\r\n", s_mb_serial_counters[MB_NAK]);
-	printf("BUSY\t\t= %d\r\n", s_mb_serial_counters[MB_BUSY]);
-	printf("OVERRUN\t\t= %d\r\n", s_mb_serial_counters[MB_OVERRUN]);
+	printf("BUS MESSAGE\t= %lu\r\n", s_mb_serial_counters[MB_BUS_MESSAGE]);
+	printf("BUS COM ERROR\t= %lu\r\n", s_mb_serial_counters[MB_BUS_COM_ERROR]);
+	printf("EXCEPTION\t= %lu\r\n", s_mb_serial_counters[MB_EXCEPTION]);
+	printf("MESSAGE\t\t= %lu\r\n", s_mb_serial_counters[MB_MESSAGE]);
+	printf("NO RESPONSE\t= %lu\r\n", s_mb_serial_counters[MB_NO_RESPONSE]);
+	printf("NAK\t\t= %lu\r\n", s_mb_serial_counters[MB_NAK]);
+	printf("BUSY\t\t= %lu\r\n", s_mb_serial_counters[MB_BUSY]);
+	printf("OVERRUN\t\t= %lu\r\n", s_mb_serial_counters[MB_OVERRUN]);
+	printf("COMM EVENTS\t= %lu\r\n", s_comm_event_counter);
+	printf("LISTEN ONLY\t= %s\r\n", s_listen_only ? "YES" : "NO");
+#if MB_RESPONSE_CACHE_ENTRIES
+	uint32_t lookups = s_cache_hits + s_cache_misses;
+	uint32_t hit_avg = s_cache_hits ? (uint32_t)(s_cache_hit_cycles / s_cache_hits) : 0;
+	uint32_t miss_avg = s_cache_misses ? (uint32_t)(s_cache_miss_cycles / s_cache_misses) : 0;
+	printf("CACHE HITS\t= %lu\r\n", s_cache_hits);
+	printf("CACHE MISSES\t= %lu\r\n", s_cache_misses);
+	printf("CACHE HIT RATE\t= %lu%%\r\n", lookups ? (uint32_t)(100ULL * s_cache_hits / lookups) : 0);
+	printf("HIT CYCLES\t= %lu avg\r\n", hit_avg);
+	printf("MISS CYCLES\t= %lu avg\r\n", miss_avg);
+	printf("CYCLES SAVED\t= %llu\r\n", miss_avg > hit_avg ? (uint64_t)s_cache_hits * (miss_avg - hit_avg) : 0ULL);
+#endif
+}
+
+static bool mb_unit_served(uint8_t unit)
+{
+	return unit == MB_UNIT_DIRECT || unit == MB_BROADCAST_ID || (s_unit_bitmap[unit / 32] & (1u << (unit % 32)));
+}
+
+// Runs the frame already in s_input_buffer for a transport other than RS485
+// and copies out the reply, without its unit id and CRC when pdu_only is set
+static int16_t mb_transport_process(uint8_t unit, uint8_t *reply, bool pdu_only)
+{
+	// The receive interrupt only fills s_rx_buffer, so an RS485 frame arriving
+	// now waits for the task (or the fast path alarm) until we are done
+	s_transport_busy = true;
+	s_unit = unit == MB_UNIT_DIRECT ? &s_mb_units[0] : mb_unit_find(unit);
+	mb_function_process();
+	
+	int16_t reply_count = 0;
+	if (unit != MB_BROADCAST_ID && !s_reply_suppressed)
+	{
+		reply_count = pdu_only ? s_output_buffer_count - 3 : s_output_buffer_count;
+		memcpy(reply, s_output_buffer + (pdu_only ? 1 : 0), reply_count);
+	}
+	s_output_buffer_count = 0;
+	s_transport_busy = false;
+	return reply_count;
+}
+
+int16_t mb_process_frame(const uint8_t *frame, uint16_t count, uint8_t *reply)
+{
+	if (s_mb_state != MB_IDLE)
+	{
+		return -1; // the RS485 port is between check and reply on the shared buffers
+	}
+	if (count < 4 || count > MB_BUFFER_SIZE || CRC16((uint8_t *)frame, count - 2) != (frame[count - 2] | (frame[count - 1] << 8)))
+	{
+		return 0;
+	}
+	if (!mb_unit_served(frame[0]))
+	{
+		return 0;
+	}
+	
+	memcpy(s_input_buffer, frame, count);
+	s_input_buffer_count = count;
+	return mb_transport_process(frame[0], reply, false);
+}
+
+int16_t mb_process_pdu(uint8_t unit, const uint8_t *pdu, uint16_t count, uint8_t *reply)
+{
+	if (s_mb_state != MB_IDLE)
+	{
+		return -1;
+	}
+	if (count < 1 || count + 3 > MB_BUFFER_SIZE)
+	{
+		return 0;
+	}
+	if (!mb_unit_served(unit))
+	{
+		reply[0] = pdu[0] | MB_FUNC_EXCEPTION_MODIFIER;
+		reply[1] = MB_EXCEPTION_GATEWAY_NO_RESPONSE;
+		return 2;
+	}
+	
+	// TCP has no broadcast, unit 0 addresses the device like 255. The handlers
+	// check lengths with the CRC included, so the frame is rebuilt as RTU.
+	unit = unit == MB_BROADCAST_ID ? MB_UNIT_DIRECT : unit;
+	s_input_buffer[0] = unit;
+	memcpy(s_input_buffer + 1, pdu, count);
+	uint16_t crc = CRC16(s_input_buffer, count + 1);
+	s_input_buffer[count + 1] = crc & 0xFF;
+	s_input_buffer[count + 2] = (crc >> 8) & 0xFF;
+	s_input_buffer_count = count + 3;
+	return mb_transport_process(unit, reply, true);
+}
+
+uint64_t mb_first_reply_us()
+{
+	return s_first_reply_us;
+}
+
+uint32_t mb_bus_idle_us()
+{
+	if (s_mb_state != MB_IDLE)
+	{
+		return 0;
+	}
+	uint64_t idle_us = time_us_64() - s_last_byte_us;
+	return idle_us > UINT32_MAX ? UINT32_MAX : (uint32_t)idle_us;
+}
+
+uint32_t mb_char_time_us()
+{
+	return s_char_time_us;
+}
+
+uint32_t mb_t35_us()
+{
+	return s_t35_us;
+}
+
+void mb_set_response_delay(uint32_t delay_us)
+{
+	s_response_delay_us = delay_us;
+}
+
+uint32_t mb_get_response_delay()
+{
+	return s_response_delay_us;
+}
+
+void mb_print_turnaround()
+{
+	static const char *class_names[MB_TURNAROUND_CLASS_COUNT] = { "FC02", "FC05", "OTHER" };
+	static mb_turnaround_t s_copy[MB_TURNAROUND_CLASS_COUNT];
+	
+	// Printed from a copy, a reply recorded meanwhile cannot tear a line
+	uint32_t irq_state = save_and_disable_interrupts();
+	memcpy(s_copy, s_turnaround, sizeof(s_copy));
+	restore_interrupts(irq_state);
+	
+	printf("** MODBUS TURNAROUND **\r\n");
+	printf("FAST PATH\t= %s\r\n", MB_FAST_TURNAROUND ? "ON" : "OFF");
+	printf("RESPONSE DELAY\t= %lu us\r\n", s_response_delay_us);
+	printf("EARLIEST REPLY\t= %lu us\r\n", mb_reply_holdoff_us());
+	for (uint8_t i = 0; i < MB_TURNAROUND_CLASS_COUNT; i++)
+	{
+		const mb_turnaround_t *t = &s_copy[i];
+		if (t->count == 0)
+		{
+			printf("%s\t\t= none\r\n", class_names[i]);
+			continue;
+		}
+		
+		printf("%s\t\t= %lu replies, min %lu us, avg %lu us, max %lu us\r\n", class_names[i], t->count,
+			t->min_us, (uint32_t)(t->total_us / t->count), t->max_us);
+		printf("  late by");
+		for (uint8_t b = 0; b < MB_TURNAROUND_BUCKETS; b++)
+		{
+			if (t->late[b])
+			{
+				printf(" %s%luus:%lu", b == MB_TURNAROUND_BUCKETS - 1 ? ">=" : "<",
+					b == MB_TURNAROUND_BUCKETS - 1 ? 1ul << (b - 1) : 1ul << b, t->late[b]);
+			}
+		}
+		printf("\r\n");
+	}
+}
+
+void mb_reset_turnaround()
+{
+	uint32_t irq_state = save_and_disable_interrupts();
+	memset(s_turnaround, 0, sizeof(s_turnaround));
+	for (uint8_t i = 0; i < MB_TURNAROUND_CLASS_COUNT; i++)
+	{
+		s_turnaround[i].min_us = UINT32_MAX;
+	}
+	restore_interrupts(irq_state);
 }
 
 #if MB_COILS
@@ -413,14 +2795,17 @@ void mb_set_coil(uint16_t addr, bool on)
 {
 	uint16_t register_addr = addr / 16;
 	uint16_t bit_mask = 1  << (addr % 16);
-	if (on)
-	{
-		s_mb_coils[register_addr] |= bit_mask;
-	}
-	else
+	#if MB_FAST_TURNAROUND
+		uint32_t irq_state = save_and_disable_interrupts(); // FC05 may write from the alarm interrupt
+	#endif
+	if (on != !!(s_mb_coils[register_addr] & bit_mask))
 	{
-		s_mb_coils[register_addr] &= ~bit_mask;
+		s_mb_coils[register_addr] ^= bit_mask;
+		s_table_generation[MB_TABLE_COILS]++;
 	}
+	#if MB_FAST_TURNAROUND
+		restore_interrupts(irq_state);
+	#endif
 }
 
 bool mb_get_coil(uint16_t addr)
@@ -436,13 +2821,10 @@ void mb_set_discrete_input(uint16_t addr, bool on)
 {
 	uint16_t register_addr = addr / 16;
 	uint16_t bit_mask = 1  << (addr % 16);
-	if (on)
-	{
-		s_mb_inputs[register_addr] |= bit_mask;
-	}
-	else
+	if (on != !!(s_mb_inputs[register_addr] & bit_mask))
 	{
-		s_mb_inputs[register_addr] &= ~bit_mask;
+		s_mb_inputs[register_addr] ^= bit_mask;
+		s_table_generation[MB_TABLE_INPUTS]++;
 	}
 }
 
@@ -452,4 +2834,28 @@ bool mb_get_discrete_input(uint16_t addr)
 	uint16_t bit_mask = 1  << (addr % 16);
 	return s_mb_inputs[register_addr] & bit_mask;
 }
+#endif
+
+#if MB_INPUT_REGISTERS
+void mb_set_input_register(uint16_t addr, uint16_t value)
+{
+	mb_map_write(&s_mb_input_register_map, addr, value);
+}
+
+uint16_t mb_get_input_register(uint16_t addr)
+{
+	return mb_map_read(&s_mb_input_register_map, addr);
+}
+#endif
+
+#if MB_HOLDING_REGISTERS
+void mb_set_holding_register(uint16_t addr, uint16_t value)
+{
+	mb_map_write(&s_mb_holding_register_map, addr, value);
+}
+
+uint16_t mb_get_holding_register(uint16_t addr)
+{
+	return mb_map_read(&s_mb_holding_register_map, addr);
+}
 #endif
\ No newline at end of file
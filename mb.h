@@ -2,10 +2,12 @@
 
 #include <stdint.h>
 #include "pico/stdlib.h"
+#include "hardware/uart.h"
 
 #define MB_DEBUG_ENABLE 1
 
 #define MB_BROADCAST_ID 0
+#define MB_UNIT_DIRECT 0xFF // point to point transports only, answered as the DIP switch address
 	
 #define MB_FUNC_READ_DISCRETE_INPUTS 0x02
 #define MB_FUNC_READ_COILS 0x01
@@ -26,6 +28,10 @@
 #define MB_FUNC_GET_COM_EVENT_LOG 0x0C
 #define MB_FUNC_REPORT_SERVER_ID 0x11
 #define MB_FUNC_READ_DEVICE_ID 0x2B
+#define MB_MEI_READ_DEVICE_ID 0x0E // FC2B MEI type
+#define MB_FUNC_SCATTER_READ 0x41 // vendor specific, several (table, start, quantity) ranges in one request
+
+#define MB_SCATTER_MAX_RANGES 16
 
 #define MB_DIAG_SUB_QUERY_DATA 0x00
 #define MB_DIAG_RESTART_COM 0x01
@@ -41,6 +47,7 @@
 #define MB_DIAG_SERVER_NAK_COUNT 0x10
 #define MB_DIAG_SERVER_BUSY_COUNT 0x11
 #define MB_DIAG_BUS_OVERRUN_COUNT 0x12
+#define MB_DIAG_CLEAR_OVERRUN 0x14
 
 #define MB_EXCEPTION_ILLEGAL_FUNCTION 0x01
 #define MB_EXCEPTION_ILLEGAL_ADDRESS 0x02
@@ -49,16 +56,168 @@
 #define MB_EXCEPTION_ACK 0x05
 #define MB_EXCEPTION_BUSY 0x06
 #define MB_EXCEPTION_MEM_PARITY_ERROR 0x08
+#define MB_EXCEPTION_GATEWAY_NO_RESPONSE 0x0B
 
 #define MB_FUNC_EXCEPTION_MODIFIER 0x80
 
 #define MB_BUFFER_SIZE 256 // max frame size
+#define MB_ACK_THRESHOLD_MS 1000 // accepted commands running longer than this are answered with ACK
+#define MB_FAST_TURNAROUND 0 // 1 = check frames and send FC02/FC05 replies from the T3.5 alarm interrupt, needs MB_DEBUG_ENABLE 0
+#define MB_RESPONSE_DELAY_US 0 // minimum time from the end of a request to the first reply byte, for slow masters
+#define MB_RESPONSE_CACHE_ENTRIES 4 // built FC02/FC03/FC04 replies kept for repeated polls, 0 disables the cache
+#define MB_RESPONSE_CACHE_FRAME_SIZE 64 // longer replies are rebuilt every time
+#define MB_EVENT_LOG_SIZE 64 // FC0C comm event log entries, the spec maximum
+#define MB_BUS_HISTORY_S 60 // longest bus telemetry window
+#define MB_RX_CAPTURE_SIZE 512 // characters taken in while flash is busy, a 45 ms sector erase at 115200 baud
+
+#define MB_FRAMING_RTU 0
+#define MB_FRAMING_ASCII 1 // ':' start, hex pairs, LRC, CR and the delimiter end the frame
+#define MB_ASCII_START ':'
+#define MB_ASCII_DELIMITER '\n' // default end of frame after CR, FC08 sub 03 changes it
+#define MB_ASCII_DATA_BITS 7 // PL011 only, the PIO port always frames 8 data bits
+#define MB_ASCII_BUFFER_SIZE (2 * MB_BUFFER_SIZE + 1) // ':', hex of the frame with an LRC for the CRC, CR, delimiter
 
 // Data Model Definitions
 #define MB_INPUTS 2
 #define MB_COILS 1
-#define MB_INPUT_REGISTERS 0
-#define MB_HOLDING_REGISTERS 0
+#define MB_INPUT_REGISTERS 12
+#define MB_HOLDING_REGISTERS 1
+
+#define MB_MAX_READ_REGISTERS 125
+#define MB_MAX_WRITE_REGISTERS 123
+
+// Input Register Map
+#define MB_IR_PULSE_COUNT 0 // 32-bit edge count per input, high word first
+#define MB_IR_PULSE_FREQ 4 // 32-bit frequency per input in mHz, high word first
+#define MB_IR_VSENSE_5V 8 // 5V rail in mV
+#define MB_IR_VSENSE_12V 9 // 12V rail in mV
+#define MB_IR_OUTPUT_STATUS 10 // bit per output, set while its command is still running
+#define MB_IR_OUTPUT_COMPLETED 11 // wrapping count of finished output commands
+#define MB_IR_BUS_STATS 200 // MB_BUS_STAT_COUNT registers per window: last 1 s, 10 s and 60 s
+#define MB_BUS_WINDOWS 3
+#define MB_IR_LOGIC_STATS 300 // LOGIC_STAT_COUNT logic engine scan statistics, see logic.h
+#define MB_IR_HISTORY 320 // HISTORY_STAT_COUNT event history log position and counters, see history.h
+#define MB_IR_POLL 1000 // MB_POLL_REGISTERS values copied from downstream slaves in master mode
+#define MB_IR_POLL_STATUS 1500 // one register per MB_POLLS entry, MB_POLL_STATUS_* (mb_master.h)
+
+// Bus telemetry registers from MB_IR_BUS_STATS, repeated per window. Counts
+// are totals over the window's complete seconds and saturate at 65535.
+enum MB_BUS_STATS
+{
+	MB_BUS_STAT_UTILISATION, // time the line carried characters, ours included, in 0.1 %
+	MB_BUS_STAT_FRAMES_OURS, // CRC-valid frames for our units and broadcasts
+	MB_BUS_STAT_FRAMES_OTHER, // CRC-valid frames for other nodes, their replies included
+	MB_BUS_STAT_CRC_ERRORS,
+	MB_BUS_STAT_PARITY_ERRORS, // characters
+	MB_BUS_STAT_FRAMING_ERRORS, // characters
+	MB_BUS_STAT_OVERRUNS, // characters lost to a full FIFO or frame buffer
+	MB_BUS_STAT_GAP_AVG, // us from the end of our reply to the start of the next frame
+	MB_BUS_STAT_GAP_MIN,
+	MB_BUS_STAT_GAP_MAX,
+	MB_BUS_STAT_COUNT
+};
+
+// Holding Register Map
+#define MB_HR_PULSE_RESET 0 // write a bit mask of inputs to zero their pulse counters
+#define MB_HR_CONFIG 100 // NVCONFIG_HR_COUNT configuration registers, see nvconfig.h
+#define MB_HR_LOGIC 300 // LOGIC_HR_COUNT logic engine command, staging and program registers, see logic.h
+#define MB_HR_IMAGE 600 // IMAGE_HR_COUNT staging slot transfer command, size and CRC, see image.h
+
+// Register blocks, sorted by first address and not overlapping. Only mapped
+// addresses cost memory, so blocks can sit anywhere in the 64K space.
+// MB_STORAGE(first, count) is backed by RAM in mb.c, MB_CALLBACK(first, count,
+// read, write) calls out for every register (write may be NULL for read only).
+// Blocks that touch are read and written across as one.
+#define MB_INPUT_REGISTER_RANGES(MB_STORAGE, MB_CALLBACK) \
+	MB_STORAGE(0, MB_INPUT_REGISTERS) \
+	MB_CALLBACK(MB_IR_BUS_STATS, MB_BUS_WINDOWS * MB_BUS_STAT_COUNT, mb_bus_stats_read, NULL) \
+	MB_CALLBACK(MB_IR_LOGIC_STATS, LOGIC_STAT_COUNT, logic_stats_read, NULL) \
+	MB_CALLBACK(MB_IR_HISTORY, HISTORY_STAT_COUNT, history_stats_read, NULL) \
+	MB_MASTER_INPUT_REGISTER_RANGES(MB_STORAGE, MB_CALLBACK)
+
+#define MB_HOLDING_REGISTER_RANGES(MB_STORAGE, MB_CALLBACK) \
+	MB_STORAGE(0, MB_HOLDING_REGISTERS) \
+	MB_CALLBACK(MB_HR_CONFIG, NVCONFIG_HR_COUNT, nvconfig_hr_read, nvconfig_hr_write) \
+	MB_CALLBACK(MB_HR_LOGIC, LOGIC_HR_COUNT, logic_hr_read, logic_hr_write) \
+	MB_CALLBACK(MB_HR_IMAGE, IMAGE_HR_COUNT, image_hr_read, image_hr_write)
+
+// File records for FC14/FC15, served by the main unit only. MB_FILE(first,
+// count, read, write) answers file numbers first..first+count-1; read(file,
+// record, count, data) fills count registers, high byte first, write takes
+// them the same way (NULL for read only), both return an exception code or 0.
+// Records are numbered 0-9999 within a file.
+#define MB_FILE_HISTORY 1 // HISTORY_FILES files of event log pages, see history.h
+#define MB_FILE_LOGIC 12 // the staged logic program, see logic.h
+#define MB_FILE_IMAGE 16 // IMAGE_FILES files over the staging slot, see image.h
+#define MB_FILE_IMAGE_REFUSED 48 // image writes refused with BUSY, see image.h
+#define MB_FILE_IMAGE_CRC 49 // CRC per image slot sector, see image.h
+#define MB_FILES(MB_FILE) \
+	MB_FILE(MB_FILE_HISTORY, HISTORY_FILES, history_file_read, NULL) \
+	MB_FILE(MB_FILE_LOGIC, 1, logic_file_read, logic_file_write) \
+	MB_FILE(MB_FILE_IMAGE, IMAGE_FILES, image_file_read, image_file_write) \
+	MB_FILE(MB_FILE_IMAGE_REFUSED, 1, image_refused_read, NULL) \
+	MB_FILE(MB_FILE_IMAGE_CRC, 1, image_sector_crc_read, NULL)
+#define MB_FILE_RECORDS 10000
+#define MB_FILE_REFERENCE_TYPE 6
+
+// Virtual units, extra unit ids 1-247 answered besides the DIP switch address.
+// MB_UNIT(id, bits, input view, holding view): bits = 1 shares the coils and
+// discrete inputs, a view lists MB_ALIAS(first, count, block, offset) sorted by
+// first, mapping first.. onto the MB_STORAGE block starting at block, from its
+// register offset. MB_NO_VIEW leaves that table empty for the unit. e.g. input 2
+// alone as unit 100:
+//   #define MB_UNIT100_IR(MB_ALIAS) MB_ALIAS(0, 2, 0, 2) MB_ALIAS(2, 2, 0, 6)
+//   #define MB_UNITS(MB_UNIT) MB_UNIT(100, 0, MB_UNIT100_IR, MB_NO_VIEW)
+#define MB_UNITS(MB_UNIT)
+
+// Master mode: the RS485 port stops answering and instead polls downstream
+// slaves, the upstream SCADA reads the results over USB (RTU or Modbus TCP
+// through the gateway). MB_POLL(slave, function, first, count, period ms,
+// local) reads first..first+count-1 from the slave with function 1-4 every
+// period (0 = as often as the bus allows) into input register MB_IR_POLL +
+// local, coils and discrete inputs packed 16 to a register, low bit first.
+#define MB_MASTER 0 // 1 = poll MB_POLLS as a bus master instead of answering on the RS485 port
+#define MB_POLLS(MB_POLL) \
+	MB_POLL(1, MB_FUNC_READ_INPUT_REGISTER, 0, 12, 100, 0) \
+	MB_POLL(2, MB_FUNC_READ_DISCRETE_INPUTS, 0, 2, 50, 12)
+#define MB_POLL_REGISTERS 64
+#define MB_MASTER_TIMEOUT_US 50000 // from the end of a request to the first character of its reply
+#define MB_MASTER_RETRIES 2 // further attempts before a poll is marked failed
+
+#define MB_POLL_PLUS_ONE(slave, function, first, count, period_ms, local) + 1
+#define MB_POLL_COUNT (0 MB_POLLS(MB_POLL_PLUS_ONE))
+
+#if MB_MASTER
+#define MB_MASTER_INPUT_REGISTER_RANGES(MB_STORAGE, MB_CALLBACK) \
+	MB_STORAGE(MB_IR_POLL, MB_POLL_REGISTERS) \
+	MB_CALLBACK(MB_IR_POLL_STATUS, MB_POLL_COUNT, mb_master_status_read, NULL)
+#else
+#define MB_MASTER_INPUT_REGISTER_RANGES(MB_STORAGE, MB_CALLBACK)
+#endif
+
+#define MB_MAP_BENCHMARK 0 // 1 = add "map bench", timing lookups in synthetic 10 and 200 block maps
+
+// Device identification for FC2B/0E and FC11, compile time constants only.
+// MB_DEVICE_OBJECT(id, name, value), sorted by id: 0x00-0x02 basic (all
+// required), 0x03-0x7F regular, 0x80-0xFF extended. mb.c lays them out as they
+// go on the wire (id, length, text), so a reply is a copy of a slice. FC11
+// answers MB_SERVER_ID, the run indicator and the whole list at once, one
+// request per node for an inventory.
+#define MB_STRINGIFY_TEXT(x) #x
+#define MB_STRINGIFY(x) MB_STRINGIFY_TEXT(x)
+#define MB_DEVICE_FEATURES \
+	"master=" MB_STRINGIFY(MB_MASTER) " pio=" MB_STRINGIFY(RS485_USE_PIO) " fast=" MB_STRINGIFY(MB_FAST_TURNAROUND) \
+	" cache=" MB_STRINGIFY(MB_RESPONSE_CACHE_ENTRIES)
+#define MB_DEVICE_OBJECTS(MB_DEVICE_OBJECT) \
+	MB_DEVICE_OBJECT(0x00, vendor_name, "ModBusEndpoint") \
+	MB_DEVICE_OBJECT(0x01, product_code, "MBEP-RP2040") \
+	MB_DEVICE_OBJECT(0x02, revision, MB_STRINGIFY(BUILD_VERSION_MAJOR) "." MB_STRINGIFY(BUILD_VERSION_MINOR) "." MB_STRINGIFY(BUILD_NUMBER)) \
+	MB_DEVICE_OBJECT(0x04, product_name, "RP2040 Modbus Endpoint") \
+	MB_DEVICE_OBJECT(0x05, model_name, MB_STRINGIFY(MB_INPUTS) " inputs, " MB_STRINGIFY(MB_COILS) " outputs, 5V/12V sense") \
+	MB_DEVICE_OBJECT(0x80, build_time, BUILD_TIMESTAMP) \
+	MB_DEVICE_OBJECT(0x81, features, MB_DEVICE_FEATURES)
+#define MB_SERVER_ID 0x4D // FC11 server id byte
+#define MB_DEVICE_CONFORMITY 0x83 // basic, regular and extended, stream and individual access
 
 // Peripheral Definitions
 #define RS485_TX_PIN 0
@@ -66,14 +225,23 @@
 #define RS485_TX_EN_PIN 2
 #define RS485_RX_EN_PIN 3
 	
+#define RS485_USE_PIO 0 // 1 = run the port on PIO1 with hardware gap timing and DE control instead of the PL011
+
+#define RS485_PIO pio1
+
+#if RS485_USE_PIO
+#define RS485_IRQ PIO1_IRQ_0
+#else
 #define RS485_DEV uart0
 #define RS485_IRQ UART0_IRQ
+#endif
 
-#define RS485_BAUD 115200
+#define RS485_BAUD 115200 // defaults, the configuration store can override baud and parity
 #define RS485_DATA_BITS 8
 #define RS485_STOP_BITS 1
 #define RS485_PARITY UART_PARITY_EVEN
 #define RS485_SYM_SIZE (1 + RS485_DATA_BITS + RS485_STOP_BITS + 1)
+#define RS485_UART_FIFO_DEPTH 32
 
 #ifdef __cplusplus
 extern "C" {
@@ -88,7 +256,8 @@ extern "C" {
 		MB_EMISSION,
 		MB_PROCESSING_RESPONSE,
 		MB_PROCESSING_NO_RESPONSE,
-		MB_DISCARD
+		MB_DISCARD,
+		MB_TRANSMITTING // reply started from interrupt context, released by the alarm
 	};
 	
 	enum FRAME_STATUS
@@ -97,7 +266,7 @@ extern "C" {
 		MB_FRAME_NOK
 	};
 	
-	void mb_init(uint8_t address);
+	void mb_init(uint8_t address, uint32_t baud, uart_parity_t parity, uint8_t framing);
 	void mb_set_id(uint8_t address);
 	void mb_receive_char();
 	void mb_process();
@@ -109,6 +278,42 @@ extern "C" {
 	bool mb_valid_addr(uint16_t addr);
 	void mb_set_output_as_error(uint8_t error);
 	void mb_print_stats();
+	uint32_t mb_bus_idle_us(); // time the bus has been quiet, 0 while a frame is being handled
+	// Around every flash erase and program, see flash_io.h. The lockout leaves
+	// interrupts on with only the RS485 receive interrupt enabled, running a
+	// RAM handler that queues characters; the release puts them through the
+	// normal receive path before everything else is enabled again.
+	uint32_t mb_flash_lockout();
+	void mb_flash_release(uint32_t irq_state);
+	uint32_t mb_char_time_us();
+	uint32_t mb_t35_us();
+	#if MB_MASTER
+		// Puts a request on the bus, task context. Returns 0 once it has gone
+		// out, otherwise the time until T3.5 of silence allows it.
+		uint32_t mb_send_request(const uint8_t *frame, uint16_t count);
+	#endif
+	uint64_t mb_first_reply_us(); // time_us_64() when the first reply went out, 0 until then
+	
+	// Runs a whole RTU frame (CRC included) from another transport through the
+	// same data model, task context only. Returns the reply length in reply (at
+	// least MB_BUFFER_SIZE bytes), 0 for no reply, or -1 while the RS485 port
+	// holds the buffers and the caller should try again shortly.
+	int16_t mb_process_frame(const uint8_t *frame, uint16_t count, uint8_t *reply);
+	// As mb_process_frame() for a bare PDU (function code onwards, no CRC) as
+	// carried by Modbus TCP; the reply is a bare PDU too. Unit ids this device
+	// does not serve get a gateway exception rather than silence.
+	int16_t mb_process_pdu(uint8_t unit, const uint8_t *pdu, uint16_t count, uint8_t *reply);
+	uint16_t mb_bus_stats_read(uint16_t addr);
+	void mb_print_bus_stats();
+	void mb_set_response_delay(uint32_t delay_us);
+	uint32_t mb_get_response_delay();
+	void mb_print_turnaround();
+	void mb_reset_turnaround();
+	void mb_print_map();
+	void mb_print_units();
+#if MB_MAP_BENCHMARK
+	void mb_map_benchmark();
+#endif
 	
 #if MB_COILS
 	void mb_set_coil(uint16_t addr, bool on);
@@ -119,6 +324,16 @@ extern "C" {
 	void mb_set_discrete_input(uint16_t addr, bool on);
 	bool mb_get_discrete_input(uint16_t addr);
 #endif
+
+#if MB_INPUT_REGISTERS
+	void mb_set_input_register(uint16_t addr, uint16_t value);
+	uint16_t mb_get_input_register(uint16_t addr);
+#endif
+
+#if MB_HOLDING_REGISTERS
+	void mb_set_holding_register(uint16_t addr, uint16_t value);
+	uint16_t mb_get_holding_register(uint16_t addr);
+#endif
 	
 
 
@@ -0,0 +1,300 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "mb_master.h"
+#include "mb.h"
+#include "crc.h"
+#include "scheduler.h"
+#include "pico/stdlib.h"
+
+#if MB_MASTER
+
+// RTU allows one request on the bus at a time, so throughput comes from
+// leaving no gap beyond T3.5 between transactions. Requests never change, they
+// are built once at init and the next one goes out from the same task run
+// that takes the previous reply. Polls are sent in order of when they fell
+// due, so a table asking for more than the bus can carry slows every poll
+// down evenly instead of starving the slow ones.
+
+#define MB_MASTER_REQUEST_SIZE 8
+
+typedef struct
+{
+	uint8_t slave;
+	uint8_t function;
+	uint16_t first;
+	uint16_t count;
+	uint16_t period_ms;
+	uint16_t local; // register offset from MB_IR_POLL
+} mb_poll_t;
+
+typedef struct
+{
+	uint64_t due_us;
+	uint16_t status;
+	uint32_t replies;
+	uint32_t exceptions;
+	uint32_t failures;
+	uint32_t retries;
+	uint32_t max_us; // first request to the poll being settled
+} mb_poll_state_t;
+
+#define MB_POLL_ENTRY(slave, function, first, count, period_ms, local) { slave, function, first, count, period_ms, local },
+static const mb_poll_t s_polls[] = { MB_POLLS(MB_POLL_ENTRY) };
+static mb_poll_state_t s_poll_state[MB_POLL_COUNT];
+static uint8_t s_requests[MB_POLL_COUNT][MB_MASTER_REQUEST_SIZE];
+
+static int16_t s_current = -1; // poll being worked on, also across retries
+static bool s_waiting = false; // its request is out and the reply is not
+static uint8_t s_attempt = 0;
+static uint64_t s_started_us = 0;
+static uint64_t s_deadline_us = 0;
+static uint32_t s_completed = 0;
+static uint32_t s_unexpected = 0; // frames heard with no request outstanding
+static uint64_t s_stats_since_us = 0;
+
+static bool mb_poll_bits(const mb_poll_t *poll)
+{
+	return poll->function == MB_FUNC_READ_COILS || poll->function == MB_FUNC_READ_DISCRETE_INPUTS;
+}
+
+static uint16_t mb_poll_reply_size(const mb_poll_t *poll)
+{
+	return 5 + (mb_poll_bits(poll) ? (poll->count + 7) / 8 : poll->count * 2);
+}
+
+static uint16_t mb_poll_local_size(const mb_poll_t *poll)
+{
+	return mb_poll_bits(poll) ? (poll->count + 15) / 16 : poll->count;
+}
+
+void mb_master_init()
+{
+	for (uint8_t i = 0; i < MB_POLL_COUNT; i++)
+	{
+		const mb_poll_t *poll = &s_polls[i];
+		if (poll->slave == MB_BROADCAST_ID || poll->slave > 247
+			|| poll->function < MB_FUNC_READ_COILS || poll->function > MB_FUNC_READ_INPUT_REGISTER
+			|| poll->count == 0 || poll->count > (mb_poll_bits(poll) ? 2000 : MB_MAX_READ_REGISTERS)
+			|| poll->local + mb_poll_local_size(poll) > MB_POLL_REGISTERS)
+		{
+			panic("Modbus poll %u invalid", i);
+		}
+		
+		uint8_t *request = s_requests[i];
+		request[0] = poll->slave;
+		request[1] = poll->function;
+		request[2] = poll->first >> 8;
+		request[3] = poll->first & 0xFF;
+		request[4] = poll->count >> 8;
+		request[5] = poll->count & 0xFF;
+		uint16_t crc = CRC16(request, 6);
+		request[6] = crc & 0xFF;
+		request[7] = crc >> 8;
+		
+		s_poll_state[i].status = MB_POLL_STATUS_NEVER;
+		s_poll_state[i].due_us = 0; // all due at once, they go out in table order
+	}
+	mb_master_reset_stats();
+	sched_post(SCHED_TASK_MASTER);
+}
+
+static uint8_t mb_master_next()
+{
+	uint8_t next = 0;
+	for (uint8_t i = 1; i < MB_POLL_COUNT; i++)
+	{
+		if (s_poll_state[i].due_us < s_poll_state[next].due_us)
+		{
+			next = i;
+		}
+	}
+	return next;
+}
+
+static void mb_master_send(uint64_t now)
+{
+	if (s_current < 0)
+	{
+		uint8_t next = mb_master_next();
+		if (s_poll_state[next].due_us > now)
+		{
+			sched_post_at(SCHED_TASK_MASTER, s_poll_state[next].due_us);
+			return;
+		}
+		s_current = next;
+		s_attempt = 0;
+		s_started_us = now;
+	}
+	
+	uint32_t wait_us = mb_send_request(s_requests[s_current], MB_MASTER_REQUEST_SIZE);
+	if (wait_us)
+	{
+		sched_post_at(SCHED_TASK_MASTER, now + wait_us);
+		return;
+	}
+	
+	s_waiting = true;
+	s_deadline_us = time_us_64() + MB_MASTER_TIMEOUT_US + mb_poll_reply_size(&s_polls[s_current]) * mb_char_time_us() + mb_t35_us();
+	sched_post_at(SCHED_TASK_MASTER, s_deadline_us);
+}
+
+static void mb_master_complete(uint16_t status)
+{
+	const mb_poll_t *poll = &s_polls[s_current];
+	mb_poll_state_t *state = &s_poll_state[s_current];
+	uint64_t now = time_us_64();
+	
+	state->status = status;
+	if (status == MB_POLL_STATUS_OK) { state->replies++; }
+	else if (status == MB_POLL_STATUS_NO_REPLY) { state->failures++; }
+	else { state->exceptions++; }
+	
+	uint32_t took_us = (uint32_t)(now - s_started_us);
+	state->max_us = took_us > state->max_us ? took_us : state->max_us;
+	
+	uint64_t due_us = state->due_us + poll->period_ms * 1000ull;
+	state->due_us = due_us > now ? due_us : now; // a late poll is not made up for with a burst
+	s_completed++;
+	s_current = -1;
+}
+
+static void mb_master_retry()
+{
+	if (s_attempt < MB_MASTER_RETRIES)
+	{
+		s_attempt++;
+		s_poll_state[s_current].retries++;
+		return; // the same request goes out next
+	}
+	mb_master_complete(MB_POLL_STATUS_NO_REPLY);
+}
+
+static void mb_master_store(const mb_poll_t *poll, const uint8_t *data)
+{
+	uint16_t addr = MB_IR_POLL + poll->local;
+	if (mb_poll_bits(poll))
+	{
+		uint16_t bytes = (poll->count + 7) / 8;
+		for (uint16_t i = 0; i < bytes; i += 2)
+		{
+			mb_set_input_register(addr + i / 2, data[i] | (i + 1 < bytes ? data[i + 1] << 8 : 0));
+		}
+		return;
+	}
+	for (uint16_t i = 0; i < poll->count; i++)
+	{
+		mb_set_input_register(addr + i, (data[2 * i] << 8) | data[2 * i + 1]);
+	}
+}
+
+void mb_master_reply(const uint8_t *frame, uint16_t count, bool ok)
+{
+	if (!s_waiting)
+	{
+		s_unexpected++; // a reply after its timeout, or another master on the bus
+		return;
+	}
+	s_waiting = false;
+	
+	const mb_poll_t *poll = &s_polls[s_current];
+	bool valid = ok && count >= 5 && frame[0] == poll->slave
+		&& CRC16((uint8_t *)frame, count - 2) == (frame[count - 2] | (frame[count - 1] << 8));
+	if (valid && frame[1] == (poll->function | MB_FUNC_EXCEPTION_MODIFIER) && count == 5)
+	{
+		mb_master_complete(frame[2]);
+	}
+	else if (valid && frame[1] == poll->function && count == mb_poll_reply_size(poll) && frame[2] == count - 5)
+	{
+		mb_master_store(poll, frame + 3);
+		mb_master_complete(MB_POLL_STATUS_OK);
+	}
+	else
+	{
+		mb_master_retry(); // garbled replies are treated as none
+	}
+	
+	mb_master_send(time_us_64()); // T3.5 has passed since the reply, the bus is ours
+}
+
+void mb_master_task()
+{
+	uint64_t now = time_us_64();
+	if (s_waiting)
+	{
+		if (now < s_deadline_us)
+		{
+			sched_post_at(SCHED_TASK_MASTER, s_deadline_us);
+			return;
+		}
+		if (!mb_bus_idle_us())
+		{
+			sched_post_at(SCHED_TASK_MASTER, now + mb_t35_us()); // a late reply is still coming in
+			return;
+		}
+		s_waiting = false;
+		mb_master_retry();
+	}
+	mb_master_send(now);
+}
+
+uint16_t mb_master_status_read(uint16_t addr)
+{
+	return s_poll_state[addr - MB_IR_POLL_STATUS].status;
+}
+
+void mb_master_reset_stats()
+{
+	for (uint8_t i = 0; i < MB_POLL_COUNT; i++)
+	{
+		s_poll_state[i].replies = 0;
+		s_poll_state[i].exceptions = 0;
+		s_poll_state[i].failures = 0;
+		s_poll_state[i].retries = 0;
+		s_poll_state[i].max_us = 0;
+	}
+	s_completed = 0;
+	s_unexpected = 0;
+	s_stats_since_us = time_us_64();
+}
+
+void mb_master_print_stats()
+{
+	printf("** MODBUS MASTER **\r\n");
+	printf("POLL\tSLAVE\tFC\tFIRST\tCOUNT\tPERIOD\tSTATUS\tREPLIES\tEXCEPT\tFAILED\tRETRIES\tMAX us\r\n");
+	
+	// Wire time of one pass through the table: request, T3.5, reply, T3.5
+	uint64_t pass_us = 0;
+	uint32_t demand_milli = 0; // polls/s the periods ask for, in thousandths
+	bool unlimited = false;
+	for (uint8_t i = 0; i < MB_POLL_COUNT; i++)
+	{
+		const mb_poll_t *poll = &s_polls[i];
+		const mb_poll_state_t *state = &s_poll_state[i];
+		printf("%u\t%u\t%02X\t%u\t%u\t%u ms\t%03X\t%lu\t%lu\t%lu\t%lu\t%lu\r\n", i, poll->slave, poll->function,
+			poll->first, poll->count, poll->period_ms, state->status, state->replies, state->exceptions,
+			state->failures, state->retries, state->max_us);
+		
+		pass_us += (MB_MASTER_REQUEST_SIZE + mb_poll_reply_size(poll)) * mb_char_time_us() + 2 * mb_t35_us();
+		if (poll->period_ms)
+		{
+			demand_milli += 1000000 / poll->period_ms;
+		}
+		else
+		{
+			unlimited = true;
+		}
+	}
+	
+	uint64_t elapsed_us = time_us_64() - s_stats_since_us;
+	uint32_t achieved_tenths = elapsed_us ? (uint32_t)(s_completed * 10000000ull / elapsed_us) : 0;
+	uint32_t capacity_tenths = pass_us ? (uint32_t)(MB_POLL_COUNT * 10000000ull / pass_us) : 0;
+	uint32_t share_tenths = capacity_tenths ? achieved_tenths * 1000 / capacity_tenths : 0;
+	printf("UNEXPECTED\t= %lu\r\n", s_unexpected);
+	printf("POLLS/S\t\t= %lu.%lu (over %llu s)\r\n", achieved_tenths / 10, achieved_tenths % 10, elapsed_us / 1000000);
+	printf("TABLE ASKS\t= %lu.%03lu%s\r\n", demand_milli / 1000, demand_milli % 1000, unlimited ? " + as fast as possible" : "");
+	printf("BUS CAPACITY\t= %lu.%lu (back to back, wire time and T3.5 gaps only)\r\n", capacity_tenths / 10, capacity_tenths % 10);
+	printf("OF CAPACITY\t= %lu.%lu %%\r\n", share_tenths / 10, share_tenths % 10);
+}
+
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Poll status registers from MB_IR_POLL_STATUS, one per MB_POLLS entry.
+// 0x01-0xFF is the exception code the slave answered with; its registers
+// keep the values from the last good reply.
+#define MB_POLL_STATUS_OK 0 // last poll answered, its registers are current
+#define MB_POLL_STATUS_NO_REPLY 0x100 // no valid reply after MB_MASTER_RETRIES
+#define MB_POLL_STATUS_NEVER 0x200 // not answered since power up
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	
+	// Builds the requests and starts polling, after the scheduler task is added
+	void mb_master_init();
+	
+	void mb_master_task();
+	
+	// A frame heard on the bus, from mb_process() once it is complete
+	void mb_master_reply(const uint8_t *frame, uint16_t count, bool ok);
+	
+	uint16_t mb_master_status_read(uint16_t addr);
+	
+	void mb_master_print_stats();
+	
+	void mb_master_reset_stats();
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,244 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include "mb_usb.h"
+#include "mb.h"
+#include "usb_cdc.h"
+#include "scheduler.h"
+#include "tusb.h"
+#include "pico/stdlib.h"
+
+// RTU frames over USB have no silent interval to end them. The length of a
+// request follows from its function code and, for the variable ones, its byte
+// count, so frames sharing a USB packet or split across several come apart
+// the same way; the CRC is only checked once the frame is complete. A function
+// code without a known layout ends the frame where the host's write ends, when
+// nothing more is waiting in the CDC FIFO.
+//
+// The port also takes Modbus TCP framing (MBAP header, no CRC) so a TCP
+// gateway on the host can pass its traffic straight through. The host picks
+// it by opening the port at MB_USB_MBAP_BAUD, like the 1200 baud reset touch;
+// guessing from the first frame cannot tell an RTU write to register 0 from
+// an MBAP header.
+
+static uint8_t s_staging[CFG_TUD_CDC_EP_BUFSIZE]; // read from the CDC FIFO, not yet framed
+static uint16_t s_staging_head = 0;
+static uint16_t s_staging_count = 0;
+
+static bool s_mbap = false;
+static uint8_t s_frame[MB_MBAP_MAX_SIZE];
+static uint16_t s_frame_count = 0;
+static bool s_frame_ready = false;
+static uint64_t s_last_rx_us = 0;
+static uint8_t s_reply[MB_MBAP_MAX_SIZE];
+
+static uint32_t s_frames = 0;
+static uint32_t s_mbap_frames = 0;
+static uint32_t s_replies = 0;
+static uint32_t s_dropped = 0;
+static uint32_t s_retries = 0;
+
+static void mb_usb_frame_reset()
+{
+	s_frame_count = 0;
+	s_frame_ready = false;
+}
+
+void mb_usb_set_mbap(bool mbap)
+{
+	if (mbap != s_mbap)
+	{
+		s_mbap = mbap;
+		s_staging_count = 0;
+		mb_usb_frame_reset();
+	}
+}
+
+// Length of the MBAP frame started in s_frame once its header is in, 0 if the header is not one
+static uint16_t mb_usb_mbap_size()
+{
+	uint16_t length = (s_frame[4] << 8) | s_frame[5]; // unit id and PDU
+	if (s_frame[2] || s_frame[3] || length < 2 || length > MB_MBAP_MAX_SIZE - 6)
+	{
+		return 0;
+	}
+	return length + 6;
+}
+
+// Length of the RTU request started in s_frame, 0 while the bytes that give
+// it are still to come, MB_USB_RTU_SIZE_UNKNOWN for a function code without a
+// fixed layout
+static uint16_t mb_usb_rtu_size()
+{
+	if (s_frame_count < 3)
+	{
+		return 0; // function code and, for most variable ones, the byte count
+	}
+	switch (s_frame[1])
+	{
+	case MB_FUNC_READ_COILS:
+	case MB_FUNC_READ_DISCRETE_INPUTS:
+	case MB_FUNC_READ_HOLDING_REGISTERS:
+	case MB_FUNC_READ_INPUT_REGISTER:
+	case MB_FUNC_WRITE_SINGLE_COIL:
+	case MB_FUNC_WRITE_SINGLE_REGISTER:
+	case MB_FUNC_DIAGNOSTICS:
+		return 8;
+	case MB_FUNC_READ_EXCEPTION_STATUS:
+	case MB_FUNC_GET_COM_EVENT_COUNTER:
+	case MB_FUNC_GET_COM_EVENT_LOG:
+	case MB_FUNC_REPORT_SERVER_ID:
+		return 4;
+	case MB_FUNC_READ_FIFO_QUEUE:
+		return 6;
+	case MB_FUNC_MASK_WRITE_REGISTER:
+		return 10;
+	case MB_FUNC_READ_DEVICE_ID:
+		return s_frame[2] == MB_MEI_READ_DEVICE_ID ? 7 : MB_USB_RTU_SIZE_UNKNOWN;
+	case MB_FUNC_WRITE_MULTIPLE_COILS:
+	case MB_FUNC_WRITE_MULTIPLE_REGISTERS:
+		return s_frame_count < 7 ? 0 : 9 + s_frame[6];
+	case MB_FUNC_READ_WRITE_MULTIPLE_REGISTERS:
+		return s_frame_count < 11 ? 0 : 13 + s_frame[10];
+	case MB_FUNC_READ_FILE_RECORD:
+	case MB_FUNC_WRITE_FILE_RECORD:
+		return 5 + s_frame[2];
+	case MB_FUNC_SCATTER_READ:
+		return 5 + 5 * s_frame[2];
+	default:
+		return MB_USB_RTU_SIZE_UNKNOWN;
+	}
+}
+
+static bool mb_usb_frame_complete()
+{
+	if (s_mbap)
+	{
+		if (s_frame_count < MB_MBAP_HEADER_SIZE)
+		{
+			return false;
+		}
+		uint16_t size = mb_usb_mbap_size();
+		if (!size)
+		{
+			s_dropped++; // lost our place in the stream, the host's timeout clears it
+			mb_usb_frame_reset();
+		}
+		return size && s_frame_count == size;
+	}
+	
+	uint16_t size = mb_usb_rtu_size();
+	if (size == MB_USB_RTU_SIZE_UNKNOWN)
+	{
+		return false; // ended by mb_usb_assemble() when the FIFO runs dry
+	}
+	if (size > MB_BUFFER_SIZE)
+	{
+		s_dropped++; // a byte count no request can have, lost our place in the stream
+		mb_usb_frame_reset();
+		return false;
+	}
+	return size && s_frame_count == size;
+}
+
+static void mb_usb_assemble()
+{
+	if (s_frame_count && !s_staging_count && time_us_64() - s_last_rx_us > MB_USB_STALE_US)
+	{
+		s_dropped++; // host gave up halfway, start clean
+		mb_usb_frame_reset();
+	}
+	
+	while (!s_frame_ready)
+	{
+		if (!s_staging_count)
+		{
+			s_staging_count = tud_cdc_n_read(USB_CDC_MODBUS, s_staging, sizeof(s_staging));
+			s_staging_head = 0;
+			if (!s_staging_count)
+			{
+				s_frame_ready = !s_mbap && s_frame_count && mb_usb_rtu_size() == MB_USB_RTU_SIZE_UNKNOWN;
+				return;
+			}
+			s_last_rx_us = time_us_64();
+		}
+		
+		if (s_frame_count == (s_mbap ? MB_MBAP_MAX_SIZE : MB_BUFFER_SIZE))
+		{
+			s_dropped++; // never found the end, resynchronise
+			mb_usb_frame_reset();
+		}
+		
+		s_frame[s_frame_count++] = s_staging[s_staging_head++];
+		s_staging_count--;
+		s_frame_ready = mb_usb_frame_complete();
+	}
+}
+
+void mb_usb_task()
+{
+	mb_usb_assemble();
+	if (!s_frame_ready)
+	{
+		if (s_frame_count)
+		{
+			sched_post_at(SCHED_TASK_USB, s_last_rx_us + MB_USB_STALE_US);
+		}
+		return;
+	}
+	
+	// Replies are never split, so wait for room for the largest one
+	int16_t reply_count = -1;
+	if (tud_cdc_n_write_available(USB_CDC_MODBUS) >= MB_MBAP_MAX_SIZE)
+	{
+		if (s_mbap)
+		{
+			reply_count = mb_process_pdu(s_frame[6], s_frame + MB_MBAP_HEADER_SIZE, s_frame_count - MB_MBAP_HEADER_SIZE, s_reply + MB_MBAP_HEADER_SIZE);
+			if (reply_count > 0)
+			{
+				// Same transaction id, protocol and unit, the length covers the unit id and PDU
+				memcpy(s_reply, s_frame, MB_MBAP_HEADER_SIZE);
+				s_reply[4] = (reply_count + 1) >> 8;
+				s_reply[5] = (reply_count + 1) & 0xFF;
+				reply_count += MB_MBAP_HEADER_SIZE;
+			}
+		}
+		else
+		{
+			reply_count = mb_process_frame(s_frame, s_frame_count, s_reply);
+		}
+	}
+	if (reply_count < 0)
+	{
+		s_retries++;
+		sched_post_at(SCHED_TASK_USB, time_us_64() + MB_USB_RETRY_US);
+		return;
+	}
+	
+	s_frames++;
+	s_mbap_frames += s_mbap;
+	if (reply_count)
+	{
+		tud_cdc_n_write(USB_CDC_MODBUS, s_reply, reply_count);
+		tud_cdc_n_write_flush(USB_CDC_MODBUS);
+		s_replies++;
+	}
+	mb_usb_frame_reset();
+	
+	if (s_staging_count || tud_cdc_n_available(USB_CDC_MODBUS))
+	{
+		sched_post(SCHED_TASK_USB); // next frame already here
+	}
+}
+
+void mb_usb_print_stats()
+{
+	printf("** MODBUS USB STATISTICS **\r\n");
+	printf("FRAMES\t\t= %lu\r\n", s_frames);
+	printf("MBAP FRAMES\t= %lu\r\n", s_mbap_frames);
+	printf("REPLIES\t\t= %lu\r\n", s_replies);
+	printf("DROPPED\t\t= %lu\r\n", s_dropped);
+	printf("RETRIES\t\t= %lu\r\n", s_retries);
+	printf("STDOUT DROPPED\t= %lu\r\n", usb_stdout_dropped());
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MB_USB_STALE_US 100000 // a partial frame that stops growing for this long is dropped
+#define MB_USB_MBAP_BAUD 502 // opening the port at this rate selects Modbus TCP framing
+#define MB_MBAP_HEADER_SIZE 7 // transaction id, protocol id, length, unit id
+#define MB_MBAP_MAX_SIZE 260 // header and the largest PDU
+#define MB_USB_RTU_SIZE_UNKNOWN 0xFFFF // function code whose request length the framer cannot tell
+#define MB_USB_RETRY_US 200 // RS485 port or reply FIFO busy, look at the pending frame again after this
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	
+	// Moves frames from the Modbus CDC interface into the data model and
+	// queues the replies, called from usb_task()
+	void mb_usb_task();
+	
+	// Switches between RTU and MBAP framing, dropping any partial frame
+	void mb_usb_set_mbap(bool mbap);
+	
+	void mb_usb_print_stats();
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,430 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "nvconfig.h"
+#include "mb.h"
+#include "crc.h"
+#include "bsp_functions.h"
+#include "scheduler.h"
+#include "flash_io.h"
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/uart.h"
+
+#define NVCONFIG_MAGIC 0x4E564346 // "NVCF"
+#define NVCONFIG_PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define NVCONFIG_PAGES (NVCONFIG_SECTORS * NVCONFIG_PAGES_PER_SECTOR)
+#define NVCONFIG_NO_SEQUENCE UINT32_MAX // so the first record written is 0
+#define NVCONFIG_NO_SECTOR -1
+
+#if NVCONFIG_SECTORS < 2
+#error "The log needs a sector to erase ahead while another holds the newest record"
+#endif
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t sequence;
+	uint16_t size; // sizeof(nvconfig_t) when written, later fields keep their defaults
+	uint16_t crc; // over the first size bytes of config
+	nvconfig_t config;
+} nvconfig_record_t;
+
+static const nvconfig_t s_defaults =
+{
+	.address = 0,
+	.parity = RS485_PARITY,
+	.baud = RS485_BAUD,
+	.response_delay_us = MB_RESPONSE_DELAY_US,
+	.input_sample_us = INPUT_SAMPLE_INTERVAL_US,
+	.pulse_time_ms = PULSE_TIME_MS,
+	.framing = MB_FRAMING_RTU
+};
+
+static nvconfig_t s_config;
+static uint32_t s_sequence = NVCONFIG_NO_SEQUENCE; // last page the log used, torn ones included
+static uint32_t s_loaded_sequence = NVCONFIG_NO_SEQUENCE;
+static bool s_save_pending = false;
+static uint64_t s_save_requested_us = 0;
+static int8_t s_erase_ahead = NVCONFIG_NO_SECTOR; // sector the next boundary crossing will write into
+static uint32_t s_saves = 0;
+static uint32_t s_erases = 0;
+static uint32_t s_inline_erases = 0; // erase ahead never found a quiet bus
+static uint32_t s_stall_max_us = 0;
+
+// Programmed from RAM, flash cannot be read while it is being written
+static union
+{
+	nvconfig_record_t record;
+	uint8_t bytes[FLASH_PAGE_SIZE];
+} s_page;
+
+static const nvconfig_record_t *nvconfig_page(uint32_t page)
+{
+	return (const nvconfig_record_t *)(XIP_BASE + NVCONFIG_FLASH_OFFSET + page * FLASH_PAGE_SIZE);
+}
+
+static bool nvconfig_record_valid(const nvconfig_record_t *record)
+{
+	return record->magic == NVCONFIG_MAGIC && record->size <= sizeof(nvconfig_t)
+		&& record->crc == CRC16((uint8_t *)&record->config, record->size);
+}
+
+static bool nvconfig_config_valid(const nvconfig_t *config)
+{
+	return config->address <= 247 && config->parity <= UART_PARITY_ODD
+		&& config->baud >= 1200 && config->baud <= 1000000
+		&& config->response_delay_us <= 1000000
+		&& config->input_sample_us >= 100 && config->input_sample_us <= 100000
+		&& config->pulse_time_ms > 0
+		&& config->framing <= MB_FRAMING_ASCII;
+}
+
+// A record only counts where its sequence puts it
+static bool nvconfig_page_valid(uint32_t page)
+{
+	const nvconfig_record_t *record = nvconfig_page(page);
+	return nvconfig_record_valid(record) && record->sequence % NVCONFIG_PAGES == page;
+}
+
+static bool nvconfig_blank(uint32_t first_page, uint32_t pages)
+{
+	const uint32_t *word = (const uint32_t *)nvconfig_page(first_page);
+	for (uint32_t i = 0; i < pages * FLASH_PAGE_SIZE / sizeof(uint32_t); i++)
+	{
+		if (word[i] != 0xFFFFFFFF)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool nvconfig_sector_blank(uint8_t sector)
+{
+	return nvconfig_blank(sector * NVCONFIG_PAGES_PER_SECTOR, NVCONFIG_PAGES_PER_SECTOR);
+}
+
+static void nvconfig_stall_end(uint64_t start_us)
+{
+	uint32_t stall_us = (uint32_t)(time_us_64() - start_us);
+	if (stall_us > s_stall_max_us)
+	{
+		s_stall_max_us = stall_us;
+	}
+}
+
+static void nvconfig_erase(uint8_t sector)
+{
+	uint64_t start_us = time_us_64();
+	flash_io_erase(NVCONFIG_FLASH_OFFSET + sector * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+	nvconfig_stall_end(start_us);
+	s_erases++;
+}
+
+// Sector the log enters at its next sector boundary
+static uint8_t nvconfig_next_sector()
+{
+	uint32_t next_page = (s_sequence + 1) % NVCONFIG_PAGES;
+	uint8_t sector = next_page / NVCONFIG_PAGES_PER_SECTOR;
+	return next_page % NVCONFIG_PAGES_PER_SECTOR ? (sector + 1) % NVCONFIG_SECTORS : sector;
+}
+
+// Returns the sequence of the newest record that checks out. Only those are
+// trusted: a page torn by a power cut can hold any sequence. Pages after the
+// newest that are not blank were torn, the log carries on past them (up to
+// the sector boundary, where the next write erases anyway) so it never
+// programs over one.
+static uint32_t nvconfig_find_newest()
+{
+	uint32_t newest = NVCONFIG_NO_SEQUENCE;
+	for (uint32_t page = 0; page < NVCONFIG_PAGES; page++)
+	{
+		// NVCONFIG_PAGES headers and CRCs, a few microseconds at boot
+		if (nvconfig_page_valid(page) && (newest == NVCONFIG_NO_SEQUENCE || nvconfig_page(page)->sequence > newest))
+		{
+			newest = nvconfig_page(page)->sequence;
+		}
+	}
+
+	s_sequence = newest;
+	while (s_sequence != NVCONFIG_NO_SEQUENCE && (s_sequence + 1) % NVCONFIG_PAGES_PER_SECTOR
+		&& !nvconfig_blank((s_sequence + 1) % NVCONFIG_PAGES, 1))
+	{
+		s_sequence++;
+	}
+	return newest;
+}
+
+void nvconfig_init()
+{
+	s_config = s_defaults;
+
+	// A write cut short by power loss falls back to the record before it
+	uint32_t sequence = nvconfig_find_newest();
+	if (sequence != NVCONFIG_NO_SEQUENCE)
+	{
+		const nvconfig_record_t *record = nvconfig_page(sequence % NVCONFIG_PAGES);
+		nvconfig_t config = s_defaults;
+		memcpy(&config, &record->config, record->size);
+		if (nvconfig_config_valid(&config))
+		{
+			s_config = config;
+			s_loaded_sequence = sequence;
+		}
+	}
+
+	if (!nvconfig_sector_blank(nvconfig_next_sector()))
+	{
+		s_erase_ahead = nvconfig_next_sector();
+		sched_post(SCHED_TASK_NVCONFIG);
+	}
+}
+
+const nvconfig_t *nvconfig_get()
+{
+	return &s_config;
+}
+
+void nvconfig_apply()
+{
+	mb_set_id(s_config.address ? s_config.address : get_address_byte());
+	mb_set_response_delay(s_config.response_delay_us);
+	set_input_sample_interval_us(s_config.input_sample_us);
+	set_pulse_time_ms(s_config.pulse_time_ms);
+}
+
+bool nvconfig_set(const char *key, uint32_t value)
+{
+	nvconfig_t config = s_config;
+	if (!strcmp(key, "address") && value <= UINT8_MAX) { config.address = value; }
+	else if (!strcmp(key, "baud")) { config.baud = value; }
+	else if (!strcmp(key, "parity") && value <= UINT8_MAX) { config.parity = value; }
+	else if (!strcmp(key, "delay")) { config.response_delay_us = value; }
+	else if (!strcmp(key, "sample")) { config.input_sample_us = value; }
+	else if (!strcmp(key, "pulse") && value <= UINT16_MAX) { config.pulse_time_ms = value; }
+	else if (!strcmp(key, "framing") && value <= UINT8_MAX) { config.framing = value; }
+	else { return false; }
+
+	if (!nvconfig_config_valid(&config))
+	{
+		return false;
+	}
+	s_config = config;
+	nvconfig_apply();
+	return true;
+}
+
+void nvconfig_defaults()
+{
+	s_config = s_defaults;
+	nvconfig_apply();
+}
+
+bool nvconfig_save()
+{
+	// A record that fails the check at boot would take every other setting with it
+	if (!nvconfig_config_valid(&s_config))
+	{
+		return false;
+	}
+	if (!s_save_pending)
+	{
+		s_save_pending = true;
+		s_save_requested_us = time_us_64();
+	}
+	sched_post(SCHED_TASK_NVCONFIG);
+	return true;
+}
+
+static void nvconfig_write()
+{
+	uint32_t sequence = s_sequence + 1;
+	uint32_t page = sequence % NVCONFIG_PAGES;
+	uint8_t sector = page / NVCONFIG_PAGES_PER_SECTOR;
+	if (page % NVCONFIG_PAGES_PER_SECTOR == 0)
+	{
+		if (!nvconfig_sector_blank(sector))
+		{
+			nvconfig_erase(sector); // erase ahead never got a quiet bus
+			s_inline_erases++;
+		}
+		s_erase_ahead = (sector + 1) % NVCONFIG_SECTORS;
+	}
+
+	memset(s_page.bytes, 0xFF, sizeof(s_page.bytes));
+	s_page.record.magic = NVCONFIG_MAGIC;
+	s_page.record.sequence = sequence;
+	s_page.record.size = sizeof(nvconfig_t);
+	s_page.record.config = s_config;
+	s_page.record.crc = CRC16((uint8_t *)&s_page.record.config, sizeof(nvconfig_t));
+
+	uint64_t start_us = time_us_64();
+	flash_io_program(NVCONFIG_FLASH_OFFSET + page * FLASH_PAGE_SIZE, s_page.bytes, FLASH_PAGE_SIZE);
+	nvconfig_stall_end(start_us);
+
+	s_sequence = sequence;
+	if (nvconfig_record_valid(nvconfig_page(page)))
+	{
+		s_loaded_sequence = sequence;
+		s_saves++;
+	}
+}
+
+void nvconfig_task()
+{
+	uint64_t now = time_us_64();
+
+	if (s_save_pending)
+	{
+		if (!flash_io_ready(NVCONFIG_IDLE_US, s_save_requested_us + NVCONFIG_SAVE_TIMEOUT_US))
+		{
+			sched_post_at(SCHED_TASK_NVCONFIG, now + NVCONFIG_RETRY_US);
+			return;
+		}
+		nvconfig_write();
+		s_save_pending = false;
+	}
+
+	if (s_erase_ahead != NVCONFIG_NO_SECTOR)
+	{
+		if (!flash_io_ready(NVCONFIG_ERASE_IDLE_US, 0))
+		{
+			// Saves still work without it, they just erase inline
+			sched_post_at(SCHED_TASK_NVCONFIG, now + NVCONFIG_ERASE_IDLE_US - mb_bus_idle_us());
+			return;
+		}
+		if (!nvconfig_sector_blank(s_erase_ahead))
+		{
+			nvconfig_erase(s_erase_ahead);
+		}
+		s_erase_ahead = NVCONFIG_NO_SECTOR;
+	}
+}
+
+void nvconfig_print()
+{
+	static const char *parity_names[] = { "NONE", "EVEN", "ODD" };
+
+	printf("** CONFIGURATION **\r\n");
+	if (s_loaded_sequence == NVCONFIG_NO_SEQUENCE)
+	{
+		printf("SOURCE\t\t= DEFAULTS\r\n");
+	}
+	else
+	{
+		printf("SOURCE\t\t= RECORD %lu\r\n", s_loaded_sequence);
+	}
+	printf("ADDRESS\t\t= %u%s\r\n", s_config.address, s_config.address ? "" : " (DIP SWITCHES)");
+	printf("BAUD\t\t= %lu (at restart)\r\n", s_config.baud);
+	printf("PARITY\t\t= %s (at restart)\r\n", parity_names[s_config.parity]);
+	printf("FRAMING\t\t= %s (at restart)\r\n", s_config.framing == MB_FRAMING_ASCII ? "ASCII" : "RTU");
+	printf("RESPONSE DELAY\t= %lu us\r\n", s_config.response_delay_us);
+	printf("INPUT SAMPLE\t= %lu us\r\n", s_config.input_sample_us);
+	printf("PULSE TIME\t= %u ms\r\n", s_config.pulse_time_ms);
+	printf("SAVE PENDING\t= %s\r\n", s_save_pending ? "YES" : "NO");
+	printf("SAVES\t\t= %lu\r\n", s_saves);
+	printf("ERASES\t\t= %lu (%lu inline)\r\n", s_erases, s_inline_erases);
+	printf("MAX STALL\t= %lu us\r\n", s_stall_max_us);
+}
+
+uint16_t nvconfig_hr_read(uint16_t addr)
+{
+	switch (addr - MB_HR_CONFIG)
+	{
+	case NVCONFIG_HR_ADDRESS:
+		return s_config.address;
+	case NVCONFIG_HR_BAUD_HIGH:
+		return s_config.baud >> 16;
+	case NVCONFIG_HR_BAUD_LOW:
+		return s_config.baud & 0xFFFF;
+	case NVCONFIG_HR_PARITY:
+		return s_config.parity;
+	case NVCONFIG_HR_RESPONSE_DELAY:
+		return s_config.response_delay_us > UINT16_MAX ? UINT16_MAX : s_config.response_delay_us;
+	case NVCONFIG_HR_INPUT_SAMPLE:
+		return s_config.input_sample_us;
+	case NVCONFIG_HR_PULSE_TIME:
+		return s_config.pulse_time_ms;
+	case NVCONFIG_HR_COMMAND:
+		return s_save_pending;
+	case NVCONFIG_HR_FRAMING:
+		return s_config.framing;
+	default:
+		return 0;
+	}
+}
+
+uint8_t nvconfig_hr_write(uint16_t addr, uint16_t value)
+{
+	nvconfig_t config = s_config;
+	switch (addr - MB_HR_CONFIG)
+	{
+	case NVCONFIG_HR_ADDRESS:
+		if (value > UINT8_MAX)
+		{
+			return MB_EXCEPTION_ILLEGAL_DATA; // would wrap to a valid address, 0x0100 to the DIP switches
+		}
+		config.address = value;
+		break;
+	case NVCONFIG_HR_BAUD_HIGH:
+		// The halves arrive one at a time, baud is checked when the settings are saved
+		s_config.baud = (s_config.baud & 0xFFFF) | ((uint32_t)value << 16);
+		return 0;
+	case NVCONFIG_HR_BAUD_LOW:
+		s_config.baud = (s_config.baud & 0xFFFF0000) | value;
+		return 0;
+	case NVCONFIG_HR_PARITY:
+		if (value > UINT8_MAX)
+		{
+			return MB_EXCEPTION_ILLEGAL_DATA;
+		}
+		config.parity = value;
+		break;
+	case NVCONFIG_HR_RESPONSE_DELAY:
+		config.response_delay_us = value;
+		break;
+	case NVCONFIG_HR_INPUT_SAMPLE:
+		config.input_sample_us = value;
+		break;
+	case NVCONFIG_HR_PULSE_TIME:
+		config.pulse_time_ms = value;
+		break;
+	case NVCONFIG_HR_COMMAND:
+		if (value == NVCONFIG_CMD_SAVE)
+		{
+			if (!nvconfig_save())
+			{
+				return MB_EXCEPTION_ILLEGAL_DATA;
+			}
+			return MB_EXCEPTION_ACK; // accepted, completion via the command register
+		}
+		if (value == NVCONFIG_CMD_DEFAULTS)
+		{
+			nvconfig_defaults();
+			return 0;
+		}
+		return MB_EXCEPTION_ILLEGAL_DATA;
+	case NVCONFIG_HR_FRAMING:
+		if (value > MB_FRAMING_ASCII)
+		{
+			return MB_EXCEPTION_ILLEGAL_DATA; // before it is narrowed to the byte it is kept in
+		}
+		config.framing = value;
+		break;
+	default:
+		return MB_EXCEPTION_ILLEGAL_ADDRESS;
+	}
+
+	// Other settings are checked as a whole, a baud half-written is not held against them
+	config.baud = s_defaults.baud;
+	if (!nvconfig_config_valid(&config))
+	{
+		return MB_EXCEPTION_ILLEGAL_DATA;
+	}
+	config.baud = s_config.baud;
+	s_config = config;
+	nvconfig_apply();
+	return 0;
+}
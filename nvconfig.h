@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+// Flash layout: the last NVCONFIG_SECTORS sectors of flash hold an append-only
+// log of configuration records, one page each. Record n lives in page
+// n % (NVCONFIG_SECTORS * pages per sector), so writes wear the sectors evenly
+// and the newest record is found from the sector heads plus a binary search.
+#define NVCONFIG_SECTORS 4
+#define NVCONFIG_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - NVCONFIG_SECTORS * FLASH_SECTOR_SIZE)
+
+// Replies wait while flash is busy (only the receive path runs, see flash_io.h), so writes wait for a quiet bus
+#define NVCONFIG_IDLE_US 5000 // quiet time before programming a page (about 1 ms)
+#define NVCONFIG_ERASE_IDLE_US 200000 // quiet time before erasing the next sector ahead (about 50 ms)
+#define NVCONFIG_SAVE_TIMEOUT_US 2000000 // after this long a save goes ahead at the next gap between frames
+#define NVCONFIG_RETRY_US 1000
+
+#define NVCONFIG_CMD_SAVE 1
+#define NVCONFIG_CMD_DEFAULTS 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef struct
+	{
+		uint8_t address; // 0 = DIP switches
+		uint8_t parity; // uart_parity_t, applied at restart
+		uint32_t baud; // applied at restart
+		uint32_t response_delay_us;
+		uint32_t input_sample_us; // debounce is 8 samples
+		uint16_t pulse_time_ms;
+		uint8_t framing; // MB_FRAMING_RTU or MB_FRAMING_ASCII, applied at restart
+	} nvconfig_t;
+
+	// Holding registers from MB_HR_CONFIG
+	enum NVCONFIG_REGISTERS
+	{
+		NVCONFIG_HR_ADDRESS,
+		NVCONFIG_HR_BAUD_HIGH,
+		NVCONFIG_HR_BAUD_LOW,
+		NVCONFIG_HR_PARITY,
+		NVCONFIG_HR_RESPONSE_DELAY,
+		NVCONFIG_HR_INPUT_SAMPLE,
+		NVCONFIG_HR_PULSE_TIME,
+		NVCONFIG_HR_COMMAND, // write NVCONFIG_CMD_*, reads 1 while a save is waiting
+		NVCONFIG_HR_FRAMING,
+		NVCONFIG_HR_COUNT
+	};
+
+	// Loads the newest valid record, or the defaults, before anything uses the settings
+	void nvconfig_init();
+
+	const nvconfig_t *nvconfig_get();
+
+	// Pushes the settings that take effect immediately to their modules
+	void nvconfig_apply();
+
+	bool nvconfig_set(const char *key, uint32_t value);
+
+	void nvconfig_defaults();
+
+	// Queues a write, performed by nvconfig_task() once the bus is quiet.
+	// False if the settings would not pass the check at boot (a baud rate
+	// written over Modbus is only checked here).
+	bool nvconfig_save();
+
+	void nvconfig_task();
+
+	void nvconfig_print();
+
+	uint16_t nvconfig_hr_read(uint16_t addr);
+
+	uint8_t nvconfig_hr_write(uint16_t addr, uint16_t value);
+
+#ifdef __cplusplus
+}
+#endif
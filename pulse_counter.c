@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "pulse_counter.h"
+#include "bsp_functions.h"
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/clocks.h"
+#include "mb.h"
+#include "pulse_counter.pio.h"
+
+#define PULSE_PIO pio0
+
+static const uint s_pulse_pins[NUM_INPUTS] = { INPUT_1_PIN, INPUT_2_PIN };
+
+static uint s_count_sm[NUM_INPUTS];
+static uint s_period_sm[NUM_INPUTS];
+
+static uint32_t s_count[NUM_INPUTS] = { 0 };
+static uint32_t s_frequency_mhz[NUM_INPUTS] = { 0 };
+static uint64_t s_last_period_us[NUM_INPUTS] = { 0 };
+
+void pulse_counter_init()
+{
+	uint count_offset = pio_add_program(PULSE_PIO, &pulse_count_program);
+	uint period_offset = pio_add_program(PULSE_PIO, &pulse_period_program);
+	
+	for (uint8_t i = 0; i < NUM_INPUTS; i++)
+	{
+		s_count_sm[i] = pio_claim_unused_sm(PULSE_PIO, true);
+		pulse_count_program_init(PULSE_PIO, s_count_sm[i], count_offset, s_pulse_pins[i]);
+		
+		s_period_sm[i] = pio_claim_unused_sm(PULSE_PIO, true);
+		pulse_period_program_init(PULSE_PIO, s_period_sm[i], period_offset, s_pulse_pins[i]);
+	}
+}
+
+static uint32_t pulse_read_count(uint8_t channel)
+{
+	// The count SM pushes continuously, so draining the stale entries and
+	// waiting for one more always returns a value a few cycles old
+	uint level = pio_sm_get_rx_fifo_level(PULSE_PIO, s_count_sm[channel]) + 1;
+	uint32_t count = 0;
+	while (level--)
+	{
+		count = pio_sm_get_blocking(PULSE_PIO, s_count_sm[channel]);
+	}
+	return count;
+}
+
+static void pulse_read_frequency(uint8_t channel, uint64_t now)
+{
+	uint sm = s_period_sm[channel];
+	bool have_period = false;
+	uint32_t period = 0;
+	while (!pio_sm_is_rx_fifo_empty(PULSE_PIO, sm))
+	{
+		period = pio_sm_get(PULSE_PIO, sm);
+		have_period = true;
+	}
+	
+	if (have_period)
+	{
+		uint64_t cycles = 2 * (uint64_t)period + 4;
+		uint64_t frequency = (uint64_t)clock_get_hz(clk_sys) * 1000 / cycles;
+		s_frequency_mhz[channel] = frequency > UINT32_MAX ? UINT32_MAX : (uint32_t)frequency;
+		s_last_period_us[channel] = now;
+	}
+	else if (now - s_last_period_us[channel] > PULSE_FREQ_TIMEOUT_US)
+	{
+		s_frequency_mhz[channel] = 0;
+	}
+}
+
+static void pulse_publish(uint8_t channel)
+{
+	uint16_t count_reg = MB_IR_PULSE_COUNT + 2 * channel;
+	uint16_t freq_reg = MB_IR_PULSE_FREQ + 2 * channel;
+	mb_set_input_register(count_reg, s_count[channel] >> 16);
+	mb_set_input_register(count_reg + 1, s_count[channel] & 0xFFFF);
+	mb_set_input_register(freq_reg, s_frequency_mhz[channel] >> 16);
+	mb_set_input_register(freq_reg + 1, s_frequency_mhz[channel] & 0xFFFF);
+}
+
+void pulse_counter_update()
+{
+	uint16_t reset_mask = mb_get_holding_register(MB_HR_PULSE_RESET);
+	if (reset_mask)
+	{
+		for (uint8_t i = 0; i < NUM_INPUTS; i++)
+		{
+			if (reset_mask & (1 << i))
+			{
+				pulse_counter_reset(i);
+			}
+		}
+		mb_set_holding_register(MB_HR_PULSE_RESET, 0);
+	}
+	
+	uint64_t now = time_us_64();
+	for (uint8_t i = 0; i < NUM_INPUTS; i++)
+	{
+		s_count[i] = pulse_read_count(i);
+		pulse_read_frequency(i, now);
+		pulse_publish(i);
+	}
+}
+
+void pulse_counter_reset(uint8_t channel)
+{
+	if (channel >= NUM_INPUTS) { return; }
+	
+	pio_sm_exec(PULSE_PIO, s_count_sm[channel], pio_encode_mov_not(pio_x, pio_null));
+	s_count[channel] = pulse_read_count(channel);
+	pulse_publish(channel);
+}
+
+uint32_t pulse_counter_get_count(uint8_t channel)
+{
+	return channel < NUM_INPUTS ? s_count[channel] : 0;
+}
+
+uint32_t pulse_counter_get_frequency_mhz(uint8_t channel)
+{
+	return channel < NUM_INPUTS ? s_frequency_mhz[channel] : 0;
+}
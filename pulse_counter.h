@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PULSE_UPDATE_INTERVAL_US 100000 // scheduler period for publishing counts/frequencies to the data model
+#define PULSE_FREQ_TIMEOUT_US 5000000 // no edge for this long reports 0 Hz
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	void pulse_counter_init();
+	
+	void pulse_counter_update();
+	
+	void pulse_counter_reset(uint8_t channel);
+	
+	uint32_t pulse_counter_get_count(uint8_t channel);
+	
+	uint32_t pulse_counter_get_frequency_mhz(uint8_t channel);
+
+#ifdef __cplusplus
+}
+#endif
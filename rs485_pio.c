@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "rs485_pio.h"
+#include "mb.h"
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "rs485_pio.pio.h"
+
+#if RS485_RX_EN_PIN != RS485_TX_EN_PIN + 1
+#error "The PIO port drives DE and /RE as two consecutive SET pins"
+#endif
+
+#define RS485_PIO_RX_ERROR_WORD 0xFFFFFFFF
+#define RS485_PIO_FRAME_END_IRQ 0
+#define RS485_PIO_TX_DONE_IRQ 1
+#define RS485_PIO_LOOPS_PER_BIT 4 // 8 SM cycles per bit, 2 per idle loop
+
+static uint s_rx_sm;
+static uint s_tx_sm;
+static uart_parity_t s_parity;
+static uint32_t s_t15_loops;
+static uint32_t s_t35_loops;
+static int s_tx_dma;
+static uint16_t s_tx_words[MB_BUFFER_SIZE]; // 9-bit characters, DMA keeps the TX FIFO fed without gaps
+
+void rs485_pio_init(uint baud, uart_parity_t parity, irq_handler_t rx_handler)
+{
+	s_parity = parity;
+	
+	// Above 19200 baud the spec fixes T1.5/T3.5 at 750/1750 us
+	if (baud > 19200)
+	{
+		s_t15_loops = (uint32_t)(750ULL * baud * RS485_PIO_LOOPS_PER_BIT / 1000000);
+		s_t35_loops = (uint32_t)(1750ULL * baud * RS485_PIO_LOOPS_PER_BIT / 1000000);
+	}
+	else
+	{
+		s_t15_loops = 3 * RS485_SYM_SIZE * RS485_PIO_LOOPS_PER_BIT / 2;
+		s_t35_loops = 7 * RS485_SYM_SIZE * RS485_PIO_LOOPS_PER_BIT / 2;
+	}
+	
+	uint rx_offset = pio_add_program(RS485_PIO, &rs485_rx_program);
+	uint tx_offset = pio_add_program(RS485_PIO, &rs485_tx_program);
+	s_rx_sm = pio_claim_unused_sm(RS485_PIO, true);
+	s_tx_sm = pio_claim_unused_sm(RS485_PIO, true);
+	rs485_tx_program_init(RS485_PIO, s_tx_sm, tx_offset, RS485_TX_PIN, RS485_TX_EN_PIN, baud);
+	rs485_rx_program_init(RS485_PIO, s_rx_sm, rx_offset, RS485_RX_PIN, baud, s_t35_loops);
+	
+	// A late FIFO refill would make the SM release DE mid-frame, so TX is fed by DMA
+	s_tx_dma = dma_claim_unused_channel(true);
+	dma_channel_config c = dma_channel_get_default_config(s_tx_dma);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, pio_get_dreq(RS485_PIO, s_tx_sm, true));
+	dma_channel_configure(s_tx_dma, &c, &RS485_PIO->txf[s_tx_sm], s_tx_words, 0, false);
+	
+	pio_interrupt_clear(RS485_PIO, RS485_PIO_FRAME_END_IRQ);
+	pio_interrupt_clear(RS485_PIO, RS485_PIO_TX_DONE_IRQ);
+	pio_set_irq0_source_enabled(RS485_PIO, pis_sm0_rx_fifo_not_empty + s_rx_sm, true);
+	pio_set_irq0_source_enabled(RS485_PIO, pis_interrupt0 + RS485_PIO_FRAME_END_IRQ, true);
+	irq_set_exclusive_handler(RS485_IRQ, rx_handler);
+	irq_set_enabled(RS485_IRQ, true);
+}
+
+static bool rs485_pio_parity_ok(uint8_t data, bool bit9)
+{
+	if (s_parity == UART_PARITY_NONE)
+	{
+		return bit9; // second stop bit
+	}
+	
+	bool odd = __builtin_parity(data);
+	return s_parity == UART_PARITY_EVEN ? (odd == bit9) : (odd != bit9);
+}
+
+bool rs485_pio_getc(uint8_t *c, uint8_t *flags)
+{
+	if (pio_sm_is_rx_fifo_empty(RS485_PIO, s_rx_sm))
+	{
+		return false;
+	}
+	
+	rs485_pio_decode(pio_sm_get(RS485_PIO, s_rx_sm), c, flags);
+	return true;
+}
+
+void rs485_pio_decode(uint32_t word, uint8_t *c, uint8_t *flags)
+{
+	if (word == RS485_PIO_RX_ERROR_WORD)
+	{
+		*c = 0;
+		*flags = RS485_PIO_FRAMING_ERROR;
+		return;
+	}
+	
+	*c = word & 0xFF;
+	*flags = rs485_pio_parity_ok(*c, word & 0x100) ? 0 : RS485_PIO_PARITY_ERROR;
+	
+	uint32_t remaining = word >> 9;
+	if (remaining == 0)
+	{
+		*flags |= RS485_PIO_GAP_T35 | RS485_PIO_GAP_T15;
+	}
+	else if (s_t35_loops - remaining > s_t15_loops)
+	{
+		*flags |= RS485_PIO_GAP_T15;
+	}
+}
+
+// Runs while flash is busy, so it only touches registers and RAM. What
+// rs485_pio_frame_end() would have reported goes in as a word of its own.
+uint16_t __not_in_flash_func(rs485_pio_capture)(uint32_t *words, uint16_t count, uint16_t size)
+{
+	while (!(RS485_PIO->fstat & (1u << (PIO_FSTAT_RXEMPTY_LSB + s_rx_sm))))
+	{
+		uint32_t word = RS485_PIO->rxf[s_rx_sm];
+		if (count < size - 1) // the last word is kept for a frame end
+		{
+			words[count++] = word;
+		}
+		else if (count && words[count - 1] != RS485_PIO_FRAME_END_WORD)
+		{
+			words[count - 1] = RS485_PIO_RX_ERROR_WORD; // out of room, spoil the frame rather than shorten it
+		}
+	}
+	if (RS485_PIO->irq & (1u << RS485_PIO_FRAME_END_IRQ))
+	{
+		RS485_PIO->irq = 1u << RS485_PIO_FRAME_END_IRQ;
+		if (count < size)
+		{
+			words[count++] = RS485_PIO_FRAME_END_WORD;
+		}
+	}
+	return count;
+}
+
+bool rs485_pio_frame_end()
+{
+	if (!pio_interrupt_get(RS485_PIO, RS485_PIO_FRAME_END_IRQ))
+	{
+		return false;
+	}
+	pio_interrupt_clear(RS485_PIO, RS485_PIO_FRAME_END_IRQ);
+	return true;
+}
+
+void rs485_pio_write(const uint8_t *buf, uint16_t len)
+{
+	if (len > MB_BUFFER_SIZE) { len = MB_BUFFER_SIZE; }
+	
+	for (uint16_t i = 0; i < len; i++)
+	{
+		uint16_t bit9 = s_parity == UART_PARITY_NONE ? 1 : (__builtin_parity(buf[i]) ^ (s_parity == UART_PARITY_ODD));
+		s_tx_words[i] = buf[i] | (bit9 << 8);
+	}
+	
+	pio_interrupt_clear(RS485_PIO, RS485_PIO_TX_DONE_IRQ);
+	dma_channel_set_read_addr(s_tx_dma, s_tx_words, false);
+	dma_channel_set_trans_count(s_tx_dma, len, true);
+}
+
+bool rs485_pio_tx_done()
+{
+	// The SM raises the flag right after dropping DE at the end of the last stop bit
+	if (!pio_interrupt_get(RS485_PIO, RS485_PIO_TX_DONE_IRQ))
+	{
+		return false;
+	}
+	pio_interrupt_clear(RS485_PIO, RS485_PIO_TX_DONE_IRQ);
+	return true;
+}
+
+void rs485_pio_write_blocking(const uint8_t *buf, uint16_t len)
+{
+	rs485_pio_write(buf, len);
+	while (!rs485_pio_tx_done())
+	{
+		tight_loop_contents();
+	}
+}
+
+void rs485_pio_rx_flush()
+{
+	while (!pio_sm_is_rx_fifo_empty(RS485_PIO, s_rx_sm))
+	{
+		pio_sm_get(RS485_PIO, s_rx_sm);
+	}
+	pio_interrupt_clear(RS485_PIO, RS485_PIO_FRAME_END_IRQ);
+}
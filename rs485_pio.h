@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+#include "hardware/uart.h"
+#include "hardware/irq.h"
+
+// Per character status from the RX state machine
+#define RS485_PIO_FRAMING_ERROR 0x01
+#define RS485_PIO_PARITY_ERROR 0x02
+#define RS485_PIO_GAP_T15 0x04 // silence before this character exceeded T1.5
+#define RS485_PIO_GAP_T35 0x08 // silence before this character reached T3.5, it starts a new frame
+
+#define RS485_PIO_FRAME_END_WORD 0xFFFFFFFE // stands in for the frame end flag among captured words, no character reads as this
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	void rs485_pio_init(uint baud, uart_parity_t parity, irq_handler_t rx_handler);
+	
+	bool rs485_pio_getc(uint8_t *c, uint8_t *flags);
+	
+	// Character and flags from a raw RX FIFO word, as rs485_pio_getc() returns them
+	void rs485_pio_decode(uint32_t word, uint8_t *c, uint8_t *flags);
+	
+	// Flash lockout receive handler, see mb_flash_lockout(). Appends the RX
+	// FIFO to the count words already in words, then RS485_PIO_FRAME_END_WORD
+	// if the frame end flag was up, and returns the new count.
+	uint16_t rs485_pio_capture(uint32_t *words, uint16_t count, uint16_t size);
+	
+	bool rs485_pio_frame_end();
+	
+	void rs485_pio_write(const uint8_t *buf, uint16_t len);
+	
+	bool rs485_pio_tx_done();
+	
+	void rs485_pio_write_blocking(const uint8_t *buf, uint16_t len);
+	
+	void rs485_pio_rx_flush();
+
+#ifdef __cplusplus
+}
+#endif
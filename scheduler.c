@@ -0,0 +1,207 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "scheduler.h"
+#include "pico/stdlib.h"
+#include "pico/time.h"
+#include "hardware/sync.h"
+
+#define SCHED_NO_WAKE UINT64_MAX
+#define SCHED_MAX_SLEEP_US 1000000 // re-evaluate at least this often even with nothing scheduled
+
+typedef struct
+{
+	const char *name;
+	sched_func_t func;
+	uint32_t period_us;
+	uint8_t priority;
+	uint32_t budget_us;
+	uint64_t next_run_us;
+	uint64_t wake_us; // one-shot wake requested by sched_post_at()
+	
+	uint32_t runs;
+	uint32_t overruns;
+	uint32_t exec_max_us;
+	uint64_t exec_total_us;
+	uint32_t latency_max_us; // release (post, wake or period) to dispatch
+	uint64_t latency_total_us;
+} sched_task_t;
+
+static sched_task_t s_tasks[SCHED_TASK_COUNT];
+static volatile uint8_t s_pending[SCHED_TASK_COUNT];
+static volatile uint64_t s_post_us[SCHED_TASK_COUNT]; // only written by sched_post() while not pending
+static uint64_t s_idle_us = 0;
+static uint64_t s_stats_start_us = 0;
+static uint32_t s_sleeps = 0;
+
+void sched_init()
+{
+	for (uint8_t i = 0; i < SCHED_TASK_COUNT; i++)
+	{
+		s_tasks[i].func = NULL;
+		s_tasks[i].wake_us = SCHED_NO_WAKE;
+		s_pending[i] = false;
+	}
+	s_stats_start_us = time_us_64();
+}
+
+void sched_add_task(uint8_t task, const char *name, sched_func_t func, uint32_t period_us, uint8_t priority, uint32_t budget_us)
+{
+	if (task >= SCHED_TASK_COUNT) { return; }
+	
+	s_tasks[task].name = name;
+	s_tasks[task].func = func;
+	s_tasks[task].period_us = period_us;
+	s_tasks[task].priority = priority;
+	s_tasks[task].budget_us = budget_us;
+	s_tasks[task].next_run_us = time_us_64() + period_us;
+}
+
+void sched_post(uint8_t task)
+{
+	if (task >= SCHED_TASK_COUNT) { return; }
+	
+	if (!s_pending[task])
+	{
+		s_post_us[task] = time_us_64();
+		s_pending[task] = true;
+	}
+	__sev(); // make sure a WFE racing with this post returns immediately
+}
+
+void sched_post_at(uint8_t task, uint64_t when_us)
+{
+	if (task >= SCHED_TASK_COUNT) { return; }
+	
+	if (when_us < s_tasks[task].wake_us)
+	{
+		s_tasks[task].wake_us = when_us;
+	}
+}
+
+// Earliest moment the task became (or becomes) ready
+static uint64_t sched_release_time(uint8_t task)
+{
+	sched_task_t *t = &s_tasks[task];
+	uint64_t release = t->wake_us;
+	if (t->period_us && t->next_run_us < release) { release = t->next_run_us; }
+	if (s_pending[task] && s_post_us[task] < release) { release = s_post_us[task]; }
+	return release;
+}
+
+static int8_t sched_select(uint64_t now, uint64_t *release, uint64_t *next_wake)
+{
+	int8_t selected = -1;
+	for (uint8_t i = 0; i < SCHED_TASK_COUNT; i++)
+	{
+		if (s_tasks[i].func == NULL) { continue; }
+		
+		uint64_t task_release = sched_release_time(i);
+		if (task_release > now)
+		{
+			if (task_release < *next_wake) { *next_wake = task_release; }
+			continue;
+		}
+		
+		if (selected < 0 || s_tasks[i].priority < s_tasks[selected].priority
+			|| (s_tasks[i].priority == s_tasks[selected].priority && task_release < *release))
+		{
+			selected = i;
+			*release = task_release;
+		}
+	}
+	return selected;
+}
+
+static void sched_dispatch(uint8_t task, uint64_t now, uint64_t release)
+{
+	sched_task_t *t = &s_tasks[task];
+	
+	s_pending[task] = false;
+	t->wake_us = SCHED_NO_WAKE;
+	if (t->period_us && now >= t->next_run_us)
+	{
+		t->next_run_us += t->period_us;
+		if (t->next_run_us <= now) { t->next_run_us = now + t->period_us; } // fell behind, don't burst
+	}
+	
+	uint32_t latency = (uint32_t)(now - release);
+	if (latency > t->latency_max_us) { t->latency_max_us = latency; }
+	t->latency_total_us += latency;
+	
+	t->func();
+	
+	uint32_t exec = (uint32_t)(time_us_64() - now);
+	if (exec > t->exec_max_us) { t->exec_max_us = exec; }
+	if (exec > t->budget_us) { t->overruns++; }
+	t->exec_total_us += exec;
+	t->runs++;
+}
+
+void sched_run()
+{
+	while (1)
+	{
+		// Dispatch one task per pass so anything posted meanwhile competes
+		// on priority before the next lower-priority task gets the CPU
+		uint64_t now = time_us_64();
+		uint64_t release = 0;
+		uint64_t next_wake = now + SCHED_MAX_SLEEP_US;
+		int8_t task = sched_select(now, &release, &next_wake);
+		if (task >= 0)
+		{
+			sched_dispatch(task, now, release);
+			continue;
+		}
+		
+		// A post landing after the selection pass has already issued SEV, so
+		// the WFE below falls straight through instead of missing it
+		uint64_t sleep_start = time_us_64();
+		if (next_wake > sleep_start)
+		{
+			best_effort_wfe_or_timeout(from_us_since_boot(next_wake));
+			s_idle_us += time_us_64() - sleep_start;
+			s_sleeps++;
+		}
+	}
+}
+
+void sched_print_stats()
+{
+	uint64_t elapsed = time_us_64() - s_stats_start_us;
+	uint32_t blocking_max = 0;
+	
+	printf("** SCHEDULER STATISTICS **\r\n");
+	printf("IDLE\t\t= %lu.%lu %% (%lu sleeps)\r\n", (uint32_t)(s_idle_us * 100 / elapsed),
+		(uint32_t)(s_idle_us * 1000 / elapsed % 10), s_sleeps);
+	printf("TASK\t\tPRIO\tPERIOD\tBUDGET\tRUNS\t\tEXEC AVG\tEXEC MAX\tOVERRUNS\tWAIT AVG\tWAIT MAX\r\n");
+	for (uint8_t i = 0; i < SCHED_TASK_COUNT; i++)
+	{
+		sched_task_t *t = &s_tasks[i];
+		if (t->func == NULL) { continue; }
+		printf("%-8s\t%u\t%lu\t%lu\t%-8lu\t%-8lu\t%-8lu\t%-8lu\t%-8lu\t%lu\r\n", t->name, t->priority, t->period_us, t->budget_us, t->runs,
+			t->runs ? (uint32_t)(t->exec_total_us / t->runs) : 0, t->exec_max_us, t->overruns,
+			t->runs ? (uint32_t)(t->latency_total_us / t->runs) : 0, t->latency_max_us);
+		if (i != SCHED_TASK_MODBUS && t->exec_max_us > blocking_max) { blocking_max = t->exec_max_us; }
+	}
+	
+	// Tasks are not preempted, so a Modbus frame can wait for at most the longest other run
+	printf("MODBUS BLOCKING\t= %lu us worst case observed\r\n", blocking_max);
+}
+
+void sched_reset_stats()
+{
+	for (uint8_t i = 0; i < SCHED_TASK_COUNT; i++)
+	{
+		sched_task_t *t = &s_tasks[i];
+		t->runs = 0;
+		t->overruns = 0;
+		t->exec_max_us = 0;
+		t->exec_total_us = 0;
+		t->latency_max_us = 0;
+		t->latency_total_us = 0;
+	}
+	s_idle_us = 0;
+	s_sleeps = 0;
+	s_stats_start_us = time_us_64();
+}
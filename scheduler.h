@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	
+	enum SCHED_TASKS
+	{
+		SCHED_TASK_MODBUS,
+		SCHED_TASK_OUTPUTS,
+		SCHED_TASK_INPUTS,
+		SCHED_TASK_PULSE,
+		SCHED_TASK_VSENSE,
+		SCHED_TASK_LED,
+		SCHED_TASK_CLI,
+		SCHED_TASK_NVCONFIG,
+		SCHED_TASK_USB,
+		SCHED_TASK_MASTER,
+		SCHED_TASK_LOGIC,
+		SCHED_TASK_HISTORY,
+		SCHED_TASK_IMAGE,
+		SCHED_TASK_COUNT
+	};
+	
+	typedef void(*sched_func_t)(void);
+	
+	// period_us = 0 makes the task purely event triggered. Lower priority
+	// values run first; equal priorities run earliest-release first. A run
+	// longer than budget_us is counted as an overrun.
+	void sched_add_task(uint8_t task, const char *name, sched_func_t func, uint32_t period_us, uint8_t priority, uint32_t budget_us);
+	
+	void sched_init();
+	
+	// Safe to call from interrupt context
+	void sched_post(uint8_t task);
+	
+	// Task context only: run the task once at (or after) the given time_us_64() value
+	void sched_post_at(uint8_t task, uint64_t when_us);
+	
+	void sched_run();
+	
+	void sched_print_stats();
+	
+	void sched_reset_stats();
+
+#ifdef __cplusplus
+}
+#endif
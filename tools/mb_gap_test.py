@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""
+Frame loss at the minimum inter-frame gap on the RS485 bus.
+
+Each request goes out T3.5 after the previous reply came in, the shortest
+silence a master may leave. With --foreign every request is preceded by one
+for another unit, T3.5 earlier, so the board also has to let a whole frame
+that is not its own go by and still catch the next one.
+
+    python3 mb_gap_test.py /dev/ttyUSB0 --unit 5 --count 5000 --foreign
+
+Loss is judged by the board's own FC08 counters read before and after the
+run: every frame sent must show up in the bus message count and none in the
+communication error count, besides a reply to every request addressed to it.
+USB adapters add latency the host cannot see, so the silence on the wire is
+longer than asked for; the gap min of the 'bus' CLI command shows what the
+board actually saw, shorten --gap-us until it reads T3.5. Needs pyserial.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+from mb_scatter import crc16
+
+FUNC_READ_HOLDING_REGISTERS = 0x03
+FUNC_DIAGNOSTICS = 0x08
+DIAG_BUS_MESSAGE_COUNT = 0x0B
+DIAG_BUS_COM_ERROR_COUNT = 0x0C
+DIAG_SERVER_MESSAGE_COUNT = 0x0E
+
+
+def frame(pdu):
+    return pdu + struct.pack("<H", crc16(pdu))
+
+
+def read_request(unit, start, quantity):
+    return frame(struct.pack(">BBHH", unit, FUNC_READ_HOLDING_REGISTERS, start, quantity))
+
+
+def receive(port, expected):
+    reply = port.read(expected)
+    if len(reply) == 5 and reply[1] & 0x80:
+        raise IOError("exception %02X" % reply[2])
+    if len(reply) != expected or crc16(reply[:-2]) != struct.unpack("<H", reply[-2:])[0]:
+        raise IOError("bad or missing reply (%d bytes)" % len(reply))
+    return reply
+
+
+def counter(port, unit, sub_function):
+    port.write(frame(struct.pack(">BBHH", unit, FUNC_DIAGNOSTICS, sub_function, 0)))
+    return struct.unpack(">H", receive(port, 8)[4:6])[0]
+
+
+def counters(port, unit):
+    return [counter(port, unit, sub) for sub in
+            (DIAG_BUS_MESSAGE_COUNT, DIAG_BUS_COM_ERROR_COUNT, DIAG_SERVER_MESSAGE_COUNT)]
+
+
+def wait_until(deadline):
+    while time.perf_counter() < deadline:
+        pass  # sleep() is far coarser than T3.5
+
+
+def main():
+    import serial
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("--unit", type=int, default=1)
+    parser.add_argument("--foreign", type=int, nargs="?", const=247, default=None,
+                        help="also send each request to this unit first (247 if not given)")
+    parser.add_argument("--start", type=int, default=0)
+    parser.add_argument("--quantity", type=int, default=12)
+    parser.add_argument("--count", type=int, default=1000)
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--parity", choices="NEO", default="E")
+    parser.add_argument("--gap-us", type=float, help="silence before each frame, T3.5 by default")
+    parser.add_argument("--timeout", type=float, default=0.5)
+    args = parser.parse_args()
+
+    char_s = (11 if args.parity != "N" else 10) / args.baud
+    gap_s = args.gap_us / 1e6 if args.gap_us is not None else (0.00175 if args.baud > 19200 else 3.5 * char_s)
+    request = read_request(args.unit, args.start, args.quantity)
+    foreign = read_request(args.foreign, args.start, args.quantity) if args.foreign is not None else b""
+    expected = 5 + 2 * args.quantity
+    lost = 0
+
+    with serial.Serial(args.port, args.baud, parity=args.parity, stopbits=serial.STOPBITS_ONE,
+                       timeout=args.timeout) as port:
+        port.reset_input_buffer()
+        before = counters(port, args.unit)
+        quiet = time.perf_counter()
+        for _ in range(args.count):
+            if foreign:
+                wait_until(quiet + gap_s)
+                port.write(foreign)
+                quiet = time.perf_counter() + len(foreign) * char_s  # the write returns before it is on the wire
+            wait_until(quiet + gap_s)
+            port.write(request)
+            try:
+                receive(port, expected)
+            except IOError:
+                lost += 1
+                port.reset_input_buffer()
+            quiet = time.perf_counter()
+        wait_until(quiet + gap_s)
+        after = counters(port, args.unit)
+
+    sent = args.count * (2 if foreign else 1)
+    # Each difference also takes in three of the counter queries themselves
+    bus = (after[0] - before[0] - 3) % 0x10000
+    errors = (after[1] - before[1]) % 0x10000
+    served = (after[2] - before[2] - 3) % 0x10000
+    print("gap\t\t%.0f us" % (gap_s * 1e6))
+    print("frames sent\t%d" % sent)
+    print("frames heard\t%d (%d communication errors)" % (bus, errors))
+    print("requests served\t%d of %d (%d replies lost)" % (served, args.count, lost))
+    if bus != sent or errors or served != args.count or lost:
+        sys.exit("frames were lost")
+
+
+if __name__ == "__main__":
+    main()
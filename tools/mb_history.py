@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+"""
+Backfill and decode the board's event history through FC14 Read File Record.
+
+The board keeps input changes, output pulses and analog samples in a circular
+flash log of 256-byte pages. Input registers 320-326 give the sequence of the
+page being filled, the oldest sequence still held and the number of slots;
+page n sits in slot n % slots, 128 records (registers) per slot, 64 slots per
+file from file 1. Reads are packed up to the frame limit, several
+sub-requests to a transaction, so a page costs a little over one transaction
+however many events it holds.
+
+    python3 mb_history.py /dev/ttyACM1 --since 1200
+
+prints one line per event with its page sequence and uptime in ms. The
+sequence to pass as --since next time is printed last; it is the page that
+was still being filled, so its events are read again. Needs pyserial.
+"""
+
+import argparse
+import struct
+import sys
+
+from mb_scatter import crc16
+
+FUNC_READ_INPUT_REGISTERS = 0x04
+FUNC_READ_FILE_RECORD = 0x14
+REFERENCE_TYPE = 6
+IR_HISTORY = 320
+STAT_COUNT = 7
+FILE_HISTORY = 1
+FILE_PAGES = 64
+PAGE_SIZE = 256
+PAGE_RECORDS = PAGE_SIZE // 2
+HEADER = struct.Struct("<IIH")  # sequence, base_ms, magic
+MAGIC = 0x484C
+END = 0xFF
+MAX_DATA = 0xF5  # reply byte count limit, 2 bytes of it per sub-request
+
+SAMPLES = ("5V mV", "12V mV", "freq 1 mHz", "freq 2 mHz")
+
+
+def transact(port, pdu, expected):
+    frame = pdu + struct.pack("<H", crc16(pdu))
+    port.write(frame)
+    reply = port.read(3)
+    if len(reply) == 3 and reply[1] & 0x80:
+        raise IOError("exception %02X" % reply[2])
+    reply += port.read(expected - len(reply))
+    if len(reply) != expected or crc16(reply[:-2]) != struct.unpack("<H", reply[-2:])[0]:
+        raise IOError("bad or missing reply (%d bytes)" % len(reply))
+    return reply[:-2]
+
+
+def read_stats(port, unit):
+    reply = transact(port, struct.pack(">BBHH", unit, FUNC_READ_INPUT_REGISTERS, IR_HISTORY, STAT_COUNT), 5 + 2 * STAT_COUNT)
+    stats = struct.unpack(">%dH" % STAT_COUNT, reply[3:])
+    return (stats[0] << 16) | stats[1], (stats[2] << 16) | stats[3], stats[4], stats[6]
+
+
+def spans(slots):
+    """(file, record, count) runs covering the slots in order, split at file ends."""
+    runs = []
+    for slot in slots:
+        file, record = FILE_HISTORY + slot // FILE_PAGES, slot % FILE_PAGES * PAGE_RECORDS
+        if runs and runs[-1][0] == file and runs[-1][1] + runs[-1][2] == record:
+            runs[-1][2] += PAGE_RECORDS
+        else:
+            runs.append([file, record, PAGE_RECORDS])
+    return runs
+
+
+def read_records(port, unit, runs):
+    """Reads the runs back to back, as many sub-requests per transaction as fit."""
+    data = bytearray()
+    runs = [list(r) for r in runs]
+    while runs:
+        subs = []
+        room = MAX_DATA
+        while runs and room > 2:
+            file, record, count = runs[0]
+            take = min(count, (room - 2) // 2)
+            subs.append((file, record, take))
+            room -= 2 + take * 2
+            if take == count:
+                runs.pop(0)
+            else:
+                runs[0] = [file, record + take, count - take]
+        pdu = struct.pack(">BBB", unit, FUNC_READ_FILE_RECORD, 7 * len(subs))
+        pdu += b"".join(struct.pack(">BHHH", REFERENCE_TYPE, f, r, c) for f, r, c in subs)
+        reply = transact(port, pdu, 5 + sum(2 + 2 * c for _, _, c in subs))
+        offset = 3
+        for _, _, count in subs:
+            data += reply[offset + 2:offset + 2 + 2 * count]
+            offset += 2 + 2 * count
+    return bytes(data)
+
+
+def varint(page, offset):
+    value = shift = 0
+    while True:
+        byte = page[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, offset
+
+
+def decode_page(page):
+    sequence, now, magic = HEADER.unpack_from(page)
+    if magic != MAGIC:
+        return None, []
+    samples = [0] * len(SAMPLES)
+    events = []
+    offset = HEADER.size
+    while offset < PAGE_SIZE and page[offset] != END:
+        tag = page[offset]
+        delta, offset = varint(page, offset + 1)
+        now = (now + delta) & 0xFFFFFFFF
+        event, argument = tag >> 5, tag & 0x1F
+        if event == 0:
+            text = "boot"
+        elif event == 1:
+            text = "input %d %s" % ((argument >> 1) + 1, "on" if argument & 1 else "off")
+        elif event == 2:
+            text = "output %d pulse" % (argument + 1)
+        elif event == 3 and argument < len(SAMPLES):
+            zigzag, offset = varint(page, offset)
+            samples[argument] += (zigzag >> 1) ^ -(zigzag & 1)
+            text = "%s %d" % (SAMPLES[argument], samples[argument])
+        elif event == 4:
+            count, offset = varint(page, offset)
+            text = "%d events dropped here" % count
+        else:
+            text = "unknown tag %02X, rest of page skipped" % tag
+            events.append((now, text))
+            break
+        events.append((now, text))
+    return sequence, events
+
+
+def main():
+    import serial
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("--unit", type=int, default=255)
+    parser.add_argument("--since", type=int, default=None, help="first page sequence to read, default the oldest")
+    parser.add_argument("--baud", type=int, default=115200, help="ignored by the USB port")
+    parser.add_argument("--parity", choices="NEO", default="E", help="ignored by the USB port")
+    parser.add_argument("--timeout", type=float, default=0.5)
+    args = parser.parse_args()
+
+    with serial.Serial(args.port, args.baud, parity=args.parity, timeout=args.timeout) as port:
+        port.reset_input_buffer()
+        try:
+            open_sequence, oldest, slots, dropped = read_stats(port, args.unit)
+            first = oldest if args.since is None else max(args.since, oldest)
+            sequences = list(range(first, open_sequence + 1))
+            data = read_records(port, args.unit, spans([s % slots for s in sequences]))
+        except IOError as e:
+            sys.exit(str(e))
+
+    for index, expected in enumerate(sequences):
+        sequence, events = decode_page(data[index * PAGE_SIZE:(index + 1) * PAGE_SIZE])
+        if sequence != expected:
+            continue  # skipped after a power cut, or overwritten while reading
+        for ms, text in events:
+            print("%d\t%d\t%s" % (sequence, ms, text))
+    if dropped:
+        print("# %d events dropped on the board" % dropped, file=sys.stderr)
+    print("# next --since %d" % open_sequence, file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""
+Inventory of the boards on an RS485 segment (or the one on a USB port), one
+FC11 Report Server ID request per unit.
+
+The board answers FC11 with its server id, the run indicator and every device
+identification object (the same ones FC2B/0E reads) as id, length and text.
+Units that do not answer within --timeout are listed as missing.
+
+    python3 mb_inventory.py /dev/ttyUSB0 --units 1-30 --baud 115200
+
+prints a tab separated line per unit: unit, vendor, product code, revision,
+then any further objects as id=text. Needs pyserial.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+from mb_scatter import crc16
+
+FUNC_REPORT_SERVER_ID = 0x11
+SERVER_ID = 0x4D
+
+
+def parse_units(text):
+    units = []
+    for part in text.split(","):
+        first, _, last = part.partition("-")
+        units += range(int(first), int(last or first) + 1)
+    return units
+
+
+def report_server_id(port, unit):
+    frame = bytes([unit, FUNC_REPORT_SERVER_ID])
+    port.write(frame + struct.pack("<H", crc16(frame)))
+    reply = port.read(3)
+    if len(reply) < 3:
+        return None
+    if reply[1] & 0x80:
+        port.read(2)
+        raise IOError("unit %d: exception %02X" % (unit, reply[2]))
+    reply += port.read(reply[2] + 2)
+    if len(reply) != reply[2] + 5 or crc16(reply[:-2]) != struct.unpack("<H", reply[-2:])[0]:
+        raise IOError("unit %d: bad reply (%d bytes)" % (unit, len(reply)))
+    return reply[3:-2]
+
+
+def decode(data):
+    """(server id, running, {object id: text})"""
+    objects = {}
+    offset = 2
+    while offset + 2 <= len(data):
+        object_id, length = data[offset], data[offset + 1]
+        objects[object_id] = data[offset + 2:offset + 2 + length].decode("ascii", "replace")
+        offset += 2 + length
+    return data[0], data[1] == 0xFF, objects
+
+
+def main():
+    import serial
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("--units", type=parse_units, default=[255], help="e.g. 1-30, default 255 for the USB port")
+    parser.add_argument("--baud", type=int, default=115200, help="ignored by the USB port")
+    parser.add_argument("--parity", choices="NEO", default="E", help="ignored by the USB port")
+    parser.add_argument("--timeout", type=float, default=0.1)
+    args = parser.parse_args()
+
+    missing = []
+    began = time.monotonic()
+    with serial.Serial(args.port, args.baud, parity=args.parity, timeout=args.timeout) as port:
+        for unit in args.units:
+            port.reset_input_buffer()
+            try:
+                data = report_server_id(port, unit)
+            except IOError as e:
+                print(str(e), file=sys.stderr)
+                continue
+            if data is None:
+                missing.append(unit)
+                continue
+            server_id, running, objects = decode(data)
+            fields = [str(unit)] + [objects.pop(i, "") for i in (0, 1, 2)]
+            fields += ["%02X=%s" % (i, text) for i, text in sorted(objects.items())]
+            if server_id != SERVER_ID or not running:
+                fields.append("server id %02X%s" % (server_id, "" if running else ", not running"))
+            print("\t".join(fields))
+    print("# %d units in %.2f s, missing %s" % (len(args.units), time.monotonic() - began, missing or "none"), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""
+Host side of the vendor scatter read (function 0x41).
+
+One request carries up to 16 (table, start, quantity) ranges and the reply
+returns all of them in one frame, so a status scan costs a single bus
+transaction instead of one per range. A table is named by the function code
+that normally reads it: 1 coils, 2 discrete inputs, 3 holding registers,
+4 input registers, 8 bus diagnostic counters (32-bit, two registers each,
+high word first).
+
+    python3 mb_scatter.py /dev/ttyUSB0 --unit 5 2:0:2 4:0:12 3:0:1 8:0:16
+
+Needs pyserial.
+"""
+
+import argparse
+import struct
+import sys
+
+FUNC_SCATTER_READ = 0x41
+MAX_RANGES = 16
+BIT_TABLES = (1, 2)
+TABLES = (1, 2, 3, 4, 8)
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return crc
+
+
+def range_bytes(table, quantity):
+    return (quantity + 7) // 8 if table in BIT_TABLES else quantity * 2
+
+
+def build_request(unit, ranges):
+    if not 0 < len(ranges) <= MAX_RANGES:
+        raise ValueError("1 to %d ranges per request" % MAX_RANGES)
+    pdu = bytes([unit, FUNC_SCATTER_READ, len(ranges)])
+    for table, start, quantity in ranges:
+        if table not in TABLES:
+            raise ValueError("unknown table %d" % table)
+        pdu += struct.pack(">BHH", table, start, quantity)
+    return pdu + struct.pack("<H", crc16(pdu))
+
+
+def parse_response(unit, ranges, frame):
+    """Returns one list per range, bools for bit tables and ints for registers."""
+    if len(frame) < 5 or crc16(frame[:-2]) != struct.unpack("<H", frame[-2:])[0]:
+        raise IOError("bad CRC or short frame")
+    if frame[0] != unit:
+        raise IOError("reply from unit %d" % frame[0])
+    if frame[1] == FUNC_SCATTER_READ | 0x80:
+        raise IOError("exception %02X" % frame[2])
+    if frame[1] != FUNC_SCATTER_READ or frame[2] != len(frame) - 5:
+        raise IOError("malformed reply")
+
+    data = frame[3:-2]
+    values = []
+    offset = 0
+    for table, _, quantity in ranges:
+        size = range_bytes(table, quantity)
+        chunk = data[offset:offset + size]
+        offset += size
+        if table in BIT_TABLES:
+            values.append([bool(chunk[i // 8] >> (i % 8) & 1) for i in range(quantity)])
+        else:
+            values.append(list(struct.unpack(">%dH" % quantity, chunk)))
+    return values
+
+
+def scatter_read(port, unit, ranges):
+    """Sends one scatter read on an open serial.Serial and returns the decoded ranges."""
+    expected = 5 + sum(range_bytes(t, q) for t, _, q in ranges)
+    port.reset_input_buffer()
+    port.write(build_request(unit, ranges))
+    frame = port.read(3)
+    if len(frame) == 3 and frame[1] & 0x80:
+        frame += port.read(2)
+    else:
+        frame += port.read(expected - len(frame))
+    return parse_response(unit, ranges, frame)
+
+
+def main():
+    import serial
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("ranges", nargs="+", help="table:start:quantity")
+    parser.add_argument("--unit", type=int, default=1)
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--parity", default="E", choices="NEO")
+    parser.add_argument("--timeout", type=float, default=0.5)
+    args = parser.parse_args()
+
+    ranges = [tuple(int(v, 0) for v in r.split(":")) for r in args.ranges]
+    with serial.Serial(args.port, args.baud, parity=args.parity, timeout=args.timeout) as port:
+        try:
+            values = scatter_read(port, args.unit, ranges)
+        except IOError as e:
+            sys.exit(str(e))
+    for (table, start, _), data in zip(ranges, values):
+        print("%d:%d\t%s" % (table, start, " ".join(str(int(v)) for v in data)))
+
+
+if __name__ == "__main__":
+    main()
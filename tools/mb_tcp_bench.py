@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""
+Modbus TCP transactions per second against mb_tcp_gateway.py (or any Modbus
+TCP server) for several client counts.
+
+Every client holds its own connection and keeps --depth requests in flight,
+matching replies by transaction id, so the run shows what pipelining and
+concurrency buy over one request at a time.
+
+    python3 mb_tcp_bench.py 127.0.0.1:5020 --clients 1 16 128 --seconds 5
+"""
+
+import argparse
+import asyncio
+import selectors
+import struct
+import time
+
+MBAP_HEADER = struct.Struct(">HHHB")
+FUNC_READ_INPUT_REGISTERS = 0x04
+
+
+class Stats:
+    def __init__(self):
+        self.replies = 0
+        self.exceptions = 0
+        self.latency = 0.0
+        self.latency_max = 0.0
+
+
+async def client(host, port, args, stats, deadline):
+    reader, writer = await asyncio.open_connection(host, port)
+    pdu = struct.pack(">BHH", FUNC_READ_INPUT_REGISTERS, args.start, args.quantity)
+    sent = {}
+    transaction = 0
+
+    def send():
+        nonlocal transaction
+        transaction = (transaction + 1) & 0xFFFF
+        sent[transaction] = time.perf_counter()
+        writer.write(MBAP_HEADER.pack(transaction, 0, len(pdu) + 1, args.unit) + pdu)
+
+    for _ in range(args.depth):
+        send()
+    while sent:
+        header = await reader.readexactly(MBAP_HEADER.size)
+        reply_transaction, _, length, _ = MBAP_HEADER.unpack(header)
+        reply = await reader.readexactly(length - 1)
+        latency = time.perf_counter() - sent.pop(reply_transaction)
+        stats.replies += 1
+        stats.exceptions += reply[0] & 0x80 != 0
+        stats.latency += latency
+        stats.latency_max = max(stats.latency_max, latency)
+        if time.perf_counter() < deadline:
+            send()
+    writer.close()
+
+
+async def run(args):
+    host, _, port = args.target.rpartition(":")
+    print("clients\tdepth\ttrans/s\tavg ms\tmax ms\texceptions")
+    for clients in args.clients:
+        stats = Stats()
+        began = time.perf_counter()
+        deadline = began + args.seconds
+        await asyncio.gather(*(client(host, int(port), args, stats, deadline) for _ in range(clients)))
+        elapsed = time.perf_counter() - began
+        print("%d\t%d\t%.0f\t%.3f\t%.3f\t%d" % (clients, args.depth, stats.replies / elapsed,
+            stats.latency / max(stats.replies, 1) * 1e3, stats.latency_max * 1e3, stats.exceptions))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("target", nargs="?", default="127.0.0.1:5020")
+    parser.add_argument("--clients", type=int, nargs="+", default=[1, 16, 128])
+    parser.add_argument("--depth", type=int, default=4, help="requests in flight per client")
+    parser.add_argument("--seconds", type=float, default=5.0)
+    parser.add_argument("--unit", type=int, default=255)
+    parser.add_argument("--start", type=int, default=0)
+    parser.add_argument("--quantity", type=int, default=12)
+    args = parser.parse_args()
+
+    loop = asyncio.SelectorEventLoop(selectors.EpollSelector())
+    try:
+        loop.run_until_complete(run(args))
+    finally:
+        loop.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+"""
+Modbus TCP server for the board's Modbus USB port.
+
+Opening the port at 502 baud switches the board to MBAP framing, so TCP
+requests pass straight through to the same function handlers the RS485 bus
+uses. Any number of clients can connect and each may pipeline requests; the
+gateway gives every request its own transaction id on the USB side, keeps up
+to --window of them in flight and hands each reply back to the client that
+asked with that client's transaction id. A request the board does not answer
+within --timeout gets exception 0x0B.
+
+    python3 mb_tcp_gateway.py /dev/ttyACM1 --listen 127.0.0.1:5020
+
+Single threaded on an epoll loop. Needs pyserial.
+"""
+
+import argparse
+import asyncio
+import collections
+import os
+import selectors
+import struct
+
+MBAP_BAUD = 502
+MBAP_HEADER = struct.Struct(">HHHB")  # transaction, protocol, length, unit
+MBAP_MAX_SIZE = 260
+EXCEPTION_GATEWAY_NO_RESPONSE = 0x0B
+
+
+def mbap_frame(transaction, unit, pdu):
+    return MBAP_HEADER.pack(transaction, 0, len(pdu) + 1, unit) + pdu
+
+
+def exception_pdu(pdu, code):
+    return bytes([pdu[0] | 0x80, code])
+
+
+class Gateway:
+    def __init__(self, port, window, timeout):
+        self.port = port
+        self.window = window
+        self.timeout = timeout
+        self.queue = collections.deque()  # (writer, client transaction, unit, pdu) not yet sent
+        self.in_flight = {}  # our transaction -> (writer, client transaction, unit, pdu, timer)
+        self.next_transaction = 0
+        self.rx = bytearray()
+
+    def start(self, loop):
+        self.loop = loop
+        os.set_blocking(self.port.fileno(), False)
+        loop.add_reader(self.port.fileno(), self.on_readable)
+
+    def submit(self, writer, transaction, unit, pdu):
+        self.queue.append((writer, transaction, unit, pdu))
+        self.pump()
+
+    def pump(self):
+        frames = []
+        while self.queue and len(self.in_flight) < self.window:
+            writer, transaction, unit, pdu = self.queue.popleft()
+            if writer.is_closing():
+                continue
+            ours = self.next_transaction
+            self.next_transaction = (self.next_transaction + 1) & 0xFFFF
+            timer = self.loop.call_later(self.timeout, self.on_timeout, ours)
+            self.in_flight[ours] = (writer, transaction, unit, pdu, timer)
+            frames.append(mbap_frame(ours, unit, pdu))
+        if frames:
+            # USB flow control holds the write until the board has room
+            self.port.write(b"".join(frames))
+
+    def reply(self, ours, pdu):
+        writer, transaction, unit, request, timer = self.in_flight.pop(ours)
+        timer.cancel()
+        if not writer.is_closing():
+            writer.write(mbap_frame(transaction, unit, pdu if pdu else exception_pdu(request, EXCEPTION_GATEWAY_NO_RESPONSE)))
+        self.pump()
+
+    def on_timeout(self, ours):
+        self.reply(ours, None)
+
+    def on_readable(self):
+        try:
+            self.rx += os.read(self.port.fileno(), 4096)
+        except BlockingIOError:
+            return
+        while len(self.rx) >= MBAP_HEADER.size:
+            ours, protocol, length, unit = MBAP_HEADER.unpack_from(self.rx)
+            if protocol != 0 or not 2 <= length <= MBAP_MAX_SIZE - 6:
+                self.rx.clear()  # out of step, the timeouts clear whatever was in flight
+                return
+            if len(self.rx) < length + 6:
+                return
+            pdu = bytes(self.rx[MBAP_HEADER.size:length + 6])
+            del self.rx[:length + 6]
+            if ours in self.in_flight:
+                self.reply(ours, pdu)  # late replies to timed out requests are dropped
+
+    async def serve_client(self, reader, writer):
+        try:
+            while True:
+                header = await reader.readexactly(MBAP_HEADER.size)
+                transaction, protocol, length, unit = MBAP_HEADER.unpack(header)
+                if protocol != 0 or not 2 <= length <= MBAP_MAX_SIZE - 6:
+                    break
+                pdu = await reader.readexactly(length - 1)
+                self.submit(writer, transaction, unit, pdu)
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            writer.close()
+
+
+async def run(args):
+    import serial
+
+    host, _, tcp_port = args.listen.rpartition(":")
+    gateway = Gateway(serial.Serial(args.port, MBAP_BAUD), args.window, args.timeout)
+    gateway.start(asyncio.get_running_loop())
+    server = await asyncio.start_server(gateway.serve_client, host or None, int(tcp_port))
+    print("listening on %s, %s in MBAP framing" % (args.listen, args.port))
+    async with server:
+        await server.serve_forever()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("--listen", default="127.0.0.1:5020")
+    parser.add_argument("--window", type=int, default=8, help="requests in flight on the USB port")
+    parser.add_argument("--timeout", type=float, default=1.0)
+    args = parser.parse_args()
+
+    loop = asyncio.SelectorEventLoop(selectors.EpollSelector())
+    try:
+        loop.run_until_complete(run(args))
+    except KeyboardInterrupt:
+        pass
+    finally:
+        loop.close()
+
+
+if __name__ == "__main__":
+    main()
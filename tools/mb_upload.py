@@ -0,0 +1,391 @@
+#!/usr/bin/env python3
+"""
+Upload a file (a firmware image or any bulk data) into the board's staging
+slot with FC15 Write File Record and check it against the board's CRC, and
+optionally activate it as the board's new firmware.
+
+Holding registers 600-604 take the size and the commands and report the
+transfer state, the Modbus CRC16 of the slot and how the firmware booted. The
+slot is files 16 onwards, 8192 records (registers) per file, two bytes per
+record, first byte high. Each frame carries 122 registers, as much as an RTU
+frame holds; a frame refused with BUSY (flash still catching up) is sent
+again.
+
+    python3 mb_upload.py /dev/ttyUSB0 firmware.bin --baud 921600
+    python3 mb_upload.py /dev/ttyACM1 firmware.bin --mbap --window 4
+    python3 mb_upload.py /dev/ttyUSB0 ModbusEndpoint.bin --units 1-30 --activate
+
+RTU mode sends one request at a time, on RS485 or the USB port. --mbap opens
+the USB port at 502 baud, which switches the board to MBAP framing, and keeps
+--window requests in flight so the link never waits on a reply.
+
+--units broadcasts the frames once to every board on the RS485 segment, --gap
+apart so each can program a page between frames, then repairs each board one
+to one with only what it missed: the ranges it refused with BUSY (holding
+register 605, file 48), then, if its CRC still does not match, the sectors
+whose CRC differs (file 49). A board that missed the setup, or still does
+not match, gets the whole file again. --activate then restarts
+the boards into the new firmware (the .bin of the application, linked to run
+after the bootloader) and confirms each once it answers on trial; both need
+RS485. Prints the time every step took. Needs pyserial.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+from mb_scatter import crc16
+
+FUNC_READ_HOLDING_REGISTERS = 0x03
+FUNC_WRITE_SINGLE_REGISTER = 0x06
+FUNC_WRITE_MULTIPLE_REGISTERS = 0x10
+FUNC_READ_FILE_RECORD = 0x14
+FUNC_WRITE_FILE_RECORD = 0x15
+EXCEPTION_ACK = 0x05
+EXCEPTION_BUSY = 0x06
+REFERENCE_TYPE = 6
+HR_IMAGE = 600
+CMD_BEGIN, CMD_FINISH, CMD_ABORT, CMD_ACTIVATE, CMD_CONFIRM, CMD_REOPEN = 1, 2, 3, 4, 5, 6
+IDLE, ERASING, RECEIVING, FINISHING, DONE, ACTIVATING = range(6)
+STATES = ("IDLE", "ERASING", "RECEIVING", "FINISHING", "DONE", "ACTIVATING")
+BOOT_TRIAL = 1
+BOOTS = ("NORMAL", "TRIAL", "UPDATED", "REVERTED")
+FILE_IMAGE = 16
+FILE_RECORDS = 8192
+FILE_REFUSED = 48
+REFUSED_RECORDS = 4  # first byte, end byte, high word first
+REFUSED_LOST = 0xFFFF
+FILE_SECTOR_CRC = 49
+SECTOR_CRC_MAX = 4  # records per request
+SECTOR_SIZE = 4096
+SLOT_SIZE = 512 * 1024
+FRAME_RECORDS = 122  # byte count 7 + 2 * 122 = 251, the FC15 limit
+MBAP_BAUD = 502
+MBAP_HEADER = struct.Struct(">HHHB")  # transaction, protocol, length, unit
+
+
+class ModbusException(IOError):
+    def __init__(self, code):
+        IOError.__init__(self, "exception %02X" % code)
+        self.code = code
+
+
+class Rtu:
+    def __init__(self, port, unit):
+        self.port = port
+        self.unit = unit
+
+    def transact(self, pdu, expected):
+        frame = bytes([self.unit]) + pdu
+        self.port.write(frame + struct.pack("<H", crc16(frame)))
+        reply = self.port.read(3)
+        if len(reply) == 3 and reply[1] & 0x80:
+            reply += self.port.read(2)
+            raise ModbusException(reply[2])
+        reply += self.port.read(expected + 3 - len(reply))
+        if len(reply) != expected + 3 or crc16(reply[:-2]) != struct.unpack("<H", reply[-2:])[0]:
+            raise IOError("bad or missing reply (%d bytes)" % len(reply))
+        return reply[1:-2]
+
+    def broadcast(self, pdu, gap):
+        """Sends to unit 0, nobody answers. Returns once the frame and the gap are over."""
+        frame = bytes([0]) + pdu
+        self.port.write(frame + struct.pack("<H", crc16(frame)))
+        self.port.flush()
+        time.sleep(gap)
+
+    def stream(self, pdus):
+        """Sends each PDU in turn, repeating it while the board answers BUSY."""
+        busy = 0
+        for pdu in pdus:
+            while True:
+                try:
+                    self.transact(pdu, len(pdu))
+                    break
+                except ModbusException as e:
+                    if e.code != EXCEPTION_BUSY:
+                        raise
+                    busy += 1
+        return busy
+
+
+class Mbap:
+    def __init__(self, port, unit, window):
+        self.port = port
+        self.unit = unit
+        self.window = window
+        self.transaction = 0
+
+    def send(self, pdu):
+        self.transaction = (self.transaction + 1) & 0xFFFF
+        self.port.write(MBAP_HEADER.pack(self.transaction, 0, len(pdu) + 1, self.unit) + pdu)
+        return self.transaction
+
+    def receive(self):
+        header = self.port.read(MBAP_HEADER.size)
+        if len(header) != MBAP_HEADER.size:
+            raise IOError("missing reply")
+        transaction, _, length, _ = MBAP_HEADER.unpack(header)
+        reply = self.port.read(length - 1)
+        if len(reply) != length - 1:
+            raise IOError("short reply")
+        return transaction, reply
+
+    def transact(self, pdu, expected):
+        self.send(pdu)
+        _, reply = self.receive()
+        if reply[0] & 0x80:
+            raise ModbusException(reply[1])
+        return reply
+
+    def stream(self, pdus):
+        """Keeps window PDUs in flight, one answered BUSY is the next sent again."""
+        pending = list(reversed(pdus))
+        in_flight = {}
+        busy = 0
+        while pending or in_flight:
+            while pending and len(in_flight) < self.window:
+                pdu = pending.pop()
+                in_flight[self.send(pdu)] = pdu
+            transaction, reply = self.receive()
+            pdu = in_flight.pop(transaction, None)
+            if pdu is None:
+                continue  # late reply to an earlier run
+            if reply[0] & 0x80:
+                if reply[1] != EXCEPTION_BUSY:
+                    raise ModbusException(reply[1])
+                busy += 1
+                pending.append(pdu)
+        return busy
+
+
+def read_registers(link, first, count):
+    reply = link.transact(struct.pack(">BHH", FUNC_READ_HOLDING_REGISTERS, first, count), 2 + 2 * count)
+    return struct.unpack(">%dH" % count, reply[2:])
+
+
+def command_pdu(value):
+    return struct.pack(">BHH", FUNC_WRITE_SINGLE_REGISTER, HR_IMAGE, value)
+
+
+def size_pdu(size):
+    return struct.pack(">BHHB2H", FUNC_WRITE_MULTIPLE_REGISTERS, HR_IMAGE + 1, 2, 4, size >> 16, size & 0xFFFF)
+
+
+def command(link, value):
+    try:
+        link.transact(command_pdu(value), 5)
+    except ModbusException as e:
+        if e.code != EXCEPTION_ACK:
+            raise
+
+
+def wait_state(link, waiting, timeout):
+    """Polls slowly while the board works, each poll costs it a frame."""
+    deadline = time.monotonic() + timeout
+    while True:
+        state = read_registers(link, HR_IMAGE, 1)[0]
+        if state != waiting:
+            return state
+        if time.monotonic() > deadline:
+            raise IOError("still %s after %.0f s" % (STATES[state], timeout))
+        time.sleep(0.1)
+
+
+def frames(data, first=0, end=None):
+    """FC15 PDUs covering data from byte first to end, split at file ends."""
+    pdus = []
+    offset = first
+    end = len(data) if end is None else min(end, len(data))
+    while offset < end:
+        file, record = FILE_IMAGE + offset // (2 * FILE_RECORDS), offset // 2 % FILE_RECORDS
+        records = min(FRAME_RECORDS, FILE_RECORDS - record, (end - offset) // 2)
+        payload = data[offset:offset + 2 * records]
+        pdus.append(struct.pack(">BBBHHH", FUNC_WRITE_FILE_RECORD, 7 + len(payload), REFERENCE_TYPE, file, record, records) + payload)
+        offset += len(payload)
+    return pdus
+
+
+def read_file(link, file, record, count):
+    pdu = struct.pack(">BBBHHH", FUNC_READ_FILE_RECORD, 7, REFERENCE_TYPE, file, record, count)
+    return link.transact(pdu, 4 + 2 * count)[4:]
+
+
+def refused_ranges(link):
+    """(first, end) byte ranges the board refused with BUSY, None when it lost count."""
+    count = read_registers(link, HR_IMAGE + 5, 1)[0]
+    if count == REFUSED_LOST:
+        return None
+    ranges = []
+    while len(ranges) < count:
+        take = min(count - len(ranges), FRAME_RECORDS // REFUSED_RECORDS)
+        words = struct.unpack(">%dH" % (take * REFUSED_RECORDS),
+            read_file(link, FILE_REFUSED, len(ranges) * REFUSED_RECORDS, take * REFUSED_RECORDS))
+        for i in range(0, len(words), REFUSED_RECORDS):
+            ranges.append(((words[i] << 16) | words[i + 1], (words[i + 2] << 16) | words[i + 3]))
+    return ranges
+
+
+def bad_sectors(link, data):
+    """Sectors whose CRC on the board differs from data, read once the board is DONE."""
+    padded = data + b"\xFF" * (-len(data) % SECTOR_SIZE)  # erased past the end
+    sectors = len(padded) // SECTOR_SIZE
+    bad = []
+    for first in range(0, sectors, SECTOR_CRC_MAX):
+        count = min(SECTOR_CRC_MAX, sectors - first)
+        crcs = struct.unpack(">%dH" % count, read_file(link, FILE_SECTOR_CRC, first, count))
+        for sector, crc in enumerate(crcs, first):
+            if crc != crc16(padded[sector * SECTOR_SIZE:(sector + 1) * SECTOR_SIZE]):
+                bad.append(sector)
+    return bad
+
+
+def check(link, data):
+    """Finishes the transfer, True when the board's CRC matches."""
+    command(link, CMD_FINISH)
+    state = wait_state(link, FINISHING, 30)
+    crc = read_registers(link, HR_IMAGE + 3, 1)[0]
+    return state == DONE and crc == crc16(data)
+
+
+def upload(link, data):
+    """One board, acknowledged frames. Returns the BUSY retry count."""
+    command(link, CMD_ABORT)
+    link.transact(size_pdu(len(data)), 5)
+    command(link, CMD_BEGIN)
+    state = wait_state(link, ERASING, 30)
+    if state != RECEIVING:
+        raise IOError("board went to %s instead of receiving" % STATES[state])
+    busy = link.stream(frames(data))
+    if not check(link, data):
+        raise IOError("CRC mismatch after the transfer")
+    return busy
+
+
+def repair(link, data):
+    """Sends one board what it missed of a broadcast. Returns what it took, None if nothing."""
+    ranges = refused_ranges(link)
+    for first, end in ranges or []:
+        link.stream(frames(data, first, end))
+    if check(link, data):
+        return "%d refused ranges" % len(ranges) if ranges else None
+    bad = bad_sectors(link, data)
+    if bad:
+        command(link, CMD_REOPEN)  # DONE refuses writes
+    for sector in bad:
+        link.stream(frames(data, sector * SECTOR_SIZE, (sector + 1) * SECTOR_SIZE))
+    if bad and check(link, data):
+        return "%s refused ranges, %d sectors" % ("lost" if ranges is None else len(ranges), len(bad))
+    upload(link, data)
+    return "whole file"
+
+
+def broadcast_upload(link, units, data, gap):
+    """Every board at once, unacknowledged frames. Returns (unit, what it took) for the units repaired."""
+    link.broadcast(command_pdu(CMD_ABORT), gap)
+    link.broadcast(size_pdu(len(data)), gap)
+    link.broadcast(command_pdu(CMD_BEGIN), gap)
+    missed = set()
+    for unit in units:
+        link.unit = unit
+        if wait_state(link, ERASING, 30) != RECEIVING:
+            missed.add(unit)  # lost a setup frame, it gets everything one to one
+    for pdu in frames(data):
+        link.broadcast(pdu, gap)
+
+    repaired = []
+    for unit in units:
+        link.unit = unit
+        if unit in missed:
+            upload(link, data)
+            repaired.append((unit, "whole file, missed the setup"))
+            continue
+        how = repair(link, data)
+        if how:
+            repaired.append((unit, how))
+    return repaired
+
+
+def activate(link, units, timeout):
+    """Restarts the boards into the slot and confirms each once it answers on trial."""
+    for unit in units:
+        link.unit = unit
+        command(link, CMD_ACTIVATE)
+    deadline = time.monotonic() + timeout
+    for unit in units:
+        link.unit = unit
+        while True:
+            try:
+                boot = read_registers(link, HR_IMAGE + 4, 1)[0]
+                if boot == BOOT_TRIAL:
+                    break
+                if time.monotonic() > deadline:
+                    raise IOError("unit %d came back %s" % (unit, BOOTS[boot]))
+            except IOError:
+                if time.monotonic() > deadline:
+                    raise
+                link.port.reset_input_buffer()  # still swapping, or answered half a frame
+            time.sleep(0.5)
+        command(link, CMD_CONFIRM)
+
+
+def parse_units(text):
+    units = []
+    for part in text.split(","):
+        first, _, last = part.partition("-")
+        units += range(int(first), int(last or first) + 1)
+    return units
+
+
+def main():
+    import serial
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("file")
+    parser.add_argument("--unit", type=int, default=255)
+    parser.add_argument("--units", type=parse_units, help="broadcast to these units on RS485, e.g. 1-30")
+    parser.add_argument("--gap", type=float, default=0.004, help="pause after each broadcast frame in s")
+    parser.add_argument("--activate", action="store_true", help="restart into the uploaded firmware")
+    parser.add_argument("--mbap", action="store_true", help="USB port only, pipelined MBAP framing")
+    parser.add_argument("--window", type=int, default=4, help="MBAP requests in flight")
+    parser.add_argument("--baud", type=int, default=115200, help="ignored by the USB port")
+    parser.add_argument("--parity", choices="NEO", default="E", help="ignored by the USB port")
+    parser.add_argument("--timeout", type=float, default=0.5)
+    args = parser.parse_args()
+    if args.mbap and (args.units or args.activate):
+        sys.exit("--units and --activate need RS485, the USB port has no broadcast and goes away at the restart")
+
+    data = open(args.file, "rb").read()
+    if not data or len(data) > SLOT_SIZE:
+        sys.exit("file must be 1 to %d bytes" % SLOT_SIZE)
+    data += b"\xFF" * (len(data) % 2)  # whole records, the pad byte is left erased
+    units = args.units or [args.unit]
+
+    baud = MBAP_BAUD if args.mbap else args.baud
+    with serial.Serial(args.port, baud, parity=args.parity, timeout=args.timeout) as port:
+        port.reset_input_buffer()
+        link = Mbap(port, args.unit, args.window) if args.mbap else Rtu(port, args.unit)
+        try:
+            began = time.monotonic()
+            if args.units:
+                repaired = broadcast_upload(link, units, data, args.gap)
+                print("%d bytes to %d units, %d repaired one to one" % (len(data), len(units), len(repaired)))
+                for unit, how in repaired:
+                    print("  unit %d: %s" % (unit, how))
+            else:
+                busy = upload(link, data)
+                print("%d bytes, CRC %04X, %d BUSY retries" % (len(data), crc16(data), busy))
+            uploaded = time.monotonic()
+            print("upload %.2f s, %.0f bytes/s" % (uploaded - began, len(data) / (uploaded - began)))
+            if args.activate:
+                activate(link, units, 120)
+                print("activate %.2f s, transfer start to all running the new firmware %.2f s"
+                    % (time.monotonic() - uploaded, time.monotonic() - began))
+        except IOError as e:
+            sys.exit(str(e))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""
+Transactions per second over the Modbus RTU USB CDC interface.
+
+The board enumerates two CDC ports: the CLI and Modbus RTU. Frames on the
+Modbus port carry the usual unit id and CRC but no silent interval, so
+requests go back to back as fast as the replies come in. Unit 255 always
+reaches the board whatever its DIP switch address.
+
+    python3 mb_usb_bench.py /dev/ttyACM1 --count 5000 --quantity 12
+
+Point it at an RS485 adapter (with --baud and --parity) to compare against
+the bus, and add --ascii to run the same poll in ASCII framing once the board
+is configured for it ("config framing ascii", 7 data bits on the PL011 port).
+Needs pyserial.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+from mb_scatter import crc16
+
+FUNC_READ_INPUT_REGISTERS = 0x04
+
+
+def read_request(unit, start, quantity):
+    pdu = struct.pack(">BBHH", unit, FUNC_READ_INPUT_REGISTERS, start, quantity)
+    return pdu + struct.pack("<H", crc16(pdu))
+
+
+def lrc(data):
+    return -sum(data) & 0xFF
+
+
+def ascii_request(unit, start, quantity):
+    frame = struct.pack(">BBHH", unit, FUNC_READ_INPUT_REGISTERS, start, quantity)
+    return b":" + (frame + bytes([lrc(frame)])).hex().upper().encode() + b"\r\n"
+
+
+def ascii_transact(port, request, expected):
+    port.write(request)
+    reply = port.read_until(b"\n")
+    if not reply.startswith(b":") or not reply.endswith(b"\r\n"):
+        raise IOError("bad or missing reply (%d characters)" % len(reply))
+    frame = bytes.fromhex(reply[1:-2].decode())
+    if lrc(frame) != 0:
+        raise IOError("bad LRC")
+    if frame[1] & 0x80:
+        raise IOError("exception %02X" % frame[2])
+    if len(frame) != expected - 1:
+        raise IOError("short reply (%d bytes)" % len(frame))
+    return frame
+
+
+def transact(port, request, expected):
+    port.write(request)
+    reply = port.read(expected)
+    if len(reply) == 5 and reply[1] & 0x80:
+        raise IOError("exception %02X" % reply[2])
+    if len(reply) != expected or crc16(reply[:-2]) != struct.unpack("<H", reply[-2:])[0]:
+        raise IOError("bad or missing reply (%d bytes)" % len(reply))
+    return reply
+
+
+def main():
+    import serial
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("--unit", type=int, default=255)
+    parser.add_argument("--start", type=int, default=0)
+    parser.add_argument("--quantity", type=int, default=12)
+    parser.add_argument("--count", type=int, default=1000)
+    parser.add_argument("--baud", type=int, default=115200, help="ignored by the USB port")
+    parser.add_argument("--parity", choices="NEO", default="E", help="ignored by the USB port")
+    parser.add_argument("--ascii", action="store_true", help="ASCII framing, RS485 only")
+    parser.add_argument("--timeout", type=float, default=0.5)
+    args = parser.parse_args()
+
+    request = (ascii_request if args.ascii else read_request)(args.unit, args.start, args.quantity)
+    exchange = ascii_transact if args.ascii else transact
+    expected = 5 + 2 * args.quantity
+    latencies = []
+    errors = 0
+    bytesize = serial.SEVENBITS if args.ascii else serial.EIGHTBITS
+    with serial.Serial(args.port, args.baud, bytesize=bytesize, parity=args.parity, timeout=args.timeout) as port:
+        port.reset_input_buffer()
+        began = time.perf_counter()
+        for _ in range(args.count):
+            sent = time.perf_counter()
+            try:
+                exchange(port, request, expected)
+            except IOError as e:
+                errors += 1
+                port.reset_input_buffer()
+                if errors > 10 and errors * 2 > len(latencies):
+                    sys.exit("giving up: %s" % e)
+                continue
+            latencies.append(time.perf_counter() - sent)
+        elapsed = time.perf_counter() - began
+
+    if not latencies:
+        sys.exit("no replies")
+    latencies.sort()
+    print("transactions\t%d (%d errors)" % (len(latencies), errors))
+    print("per second\t%.0f" % (len(latencies) / elapsed))
+    print("latency ms\tmin %.3f  median %.3f  p99 %.3f  max %.3f" % (
+        latencies[0] * 1e3, latencies[len(latencies) // 2] * 1e3,
+        latencies[int(len(latencies) * 0.99)] * 1e3, latencies[-1] * 1e3))
+
+
+if __name__ == "__main__":
+    main()
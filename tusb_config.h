@@ -0,0 +1,18 @@
+#pragma once
+
+// TinyUSB device setup, replacing the SDK stdio_usb descriptors: CDC 0
+// carries the CLI (stdio), CDC 1 carries Modbus RTU frames. CFG_TUSB_MCU and
+// CFG_TUSB_OS come from the SDK tinyusb_device library.
+
+#define CFG_TUSB_RHPORT0_MODE OPT_MODE_DEVICE
+#define CFG_TUD_ENDPOINT0_SIZE 64
+
+#define CFG_TUD_CDC 2
+#define CFG_TUD_MSC 0
+#define CFG_TUD_HID 0
+#define CFG_TUD_MIDI 0
+#define CFG_TUD_VENDOR 0
+
+#define CFG_TUD_CDC_RX_BUFSIZE 256 // one maximum size RTU frame
+#define CFG_TUD_CDC_TX_BUFSIZE 512 // a reply can be queued while the last one is still going out
+#define CFG_TUD_CDC_EP_BUFSIZE 64
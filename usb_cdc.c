@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "usb_cdc.h"
+#include "tusb.h"
+#include "pico/stdlib.h"
+#include "pico/stdio/driver.h"
+#include "pico/bootrom.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "scheduler.h"
+#include "mb_usb.h"
+
+// TinyUSB only ever runs from usb_task(), so the Modbus interface can call
+// into it without the locking the SDK stdio_usb needs. printf() can come from
+// anywhere, a USB callback or an interrupt included, so stdout only goes into
+// s_stdout and usb_task() moves it to the CDC FIFO; whatever does not fit is
+// dropped rather than waited for.
+
+static void (*s_chars_available_cb)(void *) = NULL;
+static void *s_chars_available_param = NULL;
+
+static char s_stdout[USB_STDOUT_BUFFER_SIZE];
+static uint16_t s_stdout_head = 0; // next character to go to the FIFO
+static uint16_t s_stdout_count = 0;
+static uint32_t s_stdout_dropped = 0;
+
+static void usb_stdio_out_chars(const char *buf, int length)
+{
+	if (!tud_cdc_n_connected(USB_CDC_CLI))
+	{
+		return; // nobody listening, drop it like the SDK driver
+	}
+	
+	uint32_t irq_state = save_and_disable_interrupts();
+	for (int i = 0; i < length; i++)
+	{
+		if (s_stdout_count == USB_STDOUT_BUFFER_SIZE)
+		{
+			s_stdout_dropped += length - i;
+			break;
+		}
+		s_stdout[(s_stdout_head + s_stdout_count++) % USB_STDOUT_BUFFER_SIZE] = buf[i];
+	}
+	restore_interrupts(irq_state);
+	sched_post(SCHED_TASK_USB);
+}
+
+static void usb_stdio_out_flush()
+{
+	sched_post(SCHED_TASK_USB); // usb_task() flushes whatever it moves
+}
+
+static void usb_stdout_drain()
+{
+	while (s_stdout_count)
+	{
+		uint16_t count = s_stdout_count; // only grows behind our back
+		if (count > USB_STDOUT_BUFFER_SIZE - s_stdout_head)
+		{
+			count = USB_STDOUT_BUFFER_SIZE - s_stdout_head; // up to the wrap, the rest next time round
+		}
+		uint32_t written = tud_cdc_n_write(USB_CDC_CLI, s_stdout + s_stdout_head, count);
+		if (!written)
+		{
+			break; // FIFO full, the TX complete event posts the task again
+		}
+		uint32_t irq_state = save_and_disable_interrupts();
+		s_stdout_head = (s_stdout_head + written) % USB_STDOUT_BUFFER_SIZE;
+		s_stdout_count -= written;
+		restore_interrupts(irq_state);
+	}
+	tud_cdc_n_write_flush(USB_CDC_CLI);
+}
+
+uint32_t usb_stdout_dropped()
+{
+	return s_stdout_dropped;
+}
+
+static int usb_stdio_in_chars(char *buf, int length)
+{
+	if (!tud_cdc_n_available(USB_CDC_CLI))
+	{
+		return PICO_ERROR_NO_DATA;
+	}
+	return tud_cdc_n_read(USB_CDC_CLI, buf, length);
+}
+
+static void usb_stdio_set_chars_available_callback(void (*fn)(void *), void *param)
+{
+	s_chars_available_cb = fn;
+	s_chars_available_param = param;
+}
+
+stdio_driver_t usb_stdio =
+{
+	.out_chars = usb_stdio_out_chars,
+	.out_flush = usb_stdio_out_flush,
+	.in_chars = usb_stdio_in_chars,
+	.set_chars_available_callback = usb_stdio_set_chars_available_callback,
+#if PICO_STDIO_ENABLE_CRLF_SUPPORT
+	.crlf_enabled = PICO_STDIO_DEFAULT_CRLF
+#endif
+};
+
+static void usb_irq()
+{
+	// Runs after the TinyUSB handler queued the event
+	sched_post(SCHED_TASK_USB);
+}
+
+void usb_init()
+{
+	tusb_init();
+	irq_add_shared_handler(USBCTRL_IRQ, usb_irq, PICO_SHARED_IRQ_HANDLER_LOWEST_ORDER_PRIORITY);
+	stdio_set_driver_enabled(&usb_stdio, true);
+}
+
+void usb_task()
+{
+	tud_task();
+	usb_stdout_drain();
+	mb_usb_task();
+}
+
+void tud_cdc_rx_cb(uint8_t itf)
+{
+	if (itf == USB_CDC_MODBUS)
+	{
+		mb_usb_task();
+	}
+	else if (s_chars_available_cb)
+	{
+		s_chars_available_cb(s_chars_available_param);
+	}
+}
+
+void tud_cdc_line_coding_cb(uint8_t itf, const cdc_line_coding_t *line_coding)
+{
+	// Kept from the SDK driver: opening the CLI port at 1200 baud reboots into BOOTSEL
+	if (itf == USB_CDC_CLI && line_coding->bit_rate == 1200)
+	{
+		reset_usb_boot(0, 0);
+	}
+	if (itf == USB_CDC_MODBUS)
+	{
+		mb_usb_set_mbap(line_coding->bit_rate == MB_USB_MBAP_BAUD);
+	}
+}
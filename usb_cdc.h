@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdio/driver.h"
+
+#define USB_CDC_CLI 0
+#define USB_CDC_MODBUS 1
+
+#define USB_TASK_INTERVAL_US 10000 // backstop, the USB interrupt posts the task for every event
+#define USB_STDOUT_BUFFER_SIZE 4096 // printf output waiting for usb_task(), more than that is dropped
+
+#define USB_VID 0x2E8A // Raspberry Pi
+#define USB_PID 0x000A // Pico SDK CDC, bcdDevice tells the two interface layout apart
+#define USB_BCD_DEVICE 0x0200
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	
+	extern stdio_driver_t usb_stdio; // CLI interface
+	
+	// Starts the device and hooks the CLI interface up as stdio
+	void usb_init();
+	
+	// Runs TinyUSB, every USB callback happens from here in task context
+	void usb_task();
+	
+	// Characters printf() dropped because the host was not reading fast enough
+	uint32_t usb_stdout_dropped();
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <string.h>
+#include "tusb.h"
+#include "pico/unique_id.h"
+#include "usb_cdc.h"
+
+enum USB_INTERFACES
+{
+	ITF_NUM_CLI,
+	ITF_NUM_CLI_DATA,
+	ITF_NUM_MODBUS,
+	ITF_NUM_MODBUS_DATA,
+	ITF_NUM_TOTAL
+};
+
+enum USB_STRINGS
+{
+	STRID_LANGID,
+	STRID_MANUFACTURER,
+	STRID_PRODUCT,
+	STRID_SERIAL,
+	STRID_CLI,
+	STRID_MODBUS
+};
+
+#define EPNUM_CLI_NOTIF 0x81
+#define EPNUM_CLI_OUT 0x02
+#define EPNUM_CLI_IN 0x82
+#define EPNUM_MODBUS_NOTIF 0x83
+#define EPNUM_MODBUS_OUT 0x04
+#define EPNUM_MODBUS_IN 0x84
+
+#define USB_CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + CFG_TUD_CDC * TUD_CDC_DESC_LEN)
+#define USB_MAX_POWER_MA 250
+
+static const tusb_desc_device_t s_device_descriptor =
+{
+	.bLength = sizeof(tusb_desc_device_t),
+	.bDescriptorType = TUSB_DESC_DEVICE,
+	.bcdUSB = 0x0200,
+	// IAD, each CDC pairs a control and a data interface
+	.bDeviceClass = TUSB_CLASS_MISC,
+	.bDeviceSubClass = MISC_SUBCLASS_COMMON,
+	.bDeviceProtocol = MISC_PROTOCOL_IAD,
+	.bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
+	.idVendor = USB_VID,
+	.idProduct = USB_PID,
+	.bcdDevice = USB_BCD_DEVICE,
+	.iManufacturer = STRID_MANUFACTURER,
+	.iProduct = STRID_PRODUCT,
+	.iSerialNumber = STRID_SERIAL,
+	.bNumConfigurations = 1
+};
+
+static const uint8_t s_configuration_descriptor[] =
+{
+	TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, USB_CONFIG_TOTAL_LEN, 0, USB_MAX_POWER_MA),
+	TUD_CDC_DESCRIPTOR(ITF_NUM_CLI, STRID_CLI, EPNUM_CLI_NOTIF, 8, EPNUM_CLI_OUT, EPNUM_CLI_IN, CFG_TUD_CDC_EP_BUFSIZE),
+	TUD_CDC_DESCRIPTOR(ITF_NUM_MODBUS, STRID_MODBUS, EPNUM_MODBUS_NOTIF, 8, EPNUM_MODBUS_OUT, EPNUM_MODBUS_IN, CFG_TUD_CDC_EP_BUFSIZE)
+};
+
+static const char *s_strings[] =
+{
+	NULL, // language, answered separately
+	"Raspberry Pi",
+	"Modbus Endpoint",
+	NULL, // serial, the flash unique id
+	"Modbus Endpoint CLI",
+	"Modbus Endpoint RTU"
+};
+
+static uint16_t s_string_descriptor[32];
+
+const uint8_t *tud_descriptor_device_cb(void)
+{
+	return (const uint8_t *)&s_device_descriptor;
+}
+
+const uint8_t *tud_descriptor_configuration_cb(uint8_t index)
+{
+	return s_configuration_descriptor;
+}
+
+const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+	char serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+	uint8_t length;
+	if (index == STRID_LANGID)
+	{
+		s_string_descriptor[1] = 0x0409; // English
+		length = 1;
+	}
+	else
+	{
+		const char *str;
+		if (index == STRID_SERIAL)
+		{
+			pico_get_unique_board_id_string(serial, sizeof(serial));
+			str = serial;
+		}
+		else if (index < sizeof(s_strings) / sizeof(s_strings[0]))
+		{
+			str = s_strings[index];
+		}
+		else
+		{
+			return NULL;
+		}
+		
+		length = strlen(str);
+		if (length > 31)
+		{
+			length = 31;
+		}
+		for (uint8_t i = 0; i < length; i++)
+		{
+			s_string_descriptor[1 + i] = str[i];
+		}
+	}
+	
+	s_string_descriptor[0] = (TUSB_DESC_STRING << 8) | (2 * length + 2);
+	return s_string_descriptor;
+}
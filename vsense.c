@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "config.h"
+#include "vsense.h"
+#include "pico/stdlib.h"
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "mb.h"
+
+#define VSENSE_RING_BYTES (VSENSE_RING_SAMPLES * sizeof(uint16_t))
+#define VSENSE_RING_MASK (VSENSE_RING_SAMPLES - 1)
+#define VSENSE_AVERAGE_SHIFT 4 // log2(VSENSE_BLOCK_SAMPLES / VSENSE_CHANNEL_COUNT)
+#define VSENSE_ADC_CLOCK_HZ 48000000
+#define VSENSE_ADC_FIRST_INPUT (VSENSE_5V_PIN - 26)
+
+// millivolts per averaged 12-bit count in Q16, folded at compile time so the block step is one multiply
+#define VSENSE_SCALE_Q16(num, den) ((uint32_t)(((uint64_t)VSENSE_ADC_VREF_MV * (num) << 16) / (4096ULL * (den))))
+
+static const uint32_t s_scale_q16[VSENSE_CHANNEL_COUNT] =
+{
+	VSENSE_SCALE_Q16(VSENSE_5V_DIVIDER_NUM, VSENSE_5V_DIVIDER_DEN),
+	VSENSE_SCALE_Q16(VSENSE_12V_DIVIDER_NUM, VSENSE_12V_DIVIDER_DEN)
+};
+
+static uint16_t s_samples[VSENSE_RING_SAMPLES] __attribute__((aligned(VSENSE_RING_BYTES)));
+static uint16_t s_read_index = 0;
+static int s_dma_a;
+static int s_dma_b;
+
+static uint16_t s_mv[VSENSE_CHANNEL_COUNT] = { 0 };
+static uint16_t s_mv_min[VSENSE_CHANNEL_COUNT] = { UINT16_MAX, UINT16_MAX };
+static uint16_t s_mv_max[VSENSE_CHANNEL_COUNT] = { 0 };
+static uint32_t s_blocks = 0;
+
+static void vsense_dma_setup(int channel, int chain_to)
+{
+	dma_channel_config c = dma_channel_get_default_config(channel);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_ring(&c, true, __builtin_ctz(VSENSE_RING_BYTES));
+	channel_config_set_dreq(&c, DREQ_ADC);
+	channel_config_set_chain_to(&c, chain_to);
+	dma_channel_configure(channel, &c, s_samples, &adc_hw->fifo, VSENSE_RING_SAMPLES, false);
+}
+
+void vsense_init()
+{
+	adc_init();
+	adc_gpio_init(VSENSE_5V_PIN);
+	adc_gpio_init(VSENSE_12V_PIN);
+	adc_select_input(VSENSE_ADC_FIRST_INPUT);
+	adc_set_round_robin((1 << VSENSE_ADC_FIRST_INPUT) | (1 << (VSENSE_ADC_FIRST_INPUT + 1)));
+	adc_fifo_setup(true, true, 1, false, false);
+	adc_set_clkdiv((float)VSENSE_ADC_CLOCK_HZ / VSENSE_SAMPLE_RATE_HZ - 1);
+	
+	// Two channels chained to each other each fill the whole ring, so the
+	// capture runs forever without CPU involvement
+	s_dma_a = dma_claim_unused_channel(true);
+	s_dma_b = dma_claim_unused_channel(true);
+	vsense_dma_setup(s_dma_a, s_dma_b);
+	vsense_dma_setup(s_dma_b, s_dma_a);
+	
+	dma_channel_start(s_dma_a);
+	adc_run(true);
+}
+
+static uint16_t vsense_write_index()
+{
+	int active = dma_channel_is_busy(s_dma_b) ? s_dma_b : s_dma_a;
+	uint32_t write_addr = dma_hw->ch[active].write_addr;
+	return ((write_addr - (uintptr_t)s_samples) / sizeof(uint16_t)) & VSENSE_RING_MASK;
+}
+
+void vsense_update()
+{
+	uint16_t write_index = vsense_write_index();
+	
+	while (((write_index - s_read_index) & VSENSE_RING_MASK) >= VSENSE_BLOCK_SAMPLES)
+	{
+		// Even ring slots hold the 5V channel, odd slots the 12V channel
+		uint32_t sum[VSENSE_CHANNEL_COUNT] = { 0 };
+		for (uint16_t i = 0; i < VSENSE_BLOCK_SAMPLES; i += VSENSE_CHANNEL_COUNT)
+		{
+			sum[VSENSE_5V] += s_samples[(s_read_index + i) & VSENSE_RING_MASK];
+			sum[VSENSE_12V] += s_samples[(s_read_index + i + 1) & VSENSE_RING_MASK];
+		}
+		s_read_index = (s_read_index + VSENSE_BLOCK_SAMPLES) & VSENSE_RING_MASK;
+		
+		for (uint8_t ch = 0; ch < VSENSE_CHANNEL_COUNT; ch++)
+		{
+			uint32_t average = sum[ch] >> VSENSE_AVERAGE_SHIFT;
+			s_mv[ch] = (uint16_t)((average * s_scale_q16[ch]) >> 16);
+			if (s_mv[ch] < s_mv_min[ch]) { s_mv_min[ch] = s_mv[ch]; }
+			if (s_mv[ch] > s_mv_max[ch]) { s_mv_max[ch] = s_mv[ch]; }
+		}
+		s_blocks++;
+	}
+	
+	mb_set_input_register(MB_IR_VSENSE_5V, s_mv[VSENSE_5V]);
+	mb_set_input_register(MB_IR_VSENSE_12V, s_mv[VSENSE_12V]);
+}
+
+uint16_t vsense_get_mv(uint8_t channel)
+{
+	return channel < VSENSE_CHANNEL_COUNT ? s_mv[channel] : 0;
+}
+
+void vsense_print_stats()
+{
+	printf("** VOLTAGE SENSE STATISTICS **\r\n");
+	printf("5V RAIL\t\t= %u mV (min %u, max %u)\r\n", s_mv[VSENSE_5V], s_mv_min[VSENSE_5V], s_mv_max[VSENSE_5V]);
+	printf("12V RAIL\t= %u mV (min %u, max %u)\r\n", s_mv[VSENSE_12V], s_mv_min[VSENSE_12V], s_mv_max[VSENSE_12V]);
+	printf("BLOCKS\t\t= %lu\r\n", s_blocks);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#define VSENSE_SAMPLE_RATE_HZ 4000 // total ADC rate, shared round-robin between both channels
+#define VSENSE_RING_SAMPLES 512 // must be a power of 2, DMA ring wraps on the byte size
+#define VSENSE_BLOCK_SAMPLES 32 // samples averaged per published value (half per channel)
+#define VSENSE_UPDATE_INTERVAL_US 10000 // scheduler period, must stay well below the ring duration
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	
+	enum VSENSE_CHANNELS
+	{
+		VSENSE_5V,
+		VSENSE_12V,
+		VSENSE_CHANNEL_COUNT
+	};
+
+	void vsense_init();
+	
+	void vsense_update();
+	
+	uint16_t vsense_get_mv(uint8_t channel);
+	
+	void vsense_print_stats();
+
+#ifdef __cplusplus
+}
+#endif